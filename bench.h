@@ -0,0 +1,477 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sexpr.h"
+#include "utils.h"
+#include "binary.h"
+
+// ==================== BENCHMARK SUITE ====================
+
+// Each workload is timed in repetitions of a calibrated number of operations,
+// after a few warmup repetitions. The report is one tab-separated line per
+// workload so results from different interpreter versions can be diffed.
+
+#define BENCH_WARMUPS 2
+#define BENCH_REPS 7
+#define BENCH_TARGET_NS 20000000ULL // aim for ~20ms per repetition
+
+typedef enum BenchKind
+{
+    BENCH_EVAL,  // evaluate expr
+    BENCH_PARSE, // parse expr from text
+    BENCH_PRINT, // print the value of expr into a buffer
+} BenchKind;
+
+typedef struct BenchCase
+{
+    const char *name;
+    BenchKind kind;
+    const char *setup; // definitions evaluated once before timing
+    const char *expr;
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+    {"fib", BENCH_EVAL,
+     "(define (fib n) (if (eq (lt n 2) 1) n (add (fib (sub n 1)) (fib (sub n 2)))))",
+     "(fib 15)"},
+    {"tak", BENCH_EVAL,
+     "(define (tak x y z) (if (eq (lt y x) 1) (tak (tak (sub x 1) y z) (tak (sub y 1) z x) (tak (sub z 1) x y)) z))",
+     "(tak 12 8 4)"},
+    {"ackermann", BENCH_EVAL,
+     "(define (ack m n) (cond ((eq m 0) (add n 1)) ((eq n 0) (ack (sub m 1) 1)) (else (ack (sub m 1) (ack m (sub n 1))))))",
+     "(ack 2 3)"},
+    {"list-build", BENCH_EVAL,
+     "(define (build n acc) (if (eq n 0) acc (build (sub n 1) (cons n acc))))",
+     "(build 500 '())"},
+    {"list-traverse", BENCH_EVAL,
+     "(define (build n acc) (if (eq n 0) acc (build (sub n 1) (cons n acc))))"
+     "(define (sum-list l) (if (nil? l) 0 (add (car l) (sum-list (cdr l)))))"
+     "(define big (build 500 '()))",
+     "(sum-list big)"},
+    {"twice", BENCH_EVAL,
+     "(define (twice f x) (f (f x)))"
+     "(define (add3 n) (add n 3))",
+     "(twice add3 10)"},
+    {"compose", BENCH_EVAL,
+     "(define (compose-apply f g x) (f (g x)))"
+     "(define (add3 n) (add n 3))"
+     "(define (dbl n) (mul n 2))",
+     "(compose-apply add3 dbl 10)"},
+    {"env-lookup", BENCH_EVAL,
+     "(define (inner n) (if (eq n 0) (add x0 (add x1 x2)) (inner (sub n 1))))"
+     "(define (outer x0 x1 x2) (inner 40))",
+     "(outer 1 2 3)"},
+    {"string", BENCH_EVAL,
+     "(define (count-str l s acc) (if (nil? l) acc (count-str (cdr l) s (if (eq (car l) s) (add acc 1) acc))))"
+     "(define words '(\"alpha\" \"beta\" \"gamma\" \"alpha\" \"delta\" \"alpha\" \"epsilon\" \"zeta\"))",
+     "(count-str words \"alpha\" 0)"},
+    {"parse", BENCH_PARSE, "",
+     "(define (tak x y z) (if (eq (lt y x) 1) (tak (tak (sub x 1) y z) (tak (sub y 1) z x) (tak (sub z 1) x y)) z))"},
+    {"print", BENCH_PRINT,
+     "(define (build n acc) (if (eq n 0) acc (build (sub n 1) (cons (cons n \"leaf\") acc))))"
+     "(define big (build 200 '()))",
+     "big"},
+};
+
+static unsigned long long bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void bench_op(const BenchCase *bench, SExpr *expr, SExpr *value, Env *env, char *buf, size_t size)
+{
+    switch (bench->kind)
+    {
+    case BENCH_EVAL:
+        eval(expr, env);
+        break;
+    case BENCH_PARSE:
+    {
+        const char *ptr = bench->expr;
+        parseSExpr(&ptr);
+        break;
+    }
+    case BENCH_PRINT:
+        sexp_to_string(value, buf, size);
+        break;
+    }
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void runBench()
+{
+    size_t buf_size = 1 << 20;
+    char *buf = malloc(buf_size);
+    int n = sizeof(bench_cases) / sizeof(bench_cases[0]);
+
+    printf("# yisp bench v1: %d warmups, %d repetitions\n", BENCH_WARMUPS, BENCH_REPS);
+    printf("# name\titerations\tmedian_ns\tmin_ns\tallocs_per_op\n");
+
+    for (int i = 0; i < n; i++)
+    {
+        const BenchCase *bench = &bench_cases[i];
+        Env *env = make_env(NULL);
+
+        const char *ptr = bench->setup;
+        skipWhitespace(&ptr);
+        while (*ptr)
+        {
+            eval(parseSExpr(&ptr), env);
+            skipWhitespace(&ptr);
+        }
+
+        ptr = bench->expr;
+        SExpr *expr = parseSExpr(&ptr);
+        SExpr *value = bench->kind == BENCH_PRINT ? eval(expr, env) : NULL;
+
+        // Calibrate the number of operations per repetition from a single run
+        unsigned long long start = bench_now_ns();
+        bench_op(bench, expr, value, env, buf, buf_size);
+        unsigned long long single = bench_now_ns() - start;
+        unsigned long iterations = single ? (unsigned long)(BENCH_TARGET_NS / single) : 100000;
+        if (iterations == 0)
+            iterations = 1;
+
+        double samples[BENCH_REPS];
+        unsigned long allocs = 0;
+
+        for (int rep = -BENCH_WARMUPS; rep < BENCH_REPS; rep++)
+        {
+            unsigned long objects = interp->heap_stats.total_objects;
+            start = bench_now_ns();
+            for (unsigned long it = 0; it < iterations; it++)
+                bench_op(bench, expr, value, env, buf, buf_size);
+            unsigned long long elapsed = bench_now_ns() - start;
+
+            if (rep >= 0)
+            {
+                samples[rep] = (double)elapsed / iterations;
+                allocs += interp->heap_stats.total_objects - objects;
+            }
+        }
+
+        qsort(samples, BENCH_REPS, sizeof(double), bench_compare);
+        printf("%s\t%lu\t%.1f\t%.1f\t%.1f\n", bench->name, iterations, samples[BENCH_REPS / 2], samples[0],
+               (double)allocs / ((double)iterations * BENCH_REPS));
+        fflush(stdout);
+    }
+
+    free(buf);
+}
+
+// ==================== READER/PRINTER BENCHMARK ====================
+
+// Generates deterministic synthetic corpora of a requested size and measures
+// parseSExpr, fprintSExpr, sexp_to_string and a print/parse round trip on
+// each. Throughput is reported in MB of source text per second, except for
+// the binary encoding, which is measured in MB of encoded bytes per second
+// next to a plain memcpy of the same bytes.
+
+typedef enum CorpusKind
+{
+    CORPUS_DEEP,    // deeply nested lists
+    CORPUS_WIDE,    // long flat lists
+    CORPUS_NUMBERS, // numeric tables
+    CORPUS_STRINGS, // long string literals
+    CORPUS_SYMBOLS, // symbol-heavy code
+    CORPUS_KINDS,
+} CorpusKind;
+
+static const char *corpus_names[CORPUS_KINDS] = {"deep", "wide", "numbers", "strings", "symbols"};
+
+typedef struct CorpusBuffer
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} CorpusBuffer;
+
+static unsigned long corpus_seed = 88172645463325252UL;
+
+static unsigned long corpus_rand()
+{
+    corpus_seed ^= corpus_seed << 13;
+    corpus_seed ^= corpus_seed >> 7;
+    corpus_seed ^= corpus_seed << 17;
+    return corpus_seed;
+}
+
+static void corpus_put(CorpusBuffer *buf, const char *fmt, ...)
+{
+    va_list args;
+    for (;;)
+    {
+        va_start(args, fmt);
+        int written = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (written >= 0 && (size_t)written < buf->cap - buf->len)
+        {
+            buf->len += (size_t)written;
+            return;
+        }
+
+        buf->cap = buf->cap * 2 + (size_t)written + 1;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+}
+
+// Appends one top-level form of the given shape
+static void corpus_form(CorpusBuffer *buf, CorpusKind kind)
+{
+    switch (kind)
+    {
+    case CORPUS_DEEP:
+    {
+        int depth = 200 + (int)(corpus_rand() % 300);
+        for (int i = 0; i < depth; i++)
+            corpus_put(buf, "(n%d ", i % 10);
+        corpus_put(buf, "leaf");
+        for (int i = 0; i < depth; i++)
+            corpus_put(buf, ")");
+        break;
+    }
+    case CORPUS_WIDE:
+        corpus_put(buf, "(");
+        for (int i = 0; i < 4096; i++)
+            corpus_put(buf, i ? " %lu" : "%lu", corpus_rand() % 100000);
+        corpus_put(buf, ")");
+        break;
+    case CORPUS_NUMBERS:
+        corpus_put(buf, "(");
+        for (int row = 0; row < 64; row++)
+        {
+            corpus_put(buf, "(%lu", corpus_rand() % 1000000);
+            for (int col = 0; col < 8; col++)
+                corpus_put(buf, " %.4f", (double)(corpus_rand() % 2000000) / 1000.0 - 1000.0);
+            corpus_put(buf, ")");
+        }
+        corpus_put(buf, ")");
+        break;
+    case CORPUS_STRINGS:
+    {
+        int len = 1024 + (int)(corpus_rand() % 3072);
+        corpus_put(buf, "(\"");
+        for (int i = 0; i < len; i++)
+            corpus_put(buf, "%c", "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"[corpus_rand() % 63]);
+        corpus_put(buf, "\")");
+        break;
+    }
+    case CORPUS_SYMBOLS:
+        corpus_put(buf, "(define (rule-%lu record) (cond ((eq (field-%lu record) 'status-%lu) (score-%lu record))"
+                        " ((gt (weight-%lu record) limit-%lu) (penalty-%lu record)) (else default-%lu)))",
+                   corpus_rand() % 5000, corpus_rand() % 200, corpus_rand() % 50, corpus_rand() % 300,
+                   corpus_rand() % 200, corpus_rand() % 50, corpus_rand() % 300, corpus_rand() % 20);
+        break;
+    default:
+        break;
+    }
+    corpus_put(buf, "\n");
+}
+
+static CorpusBuffer corpus_generate(CorpusKind kind, size_t size)
+{
+    CorpusBuffer buf;
+    buf.cap = size + 65536;
+    buf.len = 0;
+    buf.data = malloc(buf.cap);
+    buf.data[0] = '\0';
+
+    corpus_seed = 88172645463325252UL + (unsigned long)kind;
+    while (buf.len < size)
+        corpus_form(&buf, kind);
+
+    return buf;
+}
+
+// getrusage's ru_maxrss is the high-water mark of the whole process and is
+// never reset, so it cannot give the peak of one corpus after a larger one.
+// Linux resets the mark through /proc/self/clear_refs and reports it as VmHWM.
+static bool bench_peak_reset()
+{
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (!file)
+        return false;
+    bool ok = fputs("5", file) >= 0;
+    return fclose(file) == 0 && ok;
+}
+
+// Peak resident set since the last reset in kB, or -1 if it is unknown
+static long bench_peak_rss_kb()
+{
+    FILE *file = fopen("/proc/self/status", "r");
+    if (!file)
+        return -1;
+    char line[256];
+    long peak = -1;
+    while (fgets(line, sizeof(line), file))
+        if (strncmp(line, "VmHWM:", 6) == 0)
+            peak = atol(line + 6);
+    fclose(file);
+    return peak;
+}
+
+static size_t bench_parse_all(const char *text, SExpr ***forms_out)
+{
+    size_t count = 0;
+    size_t cap = 1024;
+    SExpr **forms = malloc(cap * sizeof(SExpr *));
+
+    const char *ptr = text;
+    skipWhitespace(&ptr);
+    while (*ptr)
+    {
+        if (count == cap)
+        {
+            cap *= 2;
+            forms = realloc(forms, cap * sizeof(SExpr *));
+        }
+        forms[count++] = parseSExpr(&ptr);
+        skipWhitespace(&ptr);
+    }
+
+    *forms_out = forms;
+    return count;
+}
+
+static double bench_mbps(size_t bytes, unsigned long long ns)
+{
+    return ns ? (double)bytes / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0.0;
+}
+
+// Parses a size such as 4096, 64K, 16M or 1G
+size_t bench_parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        value *= 1024.0;
+        // fall through
+    case 'M':
+        value *= 1024.0;
+        // fall through
+    case 'K':
+        value *= 1024.0;
+        break;
+    default:
+        break;
+    }
+    return value > 0 ? (size_t)value : 0;
+}
+
+void runReaderBench(size_t size)
+{
+    FILE *sink = fopen("/dev/null", "w");
+    static char sink_buffer[1 << 16];
+    setvbuf(sink, sink_buffer, _IOFBF, sizeof(sink_buffer));
+
+    // Each corpus runs in a fresh interpreter, freed afterwards, so its peak
+    // is not inflated by the arenas of the corpora before it
+    Interp *saved = interp;
+
+    printf("# yisp reader bench v3: %zu bytes per corpus\n", size);
+    printf("# peak_rss_kb: peak resident set while the corpus ran, -1 where it cannot be reset\n");
+    printf("# corpus\tbytes\tforms\tparse_MBps\tprint_MBps\tto_string_MBps\troundtrip_MBps\tparse_heap_bytes\t"
+           "binary_bytes\tbinary_write_MBps\tbinary_read_MBps\tmemcpy_MBps\tpeak_rss_kb\n");
+
+    for (int kind = 0; kind < CORPUS_KINDS; kind++)
+    {
+        Interp *in = interp_new();
+        interp_enter(in);
+        bool peak_known = bench_peak_reset();
+
+        CorpusBuffer corpus = corpus_generate((CorpusKind)kind, size);
+
+        // Parse
+        SExpr **forms;
+        unsigned long heap_before = interp->heap_stats.live_bytes;
+        unsigned long long start = bench_now_ns();
+        size_t count = bench_parse_all(corpus.data, &forms);
+        unsigned long long parse_ns = bench_now_ns() - start;
+        unsigned long parse_heap = interp->heap_stats.live_bytes - heap_before;
+
+        // Print to a stream
+        start = bench_now_ns();
+        for (size_t i = 0; i < count; i++)
+        {
+            fprintSExpr(sink, forms[i]);
+            fputc('\n', sink);
+        }
+        fflush(sink);
+        unsigned long long print_ns = bench_now_ns() - start;
+
+        // Print into a string buffer, one form at a time
+        size_t text_size = corpus.len + 1;
+        char *text = malloc(text_size);
+        start = bench_now_ns();
+        for (size_t i = 0; i < count; i++)
+            sexp_to_string(forms[i], text, text_size);
+        unsigned long long to_string_ns = bench_now_ns() - start;
+
+        // Round trip: print each form and parse it back
+        start = bench_now_ns();
+        for (size_t i = 0; i < count; i++)
+        {
+            sexp_to_string(forms[i], text, text_size);
+            const char *ptr = text;
+            parseSExpr(&ptr);
+        }
+        unsigned long long roundtrip_ns = bench_now_ns() - start;
+
+        // Binary encoding of all forms as one stream, decoded back
+        BinaryWriter writer = {0};
+        start = bench_now_ns();
+        binary_reserve(&writer, BINARY_MAGIC_LEN);
+        memcpy(writer.buf, BINARY_MAGIC, BINARY_MAGIC_LEN);
+        writer.len = BINARY_MAGIC_LEN;
+        for (size_t i = 0; i < count; i++)
+            binary_write(&writer, forms[i]);
+        unsigned long long write_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        binary_decode((const char *)writer.buf, writer.len);
+        unsigned long long read_ns = bench_now_ns() - start;
+
+        char *copy = malloc(writer.len);
+        start = bench_now_ns();
+        memcpy(copy, writer.buf, writer.len);
+        unsigned long long memcpy_ns = bench_now_ns() - start;
+        volatile char keep = copy[writer.len / 2];
+        (void)keep;
+
+        printf("%s\t%zu\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\t%lu\t%zu\t%.1f\t%.1f\t%.1f\t%ld\n", corpus_names[kind],
+               corpus.len, count, bench_mbps(corpus.len, parse_ns), bench_mbps(corpus.len, print_ns),
+               bench_mbps(corpus.len, to_string_ns), bench_mbps(corpus.len, roundtrip_ns), parse_heap, writer.len,
+               bench_mbps(writer.len, write_ns), bench_mbps(writer.len, read_ns), bench_mbps(writer.len, memcpy_ns),
+               peak_known ? bench_peak_rss_kb() : -1L);
+        fflush(stdout);
+
+        free(copy);
+        binary_writer_free(&writer);
+        free(text);
+        free(forms);
+        free(corpus.data);
+        interp_free(in);
+        interp_enter(saved);
+    }
+
+    fclose(sink);
+}
+
+#endif // BENCH_H
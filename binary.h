@@ -0,0 +1,500 @@
+#ifndef BINARY_H
+#define BINARY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sexpr.h"
+#include "utils.h"
+
+// ==================== BINARY FORMAT ====================
+
+// Compact, lossless encoding of S-expressions for exchanging data between
+// programs. A stream is BINARY_MAGIC followed by any number of values:
+//
+//     BIN_NIL
+//     BIN_INT      zigzag varint          integral numbers
+//     BIN_DOUBLE   8 bytes, little-endian every other number, bit-exact
+//     BIN_STRING   varint length, bytes
+//     BIN_SYMBOL   varint length, bytes   first use; gets the next symbol id
+//     BIN_SYMREF   varint symbol id
+//     BIN_LIST     varint n, n values, tail value
+//     BIN_BACKREF  varint object id
+//
+// Strings and the n cells of every BIN_LIST (numbered before its elements)
+// get object ids in stream order, so structure that appears twice is written
+// once and read back shared. Symbol and object ids span the whole stream.
+
+#define BINARY_MAGIC "\0YSB\1"
+#define BINARY_MAGIC_LEN 5
+
+typedef enum BinaryTag
+{
+    BIN_NIL,
+    BIN_INT,
+    BIN_DOUBLE,
+    BIN_STRING,
+    BIN_SYMBOL,
+    BIN_SYMREF,
+    BIN_LIST,
+    BIN_BACKREF,
+} BinaryTag;
+
+typedef struct BinaryWriter
+{
+    uint8_t *buf;
+    size_t len;
+    size_t capacity;
+
+    // Symbols and shared objects already written, keyed by address
+    SExpr **keys;
+    uint64_t *ids;
+    size_t count;
+    size_t table_capacity;
+    uint64_t symbol_count;
+    uint64_t object_count;
+} BinaryWriter;
+
+typedef struct BinaryReader
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+
+    SExpr **symbols;
+    size_t symbol_count;
+    size_t symbol_capacity;
+    SExpr **objects;
+    size_t object_count;
+    size_t object_capacity;
+
+    // Id ranges of the lists still being read, innermost last
+    size_t *open;
+    size_t open_depth;
+    size_t open_capacity;
+} BinaryReader;
+
+static void binary_reserve(BinaryWriter *w, size_t bytes)
+{
+    if (w->len + bytes <= w->capacity)
+        return;
+    while (w->len + bytes > w->capacity)
+        w->capacity = w->capacity ? w->capacity * 2 : 4096;
+    w->buf = realloc(w->buf, w->capacity);
+}
+
+static void binary_byte(BinaryWriter *w, uint8_t byte)
+{
+    binary_reserve(w, 1);
+    w->buf[w->len++] = byte;
+}
+
+static void binary_varint(BinaryWriter *w, uint64_t value)
+{
+    binary_reserve(w, 10);
+    while (value >= 0x80)
+    {
+        w->buf[w->len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    w->buf[w->len++] = (uint8_t)value;
+}
+
+static void binary_bytes(BinaryWriter *w, const char *bytes, size_t len)
+{
+    binary_varint(w, len);
+    binary_reserve(w, len);
+    memcpy(w->buf + w->len, bytes, len);
+    w->len += len;
+}
+
+// Slot of key in the writer's table; ids are stored +1 so that 0 means absent
+static size_t binary_slot(BinaryWriter *w, SExpr *key)
+{
+    size_t h = (size_t)key;
+    size_t slot = ((h >> 3) ^ (h >> 17)) & (w->table_capacity - 1);
+    while (w->keys[slot] && w->keys[slot] != key)
+        slot = (slot + 1) & (w->table_capacity - 1);
+    return slot;
+}
+
+static uint64_t binary_lookup(BinaryWriter *w, SExpr *key)
+{
+    if (!w->table_capacity)
+        return 0;
+    size_t slot = binary_slot(w, key);
+    return w->keys[slot] ? w->ids[slot] : 0;
+}
+
+static void binary_remember(BinaryWriter *w, SExpr *key, uint64_t id)
+{
+    if ((w->count + 1) * 2 > w->table_capacity)
+    {
+        SExpr **old_keys = w->keys;
+        uint64_t *old_ids = w->ids;
+        size_t old_capacity = w->table_capacity;
+
+        w->table_capacity = old_capacity ? old_capacity * 2 : 1024;
+        w->keys = calloc(w->table_capacity, sizeof(SExpr *));
+        w->ids = malloc(w->table_capacity * sizeof(uint64_t));
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (!old_keys[i])
+                continue;
+            size_t slot = binary_slot(w, old_keys[i]);
+            w->keys[slot] = old_keys[i];
+            w->ids[slot] = old_ids[i];
+        }
+        free(old_keys);
+        free(old_ids);
+    }
+
+    size_t slot = binary_slot(w, key);
+    w->keys[slot] = key;
+    w->ids[slot] = id + 1;
+    w->count++;
+}
+
+static void binary_write(BinaryWriter *w, SExpr *x)
+{
+    if (!x || x->type == TYPE_NIL)
+    {
+        binary_byte(w, BIN_NIL);
+        return;
+    }
+
+    uint64_t seen = binary_lookup(w, x);
+    if (seen)
+    {
+        binary_byte(w, x->type == TYPE_ATOM_SYMBOL ? BIN_SYMREF : BIN_BACKREF);
+        binary_varint(w, seen - 1);
+        return;
+    }
+
+    switch (x->type)
+    {
+    case TYPE_ATOM_NUMBER:
+    {
+        double value = x->number;
+        if (value >= -9.0e18 && value <= 9.0e18 && value == (double)(int64_t)value && !(value == 0 && signbit(value)))
+        {
+            int64_t n = (int64_t)value;
+            binary_byte(w, BIN_INT);
+            binary_varint(w, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+        }
+        else
+        {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            binary_byte(w, BIN_DOUBLE);
+            binary_reserve(w, 8);
+            for (int i = 0; i < 8; i++)
+                w->buf[w->len++] = (uint8_t)(bits >> (8 * i));
+        }
+        break;
+    }
+
+    case TYPE_ATOM_STRING:
+        binary_byte(w, BIN_STRING);
+        binary_bytes(w, x->string, strlen(x->string));
+        binary_remember(w, x, w->object_count++);
+        break;
+
+    case TYPE_ATOM_SYMBOL:
+        binary_byte(w, BIN_SYMBOL);
+        binary_bytes(w, x->string, strlen(x->string));
+        binary_remember(w, x, w->symbol_count++);
+        break;
+
+    case TYPE_CONS:
+    {
+        // Number the spine up to the first cell already written
+        uint64_t n = 0;
+        SExpr *tail = x;
+        while (tail->type == TYPE_CONS && (n == 0 || !binary_lookup(w, tail)))
+        {
+            binary_remember(w, tail, w->object_count++);
+            tail = tail->cons.cdr;
+            n++;
+        }
+
+        binary_byte(w, BIN_LIST);
+        binary_varint(w, n);
+        SExpr *it = x;
+        for (uint64_t i = 0; i < n; i++, it = it->cons.cdr)
+            binary_write(w, it->cons.car);
+        binary_write(w, tail);
+        break;
+    }
+
+    default:
+        yisp_error("write-binary: cannot encode value");
+    }
+}
+
+static void binary_writer_free(BinaryWriter *w)
+{
+    free(w->buf);
+    free(w->keys);
+    free(w->ids);
+}
+
+static uint8_t binary_read_byte(BinaryReader *r)
+{
+    if (r->pos >= r->end)
+        yisp_error("read-binary: truncated input");
+    return *r->pos++;
+}
+
+static uint64_t binary_read_varint(BinaryReader *r)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t byte = binary_read_byte(r);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    yisp_error("read-binary: malformed varint");
+}
+
+static const char *binary_read_bytes(BinaryReader *r, size_t *len)
+{
+    *len = binary_read_varint(r);
+    if (*len > (size_t)(r->end - r->pos))
+        yisp_error("read-binary: truncated input");
+    const char *bytes = (const char *)r->pos;
+    r->pos += *len;
+    return bytes;
+}
+
+static void binary_push(SExpr ***table, size_t *count, size_t *capacity, SExpr *value)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *table = realloc(*table, *capacity * sizeof(SExpr *));
+    }
+    (*table)[(*count)++] = value;
+}
+
+static SExpr *binary_read(BinaryReader *r)
+{
+    // Nesting recurses, so a deep stream must not overflow the stack
+    STACK_CHECK();
+    uint8_t tag = binary_read_byte(r);
+    switch (tag)
+    {
+    case BIN_NIL:
+        return nil();
+
+    case BIN_INT:
+    {
+        uint64_t zigzag = binary_read_varint(r);
+        return number((double)(int64_t)((zigzag >> 1) ^ -(zigzag & 1)));
+    }
+
+    case BIN_DOUBLE:
+    {
+        if (r->end - r->pos < 8)
+            yisp_error("read-binary: truncated input");
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++)
+            bits |= (uint64_t)r->pos[i] << (8 * i);
+        r->pos += 8;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return number(value);
+    }
+
+    case BIN_STRING:
+    {
+        size_t len;
+        const char *bytes = binary_read_bytes(r, &len);
+        SExpr *str = heap_alloc(HEAP_STRING, sizeof(SExpr) + len + 1);
+        str->type = TYPE_ATOM_STRING;
+        str->string = (char *)(str + 1);
+        memcpy(str->string, bytes, len);
+        str->string[len] = '\0';
+        binary_push(&r->objects, &r->object_count, &r->object_capacity, str);
+        return str;
+    }
+
+    case BIN_SYMBOL:
+    {
+        size_t len;
+        const char *bytes = binary_read_bytes(r, &len);
+        SExpr *sym = intern(bytes, len);
+        binary_push(&r->symbols, &r->symbol_count, &r->symbol_capacity, sym);
+        return sym;
+    }
+
+    case BIN_SYMREF:
+    {
+        uint64_t id = binary_read_varint(r);
+        if (id >= r->symbol_count)
+            yisp_error("read-binary: bad symbol reference");
+        return r->symbols[id];
+    }
+
+    case BIN_BACKREF:
+    {
+        uint64_t id = binary_read_varint(r);
+        if (id >= r->object_count)
+            yisp_error("read-binary: bad back-reference");
+
+        // A reference into a list that is still being read would form a cycle
+        for (size_t i = 0; i < r->open_depth; i++)
+            if (id >= r->open[i * 2] && id < r->open[i * 2 + 1])
+                yisp_error("read-binary: bad back-reference");
+        return r->objects[id];
+    }
+
+    case BIN_LIST:
+    {
+        uint64_t n = binary_read_varint(r);
+        if (n == 0 || n > (uint64_t)(r->end - r->pos))
+            yisp_error("read-binary: bad list length");
+
+        // The spine is allocated in one piece, and its cells are registered
+        // before their elements, matching the writer
+        SExpr *cells = heap_alloc_array(HEAP_CONS, n, sizeof(SExpr));
+        if (r->open_depth == r->open_capacity)
+        {
+            r->open_capacity = r->open_capacity ? r->open_capacity * 2 : 64;
+            r->open = realloc(r->open, r->open_capacity * 2 * sizeof(size_t));
+        }
+        r->open[r->open_depth * 2] = r->object_count;
+        r->open[r->open_depth * 2 + 1] = r->object_count + n;
+        r->open_depth++;
+
+        for (uint64_t i = 0; i < n; i++)
+        {
+            cells[i].type = TYPE_CONS;
+            cells[i].cons.cdr = &cells[i + 1];
+            binary_push(&r->objects, &r->object_count, &r->object_capacity, &cells[i]);
+        }
+        for (uint64_t i = 0; i < n; i++)
+            cells[i].cons.car = binary_read(r);
+        cells[n - 1].cons.cdr = binary_read(r);
+        r->open_depth--;
+        return cells;
+    }
+
+    default:
+        yisp_error("read-binary: unknown tag %d", tag);
+    }
+}
+
+static void binary_reader_free(BinaryReader *r)
+{
+    free(r->symbols);
+    free(r->objects);
+    free(r->open);
+}
+
+bool is_binary(const char *buffer, size_t len)
+{
+    return len >= BINARY_MAGIC_LEN && memcmp(buffer, BINARY_MAGIC, BINARY_MAGIC_LEN) == 0;
+}
+
+// Reads every value of a binary stream into a list
+SExpr *binary_decode(const char *buffer, size_t len)
+{
+    if (!is_binary(buffer, len))
+        yisp_error("read-binary: not a binary S-expression stream");
+
+    BinaryReader r = {.pos = (const uint8_t *)buffer + BINARY_MAGIC_LEN, .end = (const uint8_t *)buffer + len};
+    SExpr *head = nil();
+    SExpr *last = NULL;
+    while (r.pos < r.end)
+    {
+        SExpr *cell = cons(binary_read(&r), nil());
+        if (last)
+            last->cons.cdr = cell;
+        else
+            head = cell;
+        last = cell;
+    }
+    binary_reader_free(&r);
+    return head;
+}
+
+// (write-binary path value...): writes the values as one stream, returns t
+SExpr *builtin_write_binary(SExpr *args)
+{
+    SExpr *path = car(args);
+    if (path->type != TYPE_ATOM_STRING)
+        yisp_error("write-binary expects a path string");
+
+    BinaryWriter w = {0};
+    binary_reserve(&w, BINARY_MAGIC_LEN);
+    memcpy(w.buf, BINARY_MAGIC, BINARY_MAGIC_LEN);
+    w.len = BINARY_MAGIC_LEN;
+    for (SExpr *it = cdr(args); it->type == TYPE_CONS; it = it->cons.cdr)
+        binary_write(&w, it->cons.car);
+
+    FILE *file = fopen(path->string, "wb");
+    bool ok = file && fwrite(w.buf, 1, w.len, file) == w.len;
+    if (file)
+        ok = fclose(file) == 0 && ok;
+    binary_writer_free(&w);
+
+    if (!ok)
+        yisp_error("write-binary: cannot write %s", path->string);
+    return interp->sym_true;
+}
+
+// (read-binary path): the first value of the stream in path
+SExpr *builtin_read_binary(SExpr *args)
+{
+    SExpr *path = car(args);
+    if (path->type != TYPE_ATOM_STRING)
+        yisp_error("read-binary expects a path string");
+
+    FILE *file = fopen(path->string, "rb");
+    if (!file)
+        yisp_error("read-binary: cannot open %s", path->string);
+    size_t len;
+    char *buffer = read_file(file, &len);
+    fclose(file);
+
+    // The buffer must be released even if decoding fails
+    jmp_buf *outer = interp->on_error;
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) != 0)
+    {
+        interp->on_error = outer;
+        free(buffer);
+        if (outer)
+            longjmp(*outer, 1);
+        fflush(interp->out);
+        exit(1);
+    }
+
+    SExpr *values = binary_decode(buffer, len);
+    interp->on_error = outer;
+    free(buffer);
+    return values->type == TYPE_CONS ? values->cons.car : nil();
+}
+
+// Evaluates a program that is either text or a binary stream, printing each
+// result. Returns false if it could not be parsed.
+bool eval_source(const char *buffer, size_t len, Env *env)
+{
+    if (!is_binary(buffer, len))
+        return eval_buffer(buffer, env);
+
+    for (SExpr *it = binary_decode(buffer, len); it->type == TYPE_CONS; it = it->cons.cdr)
+    {
+        SExpr *result = eval(it->cons.car, env);
+        fprintSExpr(interp->out, result);
+        fputc('\n', interp->out);
+    }
+    return true;
+}
+
+#endif // BINARY_H
@@ -0,0 +1,113 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sexpr.h"
+#include "utils.h"
+#include "image.h"
+#include "binary.h"
+
+// ==================== COMPILED-CODE CACHE ====================
+
+// With --cache, the parsed forms of a source file are saved next to it as
+// "<file>c" (script.yisp -> script.yispc) in the heap image format, keyed by
+// a hash of the source text and of the interpreter build. Later runs map
+// that file instead of parsing; a changed source or a rebuilt interpreter no
+// longer matches the key and the cache is rewritten.
+//
+// Forms are cached as read, before evaluation: define-time optimization
+// depends on the bindings at run time and is redone on every run.
+
+// Changes with every build, so caches never outlive the parser that made them
+#define CACHE_BUILD_ID __DATE__ " " __TIME__
+
+bool cache_enabled = false;
+
+static uint64_t cache_key(const char *buffer, size_t len)
+{
+    uint64_t key = hash_string(buffer, len);
+    key ^= hash_string(CACHE_BUILD_ID, strlen(CACHE_BUILD_ID)) * 31;
+    key ^= (uint64_t)len << 1;
+    return key ? key : 1;
+}
+
+// Parses every form of buffer into a list, or returns NULL on a parse error
+static SExpr *cache_parse_all(const char *buffer)
+{
+    SExpr *head = nil();
+    SExpr *last = NULL;
+    const char *ptr = buffer;
+    while (true)
+    {
+        while (*ptr && isspace(*ptr))
+            ptr++;
+        if (*ptr == '\0')
+            return head;
+
+        SExpr *sexpr = parseSExpr(&ptr);
+        if (!sexpr)
+            return NULL;
+
+        SExpr *cell = cons(sexpr, nil());
+        if (last)
+            last->cons.cdr = cell;
+        else
+            head = cell;
+        last = cell;
+    }
+}
+
+static void cache_store(const char *cache_path, SExpr *forms, uint64_t key)
+{
+    // Write a private file and rename it, so readers never see a partial one
+    size_t len = strlen(cache_path) + 32;
+    char *tmp = malloc(len);
+    snprintf(tmp, len, "%s.%ld.tmp", cache_path, (long)getpid());
+    if (image_write(tmp, forms, key, false))
+        rename(tmp, cache_path);
+    else
+        unlink(tmp);
+    free(tmp);
+}
+
+// Evaluates the program in buffer, read from path, through the cache
+bool eval_cached(const char *path, const char *buffer, size_t len, Env *env)
+{
+    // Hash-consing happens while reading, so it needs the real parser
+    if (!cache_enabled || hashcons_enabled || is_binary(buffer, len))
+        return eval_source(buffer, len, env);
+
+    size_t path_len = strlen(path);
+    char *cache_path = malloc(path_len + 2);
+    memcpy(cache_path, path, path_len);
+    memcpy(cache_path + path_len, "c", 2);
+
+    uint64_t key = cache_key(buffer, len);
+    SExpr *forms;
+    if (!image_map(cache_path, key, &forms))
+    {
+        forms = cache_parse_all(buffer);
+        if (!forms)
+        {
+            // Let the regular path report the error after the forms before it
+            free(cache_path);
+            return eval_buffer(buffer, env);
+        }
+        cache_store(cache_path, forms, key);
+    }
+    free(cache_path);
+
+    for (SExpr *it = forms; it->type == TYPE_CONS; it = it->cons.cdr)
+    {
+        SExpr *result = eval(it->cons.car, env);
+        fprintSExpr(interp->out, result);
+        fputc('\n', interp->out);
+    }
+    return true;
+}
+
+#endif // CACHE_H
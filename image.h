@@ -0,0 +1,606 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sexpr.h"
+
+// ==================== HEAP IMAGES ====================
+
+// An image holds every global binding of an interpreter and all objects
+// reachable from them, so a prelude can be loaded without parsing or
+// evaluating it again.
+//
+// Layout: an ImageHeader, the object region, the symbol names, then the
+// bindings. Objects are stored as SExpr records (strings followed by their
+// text), whose pointer fields hold references instead of addresses:
+//
+//     0               NULL
+//     IMAGE_NIL       the nil singleton
+//     n << 3 | 2      the n-th symbol of the name table
+//     otherwise       offset of an object within the object region
+//
+// Loading maps the file privately and rewrites each reference in place, so
+// the objects are used right where they were mapped. Symbols are interned by
+// name into the loading interpreter. Besides bindings, an image can carry a
+// root value and a caller-defined key, which the compiled-code cache uses.
+
+#define IMAGE_MAGIC "YISPIMG"
+#define IMAGE_VERSION 3
+#define IMAGE_NIL 1
+#define IMAGE_SYMBOL_TAG 2
+
+typedef struct ImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sexpr_size;    // the layout must match the loading build
+    uint64_t objects_size;  // bytes of the object region, after the header
+    uint64_t symbol_count;  // names follow as (uint32 length, bytes) records
+    uint64_t symbols_size;  // padded to a multiple of 8
+    uint64_t binding_count; // (symbol ref, value ref) pairs follow the names
+    uint64_t root;          // reference to the root value, 0 if none
+    uint64_t key;           // must match when the image is loaded
+    uint64_t checksum;      // of the objects, names and bindings, see image_checksum
+} ImageHeader;
+
+typedef struct ImageWriter
+{
+    char *objects;
+    size_t objects_size;
+    size_t objects_capacity;
+
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    uint64_t symbol_count;
+
+    // Object address -> reference, so shared structure is written once
+    SExpr **seen_keys;
+    uint64_t *seen_refs;
+    size_t seen_count;
+    size_t seen_capacity;
+
+    bool unwritable; // met an unforced promise, whose environment cannot be saved
+} ImageWriter;
+
+// Image to load into every new interpreter (--image)
+const char *startup_image = NULL;
+
+static void image_grow(char **buf, size_t *capacity, size_t needed)
+{
+    if (needed <= *capacity)
+        return;
+    while (*capacity < needed)
+        *capacity = *capacity ? *capacity * 2 : 1 << 16;
+    *buf = realloc(*buf, *capacity);
+}
+
+static size_t image_seen_slot(ImageWriter *w, SExpr *key)
+{
+    size_t h = (size_t)key;
+    size_t slot = ((h >> 3) ^ (h >> 17)) & (w->seen_capacity - 1);
+    while (w->seen_keys[slot] && w->seen_keys[slot] != key)
+        slot = (slot + 1) & (w->seen_capacity - 1);
+    return slot;
+}
+
+static void image_seen_put(ImageWriter *w, SExpr *key, uint64_t ref)
+{
+    if ((w->seen_count + 1) * 2 > w->seen_capacity)
+    {
+        SExpr **old_keys = w->seen_keys;
+        uint64_t *old_refs = w->seen_refs;
+        size_t old_capacity = w->seen_capacity;
+
+        w->seen_capacity = old_capacity ? old_capacity * 2 : 4096;
+        w->seen_keys = calloc(w->seen_capacity, sizeof(SExpr *));
+        w->seen_refs = malloc(w->seen_capacity * sizeof(uint64_t));
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (!old_keys[i])
+                continue;
+            size_t slot = image_seen_slot(w, old_keys[i]);
+            w->seen_keys[slot] = old_keys[i];
+            w->seen_refs[slot] = old_refs[i];
+        }
+        free(old_keys);
+        free(old_refs);
+    }
+
+    size_t slot = image_seen_slot(w, key);
+    w->seen_keys[slot] = key;
+    w->seen_refs[slot] = ref;
+    w->seen_count++;
+}
+
+static uint64_t image_seen_get(ImageWriter *w, SExpr *key)
+{
+    if (!w->seen_capacity)
+        return 0;
+    size_t slot = image_seen_slot(w, key);
+    return w->seen_keys[slot] ? w->seen_refs[slot] : 0;
+}
+
+// Appends a zeroed record and returns its offset. Offsets start at 8 so that
+// no object reference can collide with NULL, IMAGE_NIL or a symbol tag.
+static uint64_t image_reserve(ImageWriter *w, size_t bytes)
+{
+    if (w->objects_size == 0)
+        w->objects_size = 8;
+    bytes = (bytes + 7) & ~(size_t)7;
+    image_grow(&w->objects, &w->objects_capacity, w->objects_size + bytes);
+    memset(w->objects + w->objects_size, 0, bytes);
+    uint64_t offset = w->objects_size;
+    w->objects_size += bytes;
+    return offset;
+}
+
+static SExpr *image_record(ImageWriter *w, uint64_t offset)
+{
+    return (SExpr *)(w->objects + offset);
+}
+
+static uint64_t image_symbol(ImageWriter *w, SExpr *sym)
+{
+    uint64_t ref = image_seen_get(w, sym);
+    if (ref)
+        return ref;
+
+    uint32_t len = (uint32_t)strlen(sym->string);
+    image_grow(&w->names, &w->names_capacity, w->names_size + sizeof(len) + len);
+    memcpy(w->names + w->names_size, &len, sizeof(len));
+    memcpy(w->names + w->names_size + sizeof(len), sym->string, len);
+    w->names_size += sizeof(len) + len;
+
+    ref = w->symbol_count++ << 3 | IMAGE_SYMBOL_TAG;
+    image_seen_put(w, sym, ref);
+    return ref;
+}
+
+static uint64_t image_ref(ImageWriter *w, SExpr *x)
+{
+    if (!x)
+        return 0;
+    if (x->type == TYPE_NIL)
+        return IMAGE_NIL;
+    if (x->type == TYPE_ATOM_SYMBOL)
+        return image_symbol(w, x);
+    if (x->type == TYPE_PROMISE)
+    {
+        if (!x->promise.env)
+            return image_ref(w, x->promise.expr);
+        w->unwritable = true;
+        return IMAGE_NIL;
+    }
+
+    uint64_t ref = image_seen_get(w, x);
+    if (ref)
+        return ref;
+
+    if (x->type == TYPE_ATOM_NUMBER)
+    {
+        ref = image_reserve(w, sizeof(SExpr));
+        image_record(w, ref)->type = TYPE_ATOM_NUMBER;
+        image_record(w, ref)->number = x->number;
+    }
+    else if (x->type == TYPE_ATOM_STRING)
+    {
+        size_t len = strlen(x->string);
+        ref = image_reserve(w, sizeof(SExpr) + len + 1);
+        SExpr *record = image_record(w, ref);
+        record->type = TYPE_ATOM_STRING;
+        record->string = (char *)(uintptr_t)(ref + sizeof(SExpr));
+        memcpy(record + 1, x->string, len + 1);
+    }
+    else
+    {
+        // Lay out the whole spine first so long lists don't recurse on cdr
+        uint64_t previous = 0;
+        size_t length = 0;
+        SExpr *it = x;
+        while (it->type == TYPE_CONS && !image_seen_get(w, it))
+        {
+            uint64_t offset = image_reserve(w, sizeof(SExpr));
+            image_record(w, offset)->type = TYPE_CONS;
+            image_seen_put(w, it, offset);
+            if (previous)
+                image_record(w, previous)->cons.cdr = (SExpr *)(uintptr_t)offset;
+            else
+                ref = offset;
+            previous = offset;
+            length++;
+            it = it->cons.cdr;
+        }
+        uint64_t tail = image_ref(w, it);
+        image_record(w, previous)->cons.cdr = (SExpr *)(uintptr_t)tail;
+
+        it = x;
+        for (size_t i = 0; i < length; i++, it = it->cons.cdr)
+        {
+            uint64_t car_ref = image_ref(w, it->cons.car);
+            image_record(w, image_seen_get(w, it))->cons.car = (SExpr *)(uintptr_t)car_ref;
+        }
+        return ref;
+    }
+
+    image_seen_put(w, x, ref);
+    return ref;
+}
+
+// Catches files damaged after they were written, which the structural checks
+// of image_check could not tell from valid ones when only a number changed
+static uint64_t image_checksum(const char *objects, size_t objects_size, const char *names, size_t names_size,
+                               const uint64_t *bindings, size_t binding_count)
+{
+    uint64_t h = hash_string(objects, objects_size);
+    h = h * 31 ^ hash_string(names, names_size);
+    return h * 31 ^ hash_string((const char *)bindings, binding_count * 2 * sizeof(uint64_t));
+}
+
+// Writes root and, if requested, every global binding of the current
+// interpreter to path
+static bool image_write(const char *path, SExpr *root, uint64_t key, bool globals)
+{
+    ImageWriter w = {0};
+    uint64_t *bindings = NULL;
+    size_t binding_count = 0;
+
+    for (size_t i = 0; globals && i < interp->symbol_capacity; i++)
+    {
+        SExpr *sym = interp->symbol_table[i];
+        if (!sym || !sym->global)
+            continue;
+
+        bindings = realloc(bindings, (binding_count + 1) * 2 * sizeof(uint64_t));
+        bindings[binding_count * 2] = image_symbol(&w, sym);
+        bindings[binding_count * 2 + 1] = image_ref(&w, sym->global);
+        binding_count++;
+    }
+    uint64_t root_ref = image_ref(&w, root);
+    if (w.objects_size == 0)
+        image_reserve(&w, 0);
+
+    // Keep the bindings that follow the names 8-byte aligned
+    size_t padded = (w.names_size + 7) & ~(size_t)7;
+    image_grow(&w.names, &w.names_capacity, padded + 8);
+    memset(w.names + w.names_size, 0, padded - w.names_size);
+    w.names_size = padded;
+
+    ImageHeader header = {0};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.sexpr_size = sizeof(SExpr);
+    header.objects_size = w.objects_size;
+    header.symbol_count = w.symbol_count;
+    header.symbols_size = w.names_size;
+    header.binding_count = binding_count;
+    header.root = root_ref;
+    header.key = key;
+    header.checksum = image_checksum(w.objects, w.objects_size, w.names, w.names_size, bindings, binding_count);
+
+    FILE *file = w.unwritable ? NULL : fopen(path, "wb");
+    bool ok = file != NULL;
+    if (ok)
+    {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(w.objects, 1, w.objects_size, file) == w.objects_size &&
+             fwrite(w.names, 1, w.names_size, file) == w.names_size &&
+             (binding_count == 0 || fwrite(bindings, sizeof(uint64_t), binding_count * 2, file) == binding_count * 2);
+        ok = fclose(file) == 0 && ok;
+    }
+
+    free(w.objects);
+    free(w.names);
+    free(w.seen_keys);
+    free(w.seen_refs);
+    free(bindings);
+    return ok;
+}
+
+// Writes every global binding of the current interpreter to path
+bool image_dump(const char *path)
+{
+    if (image_write(path, NULL, 0, true))
+        return true;
+    fprintf(stderr, "Error: cannot write image %s\n", path);
+    return false;
+}
+
+static SExpr *image_resolve(uint64_t ref, char *objects, SExpr **symbols)
+{
+    if (ref == 0)
+        return NULL;
+    if (ref == IMAGE_NIL)
+        return interp->nil;
+    if ((ref & 7) == IMAGE_SYMBOL_TAG)
+        return symbols[ref >> 3];
+    return (SExpr *)(objects + ref);
+}
+
+// What image_check learns about the object region of a mapped image
+typedef struct ImageCheck
+{
+    char *objects;
+    uint64_t objects_size;
+    uint64_t symbol_count;
+    uint8_t *marks; // per 8-byte slot: IMAGE_FREE, or the state of the record starting there
+} ImageCheck;
+
+enum
+{
+    IMAGE_FREE,
+    IMAGE_RECORD, // a record starts here
+    IMAGE_OPEN,   // a cons being walked by image_acyclic
+    IMAGE_DONE,   // a cons whose structure was walked
+};
+
+// Whether ref is NULL-free and names a symbol of the table, the nil
+// singleton or the start of a record
+static bool image_valid_ref(ImageCheck *c, uint64_t ref)
+{
+    if (ref == IMAGE_NIL)
+        return true;
+    if ((ref & 7) == IMAGE_SYMBOL_TAG)
+        return (ref >> 3) < c->symbol_count;
+    return ref != 0 && (ref & 7) == 0 && ref < c->objects_size && c->marks[ref >> 3] != IMAGE_FREE;
+}
+
+// The record at ref, if ref is an object reference
+static SExpr *image_check_record(ImageCheck *c, uint64_t ref)
+{
+    if (ref == IMAGE_NIL || (ref & 7) == IMAGE_SYMBOL_TAG)
+        return NULL;
+    return (SExpr *)(c->objects + ref);
+}
+
+// Whether no cons can be reached again from itself, which would send the
+// printer and the evaluator round forever. Walks depth first with a stack of
+// cons offsets whose car is done when their state is IMAGE_OPEN.
+static bool image_acyclic(ImageCheck *c)
+{
+    size_t capacity = 64;
+    size_t depth = 0;
+    uint64_t *stack = malloc(capacity * 2 * sizeof(uint64_t));
+    bool ok = true;
+
+    for (uint64_t start = 8; start < c->objects_size && ok; start += 8)
+    {
+        if (c->marks[start >> 3] != IMAGE_RECORD || ((SExpr *)(c->objects + start))->type != TYPE_CONS)
+            continue;
+
+        c->marks[start >> 3] = IMAGE_OPEN;
+        stack[0] = start;
+        stack[1] = 0;
+        depth = 1;
+        while (depth > 0 && ok)
+        {
+            uint64_t offset = stack[depth * 2 - 2];
+            uint64_t field = stack[depth * 2 - 1]++;
+            if (field == 2)
+            {
+                c->marks[offset >> 3] = IMAGE_DONE;
+                depth--;
+                continue;
+            }
+
+            SExpr *record = (SExpr *)(c->objects + offset);
+            uint64_t ref = (uint64_t)(uintptr_t)(field == 0 ? record->cons.car : record->cons.cdr);
+            SExpr *child = image_check_record(c, ref);
+            if (!child || child->type != TYPE_CONS || c->marks[ref >> 3] == IMAGE_DONE)
+                continue;
+            if (c->marks[ref >> 3] == IMAGE_OPEN)
+            {
+                ok = false;
+                break;
+            }
+
+            if (depth == capacity)
+            {
+                capacity *= 2;
+                stack = realloc(stack, capacity * 2 * sizeof(uint64_t));
+            }
+            c->marks[ref >> 3] = IMAGE_OPEN;
+            stack[depth * 2] = ref;
+            stack[depth * 2 + 1] = 0;
+            depth++;
+        }
+    }
+    free(stack);
+    return ok;
+}
+
+// Checks everything image_map trusts before it rewrites a reference: every
+// record lies within the object region with a known type, strings are
+// terminated there, and every reference names a symbol, nil or a record.
+static bool image_check(ImageHeader *header, char *objects, uint64_t *bindings, ImageCheck *c)
+{
+    c->objects = objects;
+    c->objects_size = header->objects_size;
+    c->symbol_count = header->symbol_count;
+    c->marks = calloc(header->objects_size / 8 + 1, 1);
+
+    size_t offset = 8;
+    while (offset < header->objects_size)
+    {
+        if (header->objects_size - offset < sizeof(SExpr))
+            return false;
+        SExpr *record = (SExpr *)(objects + offset);
+        size_t bytes = sizeof(SExpr);
+        if (record->type == TYPE_ATOM_STRING)
+        {
+            uint64_t text = offset + sizeof(SExpr);
+            if ((uint64_t)(uintptr_t)record->string != text || text >= header->objects_size)
+                return false;
+            char *end = memchr(objects + text, '\0', header->objects_size - text);
+            if (!end)
+                return false;
+            bytes += (size_t)(end - (objects + text)) + 1;
+        }
+        else if (record->type != TYPE_CONS && record->type != TYPE_ATOM_NUMBER)
+        {
+            return false;
+        }
+        c->marks[offset >> 3] = IMAGE_RECORD;
+        offset += (bytes + 7) & ~(size_t)7;
+    }
+
+    for (offset = 8; offset < header->objects_size; offset += 8)
+    {
+        SExpr *record = (SExpr *)(objects + offset);
+        if (c->marks[offset >> 3] == IMAGE_RECORD && record->type == TYPE_CONS &&
+            (!image_valid_ref(c, (uint64_t)(uintptr_t)record->cons.car) ||
+             !image_valid_ref(c, (uint64_t)(uintptr_t)record->cons.cdr)))
+            return false;
+    }
+
+    for (uint64_t i = 0; i < header->binding_count; i++)
+        if ((bindings[i * 2] & 7) != IMAGE_SYMBOL_TAG || !image_valid_ref(c, bindings[i * 2]) ||
+            !image_valid_ref(c, bindings[i * 2 + 1]))
+            return false;
+    if (header->root && !image_valid_ref(c, header->root))
+        return false;
+
+    return image_acyclic(c);
+}
+
+// Whether the header describes a file of exactly size bytes that this build
+// can load with key
+static bool image_header_fits(ImageHeader *header, size_t size, uint64_t key)
+{
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || header->version != IMAGE_VERSION ||
+        header->sexpr_size != sizeof(SExpr) || header->key != key)
+        return false;
+
+    // Each part on its own first, so the sum cannot wrap around
+    size_t room = size - sizeof(ImageHeader);
+    if (header->objects_size < 8 || header->objects_size > room || header->objects_size % 8 != 0 ||
+        header->symbols_size > room || header->symbols_size % 8 != 0 ||
+        header->binding_count > room / (2 * sizeof(uint64_t)) ||
+        header->symbol_count > header->symbols_size / sizeof(uint32_t))
+        return false;
+    return header->objects_size + header->symbols_size + header->binding_count * 2 * sizeof(uint64_t) == room;
+}
+
+// Maps the image at path into the current interpreter, installs its global
+// bindings (replacing existing ones of the same name) and stores its root
+// value. Fails, leaving the bindings as they were, if the image is
+// unreadable, incompatible, has another key or does not hold together.
+static bool image_map(const char *path, uint64_t key, SExpr **root)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *base = size >= sizeof(ImageHeader)
+                     ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+
+    ImageHeader *header = base != MAP_FAILED ? (ImageHeader *)base : NULL;
+    if (!header || !image_header_fits(header, size, key))
+    {
+        if (header)
+            munmap(base, size);
+        return false;
+    }
+
+    char *objects = base + sizeof(ImageHeader);
+    char *names = objects + header->objects_size;
+    uint64_t *bindings = (uint64_t *)(names + header->symbols_size);
+    if (image_checksum(objects, header->objects_size, names, header->symbols_size, bindings, header->binding_count) !=
+        header->checksum)
+    {
+        munmap(base, size);
+        return false;
+    }
+
+    SExpr **symbols = malloc((header->symbol_count ? header->symbol_count : 1) * sizeof(SExpr *));
+    size_t name = 0;
+    bool ok = true;
+    for (uint64_t i = 0; i < header->symbol_count && ok; i++)
+    {
+        uint32_t len;
+        ok = header->symbols_size - name >= sizeof(len);
+        if (ok)
+        {
+            memcpy(&len, names + name, sizeof(len));
+            ok = header->symbols_size - name - sizeof(len) >= len;
+        }
+        if (ok)
+        {
+            symbols[i] = intern(names + name + sizeof(len), len);
+            name += sizeof(len) + len;
+        }
+    }
+
+    ImageCheck check = {0};
+    ok = ok && image_check(header, objects, bindings, &check);
+    free(check.marks);
+    if (!ok)
+    {
+        free(symbols);
+        munmap(base, size);
+        return false;
+    }
+
+    // Rewrite references into addresses, record by record
+    size_t offset = 8;
+    while (offset < header->objects_size)
+    {
+        SExpr *record = (SExpr *)(objects + offset);
+        size_t bytes = sizeof(SExpr);
+        if (record->type == TYPE_CONS)
+        {
+            record->cons.car = image_resolve((uint64_t)(uintptr_t)record->cons.car, objects, symbols);
+            record->cons.cdr = image_resolve((uint64_t)(uintptr_t)record->cons.cdr, objects, symbols);
+        }
+        else if (record->type == TYPE_ATOM_STRING)
+        {
+            record->string = objects + (uintptr_t)record->string;
+            bytes += strlen(record->string) + 1;
+        }
+        offset += (bytes + 7) & ~(size_t)7;
+    }
+
+    for (uint64_t i = 0; i < header->binding_count; i++)
+    {
+        SExpr *sym = image_resolve(bindings[i * 2], objects, symbols);
+        sym->global = image_resolve(bindings[i * 2 + 1], objects, symbols);
+    }
+    interp->env_version++;
+    if (root)
+        *root = header->root ? image_resolve(header->root, objects, symbols) : interp->nil;
+    free(symbols);
+
+    // The objects stay mapped for as long as the interpreter lives
+    ImageMapping *mapping = malloc(sizeof(ImageMapping));
+    mapping->base = base;
+    mapping->size = size;
+    mapping->next = interp->images;
+    interp->images = mapping;
+    return true;
+}
+
+// Loads the global bindings saved by image_dump
+bool image_load(const char *path)
+{
+    if (image_map(path, 0, NULL))
+        return true;
+    fprintf(stderr, "Error: cannot load image %s\n", path);
+    return false;
+}
+
+#endif // IMAGE_H
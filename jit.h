@@ -0,0 +1,529 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "sexpr.h"
+#include "profile.h"
+
+// ==================== JIT ====================
+
+// A lambda called JIT_THRESHOLD times through eval_lambda_call is compiled to
+// x86-64 code if its body is a numeric kernel: numbers, its parameters, add,
+// sub, mul, div, mod, lt, gt, lte, gte, not, if, and calls of itself by the
+// name it was called by. Code is made by appending a fixed machine-code
+// template for every node, patched with its constants and jump offsets, into
+// memory mapped executable; values live in xmm0 and on the machine stack.
+//
+// The guard on entry is that every argument is a number. A call that fails it
+// is interpreted with the arguments already evaluated. Inside, the code only
+// computes and calls itself, so whatever it cannot handle the way the
+// interpreter does (division by zero, a stack running out, a timeout) bails
+// out: the native frames are dropped and the call starts over in the
+// interpreter, which raises the error. A lambda that bailed is not compiled
+// again.
+//
+// The code assumes the primitives it uses resolve to themselves and that no
+// frame ever binds their names, as the optimizer does, and is checked again
+// whenever env_version changes.
+
+#define JIT_THRESHOLD 1000
+#define JIT_MAX_ARGS 8
+#define JIT_CODE_MAX (64 << 10)
+
+typedef double (*JitFn)(const double *args);
+
+typedef enum JitOp
+{
+    JIT_NONE,
+    JIT_ADD,
+    JIT_SUB,
+    JIT_MUL,
+    JIT_DIV,
+    JIT_MOD,
+    JIT_LT,
+    JIT_GT,
+    JIT_LTE,
+    JIT_GTE,
+    JIT_NOT,
+    JIT_EQ,
+    JIT_IF,
+} JitOp;
+
+static const struct
+{
+    const char *name;
+    JitOp op;
+} jit_ops[] = {
+    {"add", JIT_ADD}, {"+", JIT_ADD}, {"sub", JIT_SUB}, {"-", JIT_SUB}, {"mul", JIT_MUL}, {"*", JIT_MUL},
+    {"div", JIT_DIV}, {"/", JIT_DIV}, {"mod", JIT_MOD}, {"%", JIT_MOD}, {"lt", JIT_LT},  {"gt", JIT_GT},
+    {"lte", JIT_LTE}, {"gte", JIT_GTE}, {"not", JIT_NOT}, {"eq", JIT_EQ}, {"=", JIT_EQ},  {"if", JIT_IF},
+};
+
+typedef struct JitCompiler
+{
+    unsigned char *code;
+    size_t len;
+    size_t capacity;
+    size_t depth; // 8-byte slots pushed since the prologue
+    size_t *bails; // offsets of rel32 operands that jump to the bail-out
+    size_t bail_count;
+    SExpr *formals;
+    size_t arity;
+    SExpr *self;
+    Env *env;
+} JitCompiler;
+
+static void jit_bytes(JitCompiler *jc, const void *bytes, size_t n)
+{
+    if (jc->len + n > jc->capacity)
+    {
+        jc->capacity = (jc->len + n) * 2;
+        jc->code = realloc(jc->code, jc->capacity);
+    }
+    memcpy(jc->code + jc->len, bytes, n);
+    jc->len += n;
+}
+
+#define JIT_EMIT(jc, ...)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        const unsigned char bytes_[] = {__VA_ARGS__};                                                                  \
+        jit_bytes(jc, bytes_, sizeof(bytes_));                                                                         \
+    } while (0)
+
+static void jit_imm32(JitCompiler *jc, int32_t value)
+{
+    jit_bytes(jc, &value, sizeof(value));
+}
+
+static void jit_imm64(JitCompiler *jc, uint64_t value)
+{
+    jit_bytes(jc, &value, sizeof(value));
+}
+
+// mov rax, imm64
+static void jit_load_rax(JitCompiler *jc, uint64_t value)
+{
+    JIT_EMIT(jc, 0x48, 0xB8);
+    jit_imm64(jc, value);
+}
+
+// Emits a jump (opcode bytes, then rel32) and returns where its offset goes
+static size_t jit_jump(JitCompiler *jc, const unsigned char *opcode, size_t n)
+{
+    jit_bytes(jc, opcode, n);
+    jit_imm32(jc, 0);
+    return jc->len - 4;
+}
+
+static void jit_patch(JitCompiler *jc, size_t at, size_t target)
+{
+    int32_t rel = (int32_t)((long)target - (long)(at + 4));
+    memcpy(jc->code + at, &rel, sizeof(rel));
+}
+
+// Conditional jump to the bail-out, given the second byte of 0F 8x
+static void jit_bail_if(JitCompiler *jc, unsigned char cc)
+{
+    const unsigned char opcode[] = {0x0F, cc};
+    size_t at = jit_jump(jc, opcode, sizeof(opcode));
+    jc->bails = realloc(jc->bails, (jc->bail_count + 1) * sizeof(size_t));
+    jc->bails[jc->bail_count++] = at;
+}
+
+// sub rsp, 8; movsd [rsp], xmm0
+static void jit_push(JitCompiler *jc)
+{
+    JIT_EMIT(jc, 0x48, 0x83, 0xEC, 0x08, 0xF2, 0x0F, 0x11, 0x04, 0x24);
+    jc->depth++;
+}
+
+// movsd xmm0, [rsp]; add rsp, 8
+static void jit_pop(JitCompiler *jc)
+{
+    JIT_EMIT(jc, 0xF2, 0x0F, 0x10, 0x04, 0x24, 0x48, 0x83, 0xC4, 0x08);
+    jc->depth--;
+}
+
+// andpd xmm0 with 1.0, turning a comparison mask into 1 or 0
+static void jit_mask_to_number(JitCompiler *jc)
+{
+    jit_load_rax(jc, 0x3FF0000000000000ULL);
+    JIT_EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xD0); // movq xmm2, rax
+    JIT_EMIT(jc, 0x66, 0x0F, 0x54, 0xC2);       // andpd xmm0, xmm2
+}
+
+// The operation a head symbol names, if it still names the primitive
+static JitOp jit_op(JitCompiler *jc, SExpr *head)
+{
+    if (head->type != TYPE_ATOM_SYMBOL || head->bound_locally || sym_in_list(head, jc->formals) ||
+        lookup(jc->env, head) != head)
+        return JIT_NONE;
+    for (size_t i = 0; i < sizeof(jit_ops) / sizeof(jit_ops[0]); i++)
+        if (strcmp(head->string, jit_ops[i].name) == 0)
+            return jit_ops[i].op;
+    return JIT_NONE;
+}
+
+static bool jit_number(JitCompiler *jc, SExpr *expr);
+
+// Leaves a in xmm0 and b in xmm1
+static bool jit_pair(JitCompiler *jc, SExpr *args)
+{
+    if (list_length(args) != 2 || !jit_number(jc, car(args)))
+        return false;
+    jit_push(jc);
+    if (!jit_number(jc, cadr(args)))
+        return false;
+    JIT_EMIT(jc, 0x66, 0x0F, 0x28, 0xC8); // movapd xmm1, xmm0
+    jit_pop(jc);
+    return true;
+}
+
+static bool jit_self_call(JitCompiler *jc, SExpr *args)
+{
+    size_t count = list_length(args);
+    if (count != jc->arity)
+        return false;
+
+    // The call needs rsp 16-byte aligned once the arguments are pushed
+    size_t pad = (jc->depth + count) & 1;
+    if (pad)
+    {
+        JIT_EMIT(jc, 0x48, 0x83, 0xEC, 0x08); // sub rsp, 8
+        jc->depth++;
+    }
+
+    // Pushed last to first, so that the first is at the lowest address
+    SExpr *items[JIT_MAX_ARGS];
+    for (size_t i = 0; i < count; i++, args = args->cons.cdr)
+        items[i] = args->cons.car;
+    for (size_t i = count; i-- > 0;)
+    {
+        if (!jit_number(jc, items[i]))
+            return false;
+        jit_push(jc);
+    }
+
+    JIT_EMIT(jc, 0x48, 0x89, 0xE7); // mov rdi, rsp
+    const unsigned char call[] = {0xE8};
+    jit_patch(jc, jit_jump(jc, call, sizeof(call)), 0);
+
+    JIT_EMIT(jc, 0x48, 0x81, 0xC4); // add rsp, imm32
+    jit_imm32(jc, (int32_t)(8 * (count + pad)));
+    jc->depth -= count + pad;
+    return true;
+}
+
+static bool jit_if(JitCompiler *jc, SExpr *args)
+{
+    size_t count = list_length(args);
+    if (count != 2 && count != 3)
+        return false;
+    SExpr *test = car(args);
+
+    // Numbers are true, so only eq can choose the other branch
+    if (test->type != TYPE_CONS || jit_op(jc, car(test)) != JIT_EQ)
+        return jit_number(jc, test) && jit_number(jc, cadr(args));
+    if (count != 3 || !jit_pair(jc, cdr(test)))
+        return false;
+
+    JIT_EMIT(jc, 0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+    const unsigned char jne[] = {0x0F, 0x85};
+    const unsigned char jp[] = {0x0F, 0x8A};
+    const unsigned char jmp[] = {0xE9};
+    size_t to_else = jit_jump(jc, jne, sizeof(jne));
+    size_t to_else_nan = jit_jump(jc, jp, sizeof(jp));
+    if (!jit_number(jc, cadr(args)))
+        return false;
+    size_t to_end = jit_jump(jc, jmp, sizeof(jmp));
+    jit_patch(jc, to_else, jc->len);
+    jit_patch(jc, to_else_nan, jc->len);
+    if (!jit_number(jc, caddr(args)))
+        return false;
+    jit_patch(jc, to_end, jc->len);
+    return true;
+}
+
+// Emits code leaving the number expr evaluates to in xmm0; false if expr is
+// not a numeric kernel
+static bool jit_number(JitCompiler *jc, SExpr *expr)
+{
+    if (jc->len > JIT_CODE_MAX)
+        return false;
+
+    if (expr->type == TYPE_ATOM_NUMBER)
+    {
+        uint64_t bits;
+        memcpy(&bits, &expr->number, sizeof(bits));
+        jit_load_rax(jc, bits);
+        JIT_EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+        return true;
+    }
+
+    if (expr->type == TYPE_ATOM_SYMBOL)
+    {
+        size_t index = 0;
+        for (SExpr *f = jc->formals; f->type == TYPE_CONS; f = f->cons.cdr, index++)
+        {
+            if (f->cons.car == expr)
+            {
+                JIT_EMIT(jc, 0xF2, 0x0F, 0x10, 0x83); // movsd xmm0, [rbx + disp32]
+                jit_imm32(jc, (int32_t)(8 * index));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (expr->type != TYPE_CONS)
+        return false;
+
+    SExpr *head = expr->cons.car;
+    SExpr *args = expr->cons.cdr;
+    if (head == jc->self)
+        return jit_self_call(jc, args);
+
+    switch (jit_op(jc, head))
+    {
+    case JIT_ADD:
+        if (!jit_pair(jc, args))
+            return false;
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x58, 0xC1); // addsd xmm0, xmm1
+        return true;
+    case JIT_SUB:
+        if (!jit_pair(jc, args))
+            return false;
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x5C, 0xC1); // subsd xmm0, xmm1
+        return true;
+    case JIT_MUL:
+        if (!jit_pair(jc, args))
+            return false;
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x59, 0xC1); // mulsd xmm0, xmm1
+        return true;
+    case JIT_DIV:
+        if (!jit_pair(jc, args))
+            return false;
+        JIT_EMIT(jc, 0x66, 0x0F, 0x57, 0xD2); // xorpd xmm2, xmm2
+        JIT_EMIT(jc, 0x66, 0x0F, 0x2E, 0xCA); // ucomisd xmm1, xmm2
+        jit_bail_if(jc, 0x84);                // je
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x5E, 0xC1); // divsd xmm0, xmm1
+        return true;
+    case JIT_MOD:
+        // As the interpreter does: both truncated to int, then %
+        if (!jit_pair(jc, args))
+            return false;
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x2C, 0xC0); // cvttsd2si eax, xmm0
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x2C, 0xC9); // cvttsd2si ecx, xmm1
+        JIT_EMIT(jc, 0x85, 0xC9);             // test ecx, ecx
+        jit_bail_if(jc, 0x84);                // je
+        JIT_EMIT(jc, 0x83, 0xF9, 0xFF);       // cmp ecx, -1
+        jit_bail_if(jc, 0x84);                // je
+        JIT_EMIT(jc, 0x99, 0xF7, 0xF9);       // cdq; idiv ecx
+        JIT_EMIT(jc, 0xF2, 0x0F, 0x2A, 0xC2); // cvtsi2sd xmm0, edx
+        return true;
+    case JIT_LT:
+    case JIT_LTE:
+        if (!jit_pair(jc, args))
+            return false;
+        // cmpltsd or cmplesd xmm0, xmm1
+        JIT_EMIT(jc, 0xF2, 0x0F, 0xC2, 0xC1, jit_op(jc, head) == JIT_LT ? 0x01 : 0x02);
+        jit_mask_to_number(jc);
+        return true;
+    case JIT_GT:
+    case JIT_GTE:
+        if (!jit_pair(jc, args))
+            return false;
+        // cmpltsd or cmplesd xmm1, xmm0; movapd xmm0, xmm1
+        JIT_EMIT(jc, 0xF2, 0x0F, 0xC2, 0xC8, jit_op(jc, head) == JIT_GT ? 0x01 : 0x02);
+        JIT_EMIT(jc, 0x66, 0x0F, 0x28, 0xC1);
+        jit_mask_to_number(jc);
+        return true;
+    case JIT_NOT:
+        if (list_length(args) != 1 || !jit_number(jc, car(args)))
+            return false;
+        JIT_EMIT(jc, 0x66, 0x0F, 0x57, 0xC9);       // xorpd xmm1, xmm1
+        JIT_EMIT(jc, 0xF2, 0x0F, 0xC2, 0xC1, 0x00); // cmpeqsd xmm0, xmm1
+        jit_mask_to_number(jc);
+        return true;
+    case JIT_IF:
+        return jit_if(jc, args);
+    default:
+        return false;
+    }
+}
+
+static _Noreturn void jit_bail(void)
+{
+    longjmp(*interp->jit_bail, 1);
+}
+
+// Generates the code of lambda into jc->code; false if it is not a kernel
+static bool jit_generate(JitCompiler *jc, SExpr *lambda)
+{
+    // Prologue: rbx holds the arguments; bail out when the stack runs low or
+    // the evaluation timed out
+    JIT_EMIT(jc, 0x53);             // push rbx
+    JIT_EMIT(jc, 0x48, 0x89, 0xFB); // mov rbx, rdi
+    jit_load_rax(jc, (uint64_t)(uintptr_t)&interp->jit_floor);
+    JIT_EMIT(jc, 0x48, 0x3B, 0x20); // cmp rsp, [rax]
+    jit_bail_if(jc, 0x82);          // jb
+    jit_load_rax(jc, (uint64_t)(uintptr_t)&eval_timed_out);
+    JIT_EMIT(jc, 0x83, 0x38, 0x00); // cmp dword [rax], 0
+    jit_bail_if(jc, 0x85);          // jne
+
+    if (!jit_number(jc, caddr(lambda)))
+        return false;
+    JIT_EMIT(jc, 0x5B, 0xC3); // pop rbx; ret
+
+    // Bail-out: align the stack for the call into C, which does not return
+    size_t bail = jc->len;
+    JIT_EMIT(jc, 0x48, 0x83, 0xE4, 0xF0); // and rsp, -16
+    jit_load_rax(jc, (uint64_t)(uintptr_t)jit_bail);
+    JIT_EMIT(jc, 0xFF, 0xD0); // call rax
+    for (size_t i = 0; i < jc->bail_count; i++)
+        jit_patch(jc, jc->bails[i], bail);
+    return jc->len <= JIT_CODE_MAX;
+}
+
+static void jit_release(JitEntry *entry)
+{
+    if (entry->code)
+        munmap(entry->code, entry->size);
+    entry->code = NULL;
+}
+
+// Compiles entry->lambda, or finds its code unchanged since the environment
+// last changed. Leaves entry rejected if it is not a kernel.
+static void jit_compile(JitEntry *entry, Env *env)
+{
+    SExpr *lambda = entry->lambda;
+    JitCompiler jc = {.formals = cadr(lambda), .self = entry->self, .env = env};
+    jc.arity = list_length(jc.formals);
+    bool ok = false;
+#if defined(__x86_64__)
+    ok = jc.arity <= JIT_MAX_ARGS && !sym_in_list(entry->self, jc.formals) && jit_generate(&jc, lambda);
+#endif
+    entry->version = interp->env_version;
+
+    if (!ok)
+    {
+        jit_release(entry);
+        entry->rejected = true;
+    }
+    else if (!entry->code || entry->size < jc.len || memcmp(entry->code, jc.code, jc.len) != 0)
+    {
+        jit_release(entry);
+        size_t size = (jc.len + 4095) & ~(size_t)4095;
+        void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED)
+        {
+            memcpy(code, jc.code, jc.len);
+            if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0)
+            {
+                entry->code = code;
+                entry->size = size;
+            }
+            else
+            {
+                munmap(code, size);
+            }
+        }
+        entry->rejected = !entry->code;
+    }
+
+    free(jc.code);
+    free(jc.bails);
+}
+
+static JitEntry *jit_slot(SExpr *lambda)
+{
+    size_t h = (size_t)lambda;
+    return &interp->jit_cache[((h >> 4) ^ (h >> 14)) & (JIT_CACHE_SIZE - 1)];
+}
+
+// Counts a call of lambda by head. Returns its entry if the call can run as
+// native code, compiling the lambda once it is hot.
+JitEntry *jit_entry(SExpr *lambda, SExpr *head, Env *env)
+{
+    if (profile_enabled || sample_enabled || head->type != TYPE_ATOM_SYMBOL)
+        return NULL;
+
+    JitEntry *entry = jit_slot(lambda);
+    if (entry->lambda != lambda)
+    {
+        jit_release(entry);
+        *entry = (JitEntry){.lambda = lambda, .self = head};
+    }
+    if (entry->rejected || head != entry->self)
+        return NULL;
+
+    if (!entry->code)
+    {
+        if (++entry->calls < JIT_THRESHOLD)
+            return NULL;
+        jit_compile(entry, env);
+    }
+    else if (entry->version != interp->env_version)
+    {
+        jit_compile(entry, env);
+    }
+    return entry->code ? entry : NULL;
+}
+
+// Evaluates the arguments of a call of a compiled lambda and runs its code,
+// or interprets the call if an argument is not a number or the code bails out
+SExpr *jit_eval_call(SExpr *lambda, SExpr *call_expr, Env *env)
+{
+    SExpr *head = car(call_expr);
+    SExpr *values[JIT_MAX_ARGS];
+    double numbers[JIT_MAX_ARGS];
+    size_t count = 0;
+    bool numeric = true;
+    for (SExpr *args = cdr(call_expr); args->type == TYPE_CONS; args = args->cons.cdr)
+    {
+        values[count] = eval(args->cons.car, env);
+        numeric = numeric && values[count]->type == TYPE_ATOM_NUMBER;
+        numbers[count] = numeric ? values[count]->number : 0;
+        count++;
+    }
+
+    // The arguments may have evaluated code that took the entry's place
+    JitEntry *entry = jit_slot(lambda);
+    if (numeric && entry->lambda == lambda && entry->code)
+    {
+        jmp_buf bail;
+        interp->jit_bail = &bail;
+        interp->jit_floor = stack_floor;
+        if (setjmp(bail) == 0)
+        {
+            double result = ((JitFn)entry->code)(numbers);
+            interp->jit_bail = NULL;
+            return number(result);
+        }
+        interp->jit_bail = NULL;
+        entry = jit_slot(lambda);
+        jit_release(entry);
+        entry->rejected = true;
+    }
+
+    Env *frame = frame_enter(env, count, lambda);
+    SExpr *formals = cadr(lambda);
+    for (size_t i = 0; i < count; i++, formals = formals->cons.cdr)
+        frame_bind(frame, i, formals->cons.car, values[i]);
+    return run_lambda(lambda, frame, head->string);
+}
+
+void jit_free(Interp *in)
+{
+    for (size_t i = 0; i < JIT_CACHE_SIZE; i++)
+        if (in->jit_cache[i].code)
+            munmap(in->jit_cache[i].code, in->jit_cache[i].size);
+}
+
+#endif // JIT_H
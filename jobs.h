@@ -0,0 +1,310 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "sexpr.h"
+#include "utils.h"
+#include "image.h"
+#include "binary.h"
+#include "cache.h"
+
+// ==================== PARALLEL FILE JOBS ====================
+
+// Evaluates many script files on a pool of worker threads. Every file gets a
+// fresh interpreter, so files cannot see each other's definitions, and its
+// output is captured in memory and printed in the order the files were given.
+
+typedef struct Job
+{
+    char *path;
+    char *output; // everything the file printed, including error messages
+    size_t output_len;
+    bool failed;
+    bool done;
+    unsigned long long elapsed_ns;
+} Job;
+
+typedef struct JobQueue
+{
+    Job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t next; // next job to hand out
+    pthread_mutex_t lock;
+    pthread_cond_t finished; // signalled whenever a job is done
+} JobQueue;
+
+static unsigned long long jobs_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void jobs_push(JobQueue *queue, const char *path)
+{
+    if (queue->count == queue->capacity)
+    {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->jobs = realloc(queue->jobs, queue->capacity * sizeof(Job));
+    }
+
+    Job *job = &queue->jobs[queue->count++];
+    memset(job, 0, sizeof(Job));
+    job->path = strdup(path);
+}
+
+static int jobs_compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds a file, every regular file of a directory (sorted by name), or, for
+// "-", every path listed one per line on stdin
+void jobs_add_path(JobQueue *queue, const char *path)
+{
+    if (strcmp(path, "-") == 0)
+    {
+        char line[4096];
+        while (fgets(line, sizeof(line), stdin))
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0')
+                jobs_add_path(queue, line);
+        }
+        return;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        jobs_push(queue, path);
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        jobs_push(queue, path);
+        return;
+    }
+
+    size_t count = 0;
+    size_t capacity = 64;
+    char **names = malloc(capacity * sizeof(char *));
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        char *full = malloc(len);
+        snprintf(full, len, "%s/%s", path, entry->d_name);
+
+        if (stat(full, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            free(full);
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            names = realloc(names, capacity * sizeof(char *));
+        }
+        names[count++] = full;
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), jobs_compare_names);
+    for (size_t i = 0; i < count; i++)
+    {
+        jobs_push(queue, names[i]);
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Smallest stack a worker gets when --stack is shared among many
+#define JOBS_STACK_MIN ((size_t)64 << 20)
+
+static void run_job(Job *job)
+{
+    unsigned long long start = jobs_now_ns();
+
+    Interp *in = interp_new();
+    interp_enter(in);
+    if (startup_image)
+        image_load(startup_image);
+
+    FILE *out = open_memstream(&job->output, &job->output_len);
+    in->out = out;
+    in->err = out;
+
+    FILE *file = fopen(job->path, "r");
+    if (!file)
+    {
+        fprintf(out, "Error opening file: %s\n", job->path);
+        job->failed = true;
+    }
+    else
+    {
+        size_t length;
+        char *buffer = read_file(file, &length);
+        fclose(file);
+
+        jmp_buf on_error;
+        if (setjmp(on_error) == 0)
+        {
+            in->on_error = &on_error;
+            job->failed = !eval_cached(job->path, buffer, length, in->global_env);
+        }
+        else
+        {
+            job->failed = true;
+        }
+
+        free(buffer);
+    }
+
+    fclose(out);
+    interp_free(in);
+
+    job->elapsed_ns = jobs_now_ns() - start;
+}
+
+static void *job_worker(void *arg)
+{
+    JobQueue *queue = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next == queue->count)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        Job *job = &queue->jobs[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&queue->lock);
+        job->done = true;
+        pthread_cond_broadcast(&queue->finished);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+// Runs every queued file on `workers` threads, prints each file's output in
+// order as soon as it and its predecessors are done, then prints a summary to
+// stderr. Returns the number of failed files.
+size_t runJobs(JobQueue *queue, int workers)
+{
+    if (workers < 1)
+        workers = 1;
+    if ((size_t)workers > queue->count)
+        workers = queue->count ? (int)queue->count : 1;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->finished, NULL);
+    queue->next = 0;
+
+    unsigned long long start = jobs_now_ns();
+
+    // Stacks are backed by memory only as deep as a file's recursion goes,
+    // but are reserved in full, so the workers share --stack between them
+    size_t stack = program_stack_size / (size_t)workers;
+    if (stack < JOBS_STACK_MIN)
+        stack = program_stack_size < JOBS_STACK_MIN ? program_stack_size : JOBS_STACK_MIN;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack);
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    while (started < workers && (pthread_create(&threads[started], &attr, job_worker, queue) == 0 ||
+                                 pthread_create(&threads[started], NULL, job_worker, queue) == 0))
+        started++;
+    pthread_attr_destroy(&attr);
+
+    // Out of threads or address space: run with the workers there are, or
+    // on this thread alone, before waiting for any output
+    if (started < workers)
+    {
+        fprintf(stderr, "jobs: started %d of %d workers\n", started, workers);
+        workers = started;
+    }
+    if (workers == 0)
+    {
+        Interp *saved = interp;
+        job_worker(queue);
+        interp_enter(saved);
+    }
+
+    size_t failed = 0;
+    unsigned long long busy_ns = 0;
+    Job *slowest = NULL;
+
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        Job *job = &queue->jobs[i];
+
+        pthread_mutex_lock(&queue->lock);
+        while (!job->done)
+            pthread_cond_wait(&queue->finished, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+
+        printf("==> %s <==\n", job->path);
+        fwrite(job->output, 1, job->output_len, stdout);
+        free(job->output);
+        job->output = NULL;
+
+        if (job->failed)
+            failed++;
+        busy_ns += job->elapsed_ns;
+        if (!slowest || job->elapsed_ns > slowest->elapsed_ns)
+            slowest = job;
+    }
+    fflush(stdout);
+
+    for (int i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    unsigned long long wall_ns = jobs_now_ns() - start;
+
+    fprintf(stderr, "jobs: %zu files, %zu failed, %d workers, wall %.3f ms, busy %.3f ms",
+            queue->count, failed, workers, wall_ns / 1e6, busy_ns / 1e6);
+    if (slowest)
+        fprintf(stderr, ", slowest %s (%.3f ms)", slowest->path, slowest->elapsed_ns / 1e6);
+    fprintf(stderr, "\n");
+
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        if (queue->jobs[i].failed)
+            fprintf(stderr, "failed: %s\n", queue->jobs[i].path);
+        free(queue->jobs[i].path);
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->finished);
+    free(queue->jobs);
+    queue->jobs = NULL;
+    queue->count = queue->capacity = 0;
+
+    return failed;
+}
+
+#endif // JOBS_H
@@ -0,0 +1,250 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sexpr.h"
+
+// ==================== LAZY STREAMS ====================
+
+// A stream is nil or a cons whose cdr is a promise of the rest of the stream:
+// (stream-cons a b) evaluates a now and delays b. Stream operations return
+// new streams without forcing more than they need, so a producer runs only as
+// far as its consumer asks.
+//
+// stream-fold consumes a stream in constant memory: it runs in an arena window
+// whose only state is the accumulator and the rest of the stream, so whatever
+// else the steps allocate is released as it goes. A stream bound to a global
+// name keeps the elements it has produced, like any memoized promise, and so
+// does not shrink this way.
+//
+// Derived streams delay a call of the operation itself on the rest, with
+// their operands quoted into the delayed expression.
+
+#define LAZY_READ_SIZE 65536
+
+// Read-ahead of the file behind file-lines, per thread
+typedef struct LazyFile
+{
+    char *path;
+    int fd;
+    char *buffer;
+    size_t capacity;
+    off_t start; // file offset of buffer[0]
+    size_t len;
+} LazyFile;
+
+static _Thread_local LazyFile lazy_file = {.fd = -1};
+
+static SExpr *lazy_quote(SExpr *value)
+{
+    return cons(symbol("quote"), cons(value, nil()));
+}
+
+static SExpr *lazy_call2(const char *name, SExpr *a, SExpr *b)
+{
+    return cons(symbol(name), cons(a, cons(b, nil())));
+}
+
+// (stream-cdr (quote s)): the expression that forces the rest of s
+static SExpr *lazy_rest(SExpr *stream)
+{
+    return cons(symbol("stream-cdr"), cons(lazy_quote(stream), nil()));
+}
+
+static SExpr *stream_map(SExpr *fn, SExpr *stream, Env *env)
+{
+    if (stream->type != TYPE_CONS)
+        return nil();
+
+    SExpr *head = apply_function(fn, cons(car(stream), nil()), env);
+    SExpr *rest = lazy_call2("stream-map", lazy_quote(fn), lazy_rest(stream));
+    return cons(head, promise(rest, env));
+}
+
+static SExpr *stream_filter(SExpr *pred, SExpr *stream, Env *env)
+{
+    // Rejected elements are released as they are skipped
+    ArenaWindow window;
+    window_open(&window, true);
+    while (stream->type == TYPE_CONS && apply_function(pred, cons(car(stream), nil()), env)->type == TYPE_NIL)
+    {
+        stream = force(cdr(stream));
+        window_step(&window, &stream, 1);
+    }
+    window_close(&window);
+
+    if (stream->type != TYPE_CONS)
+        return nil();
+    SExpr *rest = lazy_call2("stream-filter", lazy_quote(pred), lazy_rest(stream));
+    return cons(car(stream), promise(rest, env));
+}
+
+static SExpr *stream_take(double n, SExpr *stream, Env *env)
+{
+    if (n < 1 || stream->type != TYPE_CONS)
+        return nil();
+
+    SExpr *rest = lazy_call2("stream-take", number(n - 1), lazy_rest(stream));
+    return cons(car(stream), promise(rest, env));
+}
+
+static SExpr *stream_to_list(SExpr *stream)
+{
+    SExpr *head = nil();
+    SExpr *last = NULL;
+    while (stream->type == TYPE_CONS)
+    {
+        SExpr *cell = cons(car(stream), nil());
+        if (last)
+            last->cons.cdr = cell;
+        else
+            head = cell;
+        last = cell;
+        stream = force(cdr(stream));
+    }
+    return head;
+}
+
+static SExpr *stream_fold(SExpr *fn, SExpr *acc, SExpr *stream, Env *env)
+{
+    ArenaWindow window;
+    window_open(&window, true);
+    while (stream->type == TYPE_CONS)
+    {
+        SExpr *state[2];
+        state[0] = apply_function(fn, cons(acc, cons(car(stream), nil())), env);
+        state[1] = force(cdr(stream));
+        window_step(&window, state, 2);
+        acc = state[0];
+        stream = state[1];
+    }
+    window_close(&window);
+    return acc;
+}
+
+// Makes sure the read-ahead holds the bytes at offset, or as many as remain
+static bool lazy_file_fill(const char *path, off_t offset)
+{
+    LazyFile *file = &lazy_file;
+    if (!file->path || strcmp(file->path, path) != 0)
+    {
+        if (file->fd >= 0)
+            close(file->fd);
+        free(file->path);
+        file->path = strdup(path);
+        file->fd = open(path, O_RDONLY | O_CLOEXEC);
+        file->len = 0;
+        if (file->fd < 0)
+            return false;
+    }
+    if (file->fd < 0)
+        return false;
+
+    if (!file->buffer)
+    {
+        file->capacity = LAZY_READ_SIZE;
+        file->buffer = malloc(file->capacity);
+    }
+    file->start = offset;
+    file->len = 0;
+    while (file->len < file->capacity)
+    {
+        ssize_t got = pread(file->fd, file->buffer + file->len, file->capacity - file->len, offset + (off_t)file->len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        file->len += (size_t)got;
+    }
+    return true;
+}
+
+// (file-lines path [offset]): the lines of a file from offset on, read as the
+// stream is forced. Every line is found again from its offset, so the stream
+// is a pure function of the file.
+static SExpr *file_lines(SExpr *path, off_t offset, Env *env)
+{
+    LazyFile *file = &lazy_file;
+    if (!file->path || strcmp(file->path, path->string) != 0 || offset < file->start ||
+        offset >= file->start + (off_t)file->len)
+    {
+        if (!lazy_file_fill(path->string, offset))
+            yisp_error("file-lines: cannot open %s", path->string);
+    }
+
+    while (true)
+    {
+        size_t begin = (size_t)(offset - file->start);
+        if (begin >= file->len)
+            return nil();
+
+        char *newline = memchr(file->buffer + begin, '\n', file->len - begin);
+        bool at_end = file->len < file->capacity;
+        if (!newline && !at_end)
+        {
+            // The line runs past the read-ahead: grow it, or move it forward
+            if (begin == 0)
+            {
+                file->capacity *= 2;
+                file->buffer = realloc(file->buffer, file->capacity);
+            }
+            lazy_file_fill(path->string, offset);
+            continue;
+        }
+
+        size_t len = newline ? (size_t)(newline - (file->buffer + begin)) : file->len - begin;
+        off_t next = offset + (off_t)len + (newline ? 1 : 0);
+        if (len > 0 && file->buffer[begin + len - 1] == '\r')
+            len--;
+
+        SExpr *line = heap_alloc(HEAP_STRING, sizeof(SExpr) + len + 1);
+        line->type = TYPE_ATOM_STRING;
+        line->string = (char *)(line + 1);
+        memcpy(line->string, file->buffer + begin, len);
+        line->string[len] = '\0';
+
+        SExpr *rest = lazy_call2("file-lines", path, number((double)next));
+        return cons(line, promise(rest, env));
+    }
+}
+
+// Stream primitives, dispatched by name from call_builtin
+SExpr *builtin_stream(const char *fn_name, SExpr *args, Env *env)
+{
+    if (strcmp(fn_name, "stream-car") == 0)
+        return car(car(args));
+    if (strcmp(fn_name, "stream-cdr") == 0)
+        return force(cdr(car(args)));
+    if (strcmp(fn_name, "stream-map") == 0)
+        return stream_map(car(args), force(car(cdr(args))), env);
+    if (strcmp(fn_name, "stream-filter") == 0)
+        return stream_filter(car(args), force(car(cdr(args))), env);
+    if (strcmp(fn_name, "stream-take") == 0)
+    {
+        SExpr *n = car(args);
+        if (!n || n->type != TYPE_ATOM_NUMBER)
+            yisp_error("stream-take expects a count");
+        return stream_take(n->number, force(car(cdr(args))), env);
+    }
+    if (strcmp(fn_name, "stream->list") == 0)
+        return stream_to_list(force(car(args)));
+    if (strcmp(fn_name, "stream-fold") == 0)
+        return stream_fold(car(args), car(cdr(args)), force(car(cdr(cdr(args)))), env);
+    if (strcmp(fn_name, "file-lines") == 0)
+    {
+        SExpr *path = car(args);
+        SExpr *offset = cdr(args)->type == TYPE_CONS ? car(cdr(args)) : NULL;
+        if (!path || path->type != TYPE_ATOM_STRING)
+            yisp_error("file-lines expects a path");
+        return file_lines(path, offset && offset->type == TYPE_ATOM_NUMBER ? (off_t)offset->number : 0, env);
+    }
+
+    return symbol("Error: unrecognized function");
+}
+
+#endif // LAZY_H
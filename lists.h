@@ -0,0 +1,313 @@
+#ifndef LISTS_H
+#define LISTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+
+// ==================== LIST PRIMITIVES ====================
+
+// The core list operations, written as loops: they use constant C stack
+// however long the list is, and build their results front to back with a
+// tail pointer, as parseList does. map, filter and foldl call their function
+// through apply_function, so it may be a lambda or the name of a primitive.
+//
+//     (length l)          number of elements
+//     (append l...)       the lists joined; the last one is shared, not copied
+//     (reverse l)         a reversed copy
+//     (map f l)           (f x) for every element
+//     (filter f l)        the elements for which (f x) is non-nil
+//     (foldl f init l)    (f (f init x1) x2)..., accumulator first as in stream-fold
+//     (assoc key alist)   the first pair whose car is eq to key, or nil
+//     (sort l less)       l in the order of less, equal elements kept in order
+//
+// The argument list handed to f is one cell reused for every element:
+// lambdas copy their arguments into their frame and primitives do not keep
+// theirs.
+
+// Appends value to the list being built from *head, whose last cell is *tail
+static void list_push(SExpr **head, SExpr **tail, SExpr *value)
+{
+    SExpr *cell = cons(value, nil());
+    if (*tail)
+        (*tail)->cons.cdr = cell;
+    else
+        *head = cell;
+    *tail = cell;
+}
+
+static SExpr *list_arg(SExpr *args, size_t index, const char *fn_name)
+{
+    for (; index > 0 && args->type == TYPE_CONS; index--)
+        args = args->cons.cdr;
+    SExpr *list = args->type == TYPE_CONS ? args->cons.car : NULL;
+    if (!list || (list->type != TYPE_CONS && list->type != TYPE_NIL))
+        yisp_error("%s expects a list", fn_name);
+    return list;
+}
+
+static SExpr *list_append(SExpr *args)
+{
+    SExpr *head = nil();
+    SExpr *tail = NULL;
+    for (; args->type == TYPE_CONS; args = args->cons.cdr)
+    {
+        SExpr *list = args->cons.car;
+        if (args->cons.cdr->type != TYPE_CONS)
+        {
+            // The last list is shared
+            if (tail)
+                tail->cons.cdr = list;
+            else
+                head = list;
+            break;
+        }
+        if (list->type != TYPE_CONS && list->type != TYPE_NIL)
+            yisp_error("append expects lists");
+        for (; list->type == TYPE_CONS; list = list->cons.cdr)
+            list_push(&head, &tail, list->cons.car);
+    }
+    return head;
+}
+
+static SExpr *list_reverse(SExpr *list)
+{
+    SExpr *result = nil();
+    for (; list->type == TYPE_CONS; list = list->cons.cdr)
+        result = cons(list->cons.car, result);
+    return result;
+}
+
+static SExpr *list_map(SExpr *fn, SExpr *list, bool keep_if_true, Env *env)
+{
+    SExpr *head = nil();
+    SExpr *tail = NULL;
+    SExpr *arg = cons(nil(), nil());
+    for (; list->type == TYPE_CONS; list = list->cons.cdr)
+    {
+        arg->cons.car = list->cons.car;
+        SExpr *value = apply_function(fn, arg, env);
+        if (!keep_if_true)
+            list_push(&head, &tail, value);
+        else if (is_truthy(value))
+            list_push(&head, &tail, list->cons.car);
+    }
+    return head;
+}
+
+static SExpr *list_foldl(SExpr *fn, SExpr *acc, SExpr *list, Env *env)
+{
+    SExpr *item = cons(nil(), nil());
+    SExpr *args = cons(acc, item);
+    for (; list->type == TYPE_CONS; list = list->cons.cdr)
+    {
+        item->cons.car = list->cons.car;
+        args->cons.car = apply_function(fn, args, env);
+    }
+    return args->cons.car;
+}
+
+static SExpr *list_assoc(SExpr *key, SExpr *alist)
+{
+    for (; alist->type == TYPE_CONS; alist = alist->cons.cdr)
+    {
+        SExpr *pair = alist->cons.car;
+        if (pair->type == TYPE_CONS && is_truthy(eq(key, pair->cons.car)))
+            return pair;
+    }
+    return nil();
+}
+
+// ==================== SORT ====================
+
+// sort is a bottom-up merge sort over a copy of its argument's spine: the
+// cells of the argument may be shared, by hash-consed or image-mapped
+// constants or by any other reference to the list, so only the copy is
+// relinked. Runs of 2^i cells wait in bin i until a run of the same length
+// arrives to merge with; the bins take the place of a recursion.
+//
+// less holds when it returns neither nil nor 0, which is what lt and gt
+// return. lt, gt, lte and gte compare the numbers directly, without a call;
+// a lambda runs in an arena window so the values its calls create are
+// released as the sort goes.
+
+#define SORT_BINS 64
+
+typedef enum SortCompare
+{
+    SORT_CALL, // apply the function
+    SORT_LT,
+    SORT_GT,
+    SORT_LTE,
+    SORT_GTE,
+} SortCompare;
+
+typedef struct SortOrder
+{
+    SortCompare compare;
+    const char *name;
+    SExpr *fn;
+    SExpr *args; // (a b), reused for every call of fn
+    Env *env;
+    ArenaWindow window;
+} SortOrder;
+
+static SortOrder sort_order(SExpr *fn, Env *env)
+{
+    SortOrder order = {.compare = SORT_CALL, .name = "<lambda>", .fn = fn, .env = env};
+    if (!fn || (fn->type != TYPE_ATOM_SYMBOL && fn->type != TYPE_CONS))
+        yisp_error("sort expects a function");
+    if (fn->type == TYPE_ATOM_SYMBOL)
+    {
+        order.name = fn->string;
+        if (lookup(env, fn)->type != TYPE_CONS)
+        {
+            // A primitive, not a lambda bound to one of these names
+            static const char *names[] = {"lt", "gt", "lte", "gte"};
+            for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+                if (strcmp(fn->string, names[i]) == 0)
+                    order.compare = SORT_LT + i;
+        }
+    }
+    return order;
+}
+
+// Whether a goes before b
+static bool sort_less(SortOrder *order, SExpr *a, SExpr *b)
+{
+    if (order->compare != SORT_CALL)
+    {
+        if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+            yisp_error("%s expects number atoms", order->name);
+        switch (order->compare)
+        {
+        case SORT_LT:
+            return a->number < b->number;
+        case SORT_GT:
+            return a->number > b->number;
+        case SORT_LTE:
+            return a->number <= b->number;
+        default:
+            return a->number >= b->number;
+        }
+    }
+
+    order->args->cons.car = a;
+    order->args->cons.cdr->cons.car = b;
+    SExpr *result = apply_function(order->fn, order->args, order->env);
+    bool less = is_truthy(result) && !(result->type == TYPE_ATOM_NUMBER && result->number == 0);
+    window_step(&order->window, NULL, 0);
+    return less;
+}
+
+// Merges two sorted runs; on ties the cell of a, the earlier run, goes first
+static SExpr *sort_merge(SExpr *a, SExpr *b, SortOrder *order)
+{
+    SExpr *head;
+    SExpr **tail = &head;
+    while (a->type == TYPE_CONS && b->type == TYPE_CONS)
+    {
+        if (sort_less(order, b->cons.car, a->cons.car))
+        {
+            *tail = b;
+            tail = &b->cons.cdr;
+            b = b->cons.cdr;
+        }
+        else
+        {
+            *tail = a;
+            tail = &a->cons.cdr;
+            a = a->cons.cdr;
+        }
+    }
+    *tail = a->type == TYPE_CONS ? a : b;
+    return head;
+}
+
+// A fresh copy of the spine of list, whose cells nothing else refers to
+static SExpr *sort_copy(SExpr *list)
+{
+    SExpr *head = interp->nil;
+    SExpr *tail = NULL;
+    for (; list->type == TYPE_CONS; list = list->cons.cdr)
+        list_push(&head, &tail, list->cons.car);
+    return head;
+}
+
+static SExpr *list_sort(SExpr *list, SExpr *fn, Env *env)
+{
+    SortOrder order = sort_order(fn, env);
+    list = sort_copy(list);
+    if (order.compare == SORT_CALL)
+    {
+        order.args = cons(nil(), cons(nil(), nil()));
+        window_open(&order.window, false);
+    }
+
+    SExpr *bins[SORT_BINS];
+    for (size_t i = 0; i < SORT_BINS; i++)
+        bins[i] = interp->nil;
+
+    while (list->type == TYPE_CONS)
+    {
+        SExpr *run = list;
+        list = list->cons.cdr;
+        run->cons.cdr = interp->nil;
+
+        // Bins hold runs that came earlier, so they merge from the left
+        size_t i = 0;
+        for (; bins[i]->type == TYPE_CONS; i++)
+        {
+            run = sort_merge(bins[i], run, &order);
+            bins[i] = interp->nil;
+        }
+        bins[i] = run;
+    }
+
+    SExpr *sorted = interp->nil;
+    for (size_t i = 0; i < SORT_BINS; i++)
+        if (bins[i]->type == TYPE_CONS)
+            sorted = sort_merge(bins[i], sorted, &order);
+
+    if (order.compare == SORT_CALL)
+        window_close(&order.window);
+    return sorted;
+}
+
+// List primitives, dispatched by name from call_builtin
+SExpr *builtin_list(const char *fn_name, SExpr *args, Env *env)
+{
+    if (strcmp(fn_name, "length") == 0)
+        return number((double)list_length(list_arg(args, 0, fn_name)));
+    if (strcmp(fn_name, "append") == 0)
+        return list_append(args);
+    if (strcmp(fn_name, "reverse") == 0)
+        return list_reverse(list_arg(args, 0, fn_name));
+    if (strcmp(fn_name, "map") == 0 || strcmp(fn_name, "filter") == 0)
+    {
+        SExpr *list = list_arg(args, 1, fn_name);
+        return list_map(args->cons.car, list, fn_name[0] == 'f', env);
+    }
+    if (strcmp(fn_name, "foldl") == 0)
+    {
+        SExpr *list = list_arg(args, 2, fn_name);
+        return list_foldl(args->cons.car, args->cons.cdr->cons.car, list, env);
+    }
+    if (strcmp(fn_name, "assoc") == 0)
+    {
+        SExpr *alist = list_arg(args, 1, fn_name);
+        return list_assoc(args->cons.car, alist);
+    }
+
+    if (strcmp(fn_name, "sort") == 0)
+    {
+        SExpr *list = list_arg(args, 0, fn_name);
+        SExpr *less = args->cons.cdr->type == TYPE_CONS ? args->cons.cdr->cons.car : NULL;
+        return list_sort(list, less, env);
+    }
+
+    return symbol("Error: unrecognized function");
+}
+
+#endif // LISTS_H
@@ -2,12 +2,25 @@
 #include "sexpr.h"
 #include "utils.h"
 #include "tests.h"
+#include "profile.h"
+#include "bench.h"
+#include "pmap.h"
+#include "image.h"
+#include "binary.h"
+#include "cache.h"
+#include "jobs.h"
+#include "serve.h"
+#include "stream.h"
+#include "lazy.h"
+#include "lists.h"
+#include "jit.h"
+#include "yisp.h"
 
-void run(FILE *input_file);
+void run(FILE *input_file, const char *path);
 
-void run(FILE *input_file)
+void run(FILE *input_file, const char *path)
 {
-    Env *global_env = make_env(NULL);
+    Env *global_env = interp->global_env;
 
     if (input_file == stdin)
     {
@@ -41,65 +54,249 @@ void run(FILE *input_file)
     }
     else
     {
-        fseek(input_file, 0, SEEK_END);
-        long size = ftell(input_file);
-        fseek(input_file, 0, SEEK_SET);
+        size_t length;
+        char *buffer = read_file(input_file, &length);
+        eval_cached(path, buffer, length, global_env);
+        free(buffer);
+    }
+}
+
+static int yisp_main(int argc, char *argv[])
+{
+    init_symbols();
 
-        char *buffer = malloc(size + 1);
-        fread(buffer, 1, size, input_file);
-        buffer[size] = '\0';
+    bool run_tests = false;
+    bool run_bench = false;
+    size_t reader_bench_size = 0;
+    int jobs = 0;
+    const char *dump_image_path = NULL;
+    const char *serve_path = NULL;
+    const char *paths[argc];
+    int path_count = 0;
 
-        const char *ptr = buffer;
-        while (*ptr != '\0')
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--test") == 0)
+            run_tests = true;
+        else if (strcmp(argv[i], "--bench") == 0)
+            run_bench = true;
+        else if (strcmp(argv[i], "--bench-reader") == 0)
+            reader_bench_size = i + 1 < argc ? bench_parse_size(argv[++i]) : 0;
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            pmap_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+            startup_image = argv[++i];
+        else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc)
+            dump_image_path = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            serve_path = argv[++i];
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+            serve_timeout_ms = atol(argv[++i]);
+        else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc)
         {
-            // Skip whitespace before parsing next expression
-            while (*ptr && isspace(*ptr))
-                ptr++;
+            stream_mode = STREAM_MAP;
+            stream_source = argv[++i];
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            stream_mode = STREAM_FILTER;
+            stream_source = argv[++i];
+        }
+        else if (strcmp(argv[i], "--fold") == 0 && i + 1 < argc)
+        {
+            stream_mode = STREAM_FOLD;
+            stream_source = argv[++i];
+        }
+        else if (strcmp(argv[i], "--init") == 0 && i + 1 < argc)
+            stream_init = argv[++i];
+        else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc)
+            i++; // read by main before this runs
+        else if (strcmp(argv[i], "--cache") == 0)
+            cache_enabled = true;
+        else if (strcmp(argv[i], "--hashcons") == 0)
+            hashcons_enabled = true;
+        else if (strcmp(argv[i], "--stats") == 0)
+            heap_stats_enabled = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile_enabled = true;
+        else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc)
+        {
+            profile_enabled = true;
+            profile_csv_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+        {
+            sample_enabled = true;
+            sample_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sample-hz") == 0 && i + 1 < argc)
+        {
+            sample_hz = atoi(argv[++i]);
+            if (sample_hz <= 0)
+                sample_hz = 997;
+        }
+        else
+            paths[path_count++] = argv[i];
+    }
 
-            if (*ptr == '\0')
-                break;
+    if ((jobs > 0 || path_count > 1) && (profile_enabled || sample_enabled))
+    {
+        fprintf(stderr, "Error: --profile and --sample cannot be combined with --jobs\n");
+        return 1;
+    }
 
-            SExpr *sexpr = parseSExpr(&ptr);
-            if (!sexpr)
-            {
-                printf("Parse error\n");
-                break;
-            }
+    if (serve_path && (jobs > 0 || path_count > 1))
+    {
+        fprintf(stderr, "Error: --serve preloads at most one file and cannot be combined with --jobs\n");
+        return 1;
+    }
 
-            SExpr *result = eval(sexpr, global_env);
-            printSExpr(result);
-            printf("\n");
-        }
+    if (serve_path && (profile_enabled || sample_enabled))
+    {
+        fprintf(stderr, "Error: --profile and --sample cannot be combined with --serve\n");
+        return 1;
+    }
 
-        free(buffer);
+    if (stream_mode != STREAM_NONE && (serve_path || jobs > 0 || path_count > 1))
+    {
+        fprintf(stderr, "Error: --map, --filter and --fold preload at most one file and cannot be combined with --serve or --jobs\n");
+        return 1;
     }
-}
 
-int main(int argc, char *argv[])
-{
-    init_symbols();
+    if (startup_image && !image_load(startup_image))
+        return 1;
+
+    if (heap_stats_enabled)
+        atexit(heap_stats_report);
+
+    if (profile_enabled)
+        atexit(profile_report);
+
+    if (sample_enabled)
+    {
+        sample_start();
+        atexit(sample_report);
+    }
 
-    if (argc > 1)
+    if (run_tests)
     {
-        if (strcmp(argv[1], "--test") == 0)
+        runTests();
+    }
+    else if (run_bench)
+    {
+        runBench();
+    }
+    else if (reader_bench_size)
+    {
+        runReaderBench(reader_bench_size);
+    }
+    else if (serve_path || stream_mode != STREAM_NONE)
+    {
+        // Definitions of the preloaded file are shared by every request or record
+        if (path_count == 1)
         {
-            runTests();
-            return 0;
+            FILE *file = fopen(paths[0], "r");
+            if (!file)
+            {
+                fprintf(stderr, "Error opening file: %s\n", paths[0]);
+                return 1;
+            }
+            run(file, paths[0]);
+            fclose(file);
         }
+        if ((serve_path ? runServer(serve_path) : runStream()) != 0)
+            return 1;
+    }
+    else if (jobs > 0 || path_count > 1)
+    {
+        // Without explicit paths, read a manifest of paths from stdin
+        JobQueue queue = {0};
+        if (path_count == 0)
+            jobs_add_path(&queue, "-");
+        for (int i = 0; i < path_count; i++)
+            jobs_add_path(&queue, paths[i]);
 
-        FILE *file = fopen(argv[1], "r");
+        if (runJobs(&queue, jobs) > 0)
+            return 1;
+    }
+    else if (path_count == 1)
+    {
+        FILE *file = fopen(paths[0], "r");
         if (!file)
         {
-            fprintf(stderr, "Error opening file: %s\n", argv[1]);
+            fprintf(stderr, "Error opening file: %s\n", paths[0]);
             return 1;
         }
-        run(file);
+        run(file, paths[0]);
         fclose(file);
     }
     else
     {
-        run(stdin);
+        run(stdin, NULL);
     }
 
+    if (dump_image_path && !image_dump(dump_image_path))
+        return 1;
+
+    if (hashcons_enabled)
+        hashcons_report(stderr);
+
     return 0;
 }
+
+typedef struct MainCall
+{
+    int argc;
+    char **argv;
+    int status;
+    Interp *interp; // handed back to the main thread for the atexit reports
+} MainCall;
+
+static void *main_thread(void *arg)
+{
+    MainCall *call = arg;
+    call->status = yisp_main(call->argc, call->argv);
+    call->interp = interp;
+    return NULL;
+}
+
+// Runs the interpreter on a thread with a stack of --stack MiB, so deep
+// recursion is bounded by that rather than by the process's stack limit.
+// Pages of the stack are only backed by memory once recursion reaches them.
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i + 1 < argc; i++)
+        if (strcmp(argv[i], "--stack") == 0)
+            program_stack_size = (size_t)strtoul(argv[i + 1], NULL, 10) << 20;
+
+    MainCall call = {.argc = argc, .argv = argv};
+    size_t size = program_stack_size;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *stack = size > page ? mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0)
+                              : MAP_FAILED;
+    if (stack == MAP_FAILED)
+        return yisp_main(argc, argv);
+
+    // A guard page, for C code that recurses without checking
+    mprotect(stack, page, PROT_NONE);
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, size);
+    bool started = pthread_create(&thread, &attr, main_thread, &call) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started)
+    {
+        munmap(stack, size);
+        return yisp_main(argc, argv);
+    }
+
+    pthread_join(thread, NULL);
+    munmap(stack, size);
+    interp = call.interp;
+    return call.status;
+}
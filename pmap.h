@@ -0,0 +1,362 @@
+#ifndef PMAP_H
+#define PMAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "sexpr.h"
+#include "profile.h"
+
+// ==================== PARALLEL MAP ====================
+
+// (pmap f list) applies f to every element on a pool of worker threads and
+// returns the results in list order. Each participant evaluates in a forked
+// interpreter with its own arena; symbols and globals are shared read-only,
+// and the forks' allocations are handed to the caller once the map is done.
+//
+// Work is distributed by range splitting: every participant starts with an
+// equal slice in its own deque, repeatedly splits off the upper half of the
+// range it pops until it is at most one grain, and steals the oldest (largest)
+// range of another participant when its deque runs dry. The grain is sized
+// from the measured cost of the first element so that a chunk takes about
+// PMAP_CHUNK_NS; maps whose total cost is below PMAP_SERIAL_NS run serially.
+
+#define PMAP_MAX_THREADS 64
+#define PMAP_DEQUE_SIZE 128
+#define PMAP_CHUNK_NS 50000ULL
+#define PMAP_SERIAL_NS 200000ULL
+
+// Worker threads in the pool, excluding the caller. Negative until set by
+// --threads or sized to the machine on first use.
+int pmap_threads = -1;
+
+typedef struct PmapRange
+{
+    size_t lo;
+    size_t hi;
+} PmapRange;
+
+typedef struct PmapDeque
+{
+    pthread_mutex_t lock;
+    PmapRange ranges[PMAP_DEQUE_SIZE];
+    size_t top;    // oldest range, taken by thieves
+    size_t bottom; // newest range, taken by the owner
+} PmapDeque;
+
+typedef struct PmapTask
+{
+    SExpr *fn;
+    SExpr **items;
+    SExpr **results;
+    size_t count;
+    size_t grain;
+    Env *env;
+
+    int participants;
+    Interp **forks;
+    PmapDeque *deques;
+
+    atomic_size_t completed;
+    atomic_bool cancelled;
+    char *error; // message of the first failing participant
+    pthread_mutex_t error_lock;
+} PmapTask;
+
+typedef struct PmapPool
+{
+    int size;
+    pthread_t threads[PMAP_MAX_THREADS];
+    pthread_mutex_t busy; // held by the thread whose map occupies the pool
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    unsigned long generation; // bumped for every map handed to the workers
+    int running;              // workers still inside the current map
+    PmapTask *task;
+} PmapPool;
+
+static PmapPool pmap_pool = {
+    .size = -1,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t pmap_pool_once = PTHREAD_ONCE_INIT;
+
+static unsigned long long pmap_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static bool pmap_push(PmapDeque *deque, PmapRange range)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool room = deque->bottom - deque->top < PMAP_DEQUE_SIZE;
+    if (room)
+        deque->ranges[deque->bottom++ % PMAP_DEQUE_SIZE] = range;
+    pthread_mutex_unlock(&deque->lock);
+    return room;
+}
+
+static bool pmap_pop(PmapDeque *deque, PmapRange *range, bool steal)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->top < deque->bottom;
+    if (found)
+        *range = steal ? deque->ranges[deque->top++ % PMAP_DEQUE_SIZE]
+                       : deque->ranges[--deque->bottom % PMAP_DEQUE_SIZE];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Finds the next range for participant self, or returns false once the map
+// is complete or cancelled
+static bool pmap_next(PmapTask *task, int self, PmapRange *range)
+{
+    PmapDeque *own = &task->deques[self];
+    unsigned int seed = (unsigned int)self * 2654435761u + 1;
+
+    while (!atomic_load(&task->cancelled) && atomic_load(&task->completed) < task->count)
+    {
+        bool found = pmap_pop(own, range, false);
+        for (int tries = 0; !found && tries < task->participants * 2; tries++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            int victim = (int)((seed >> 16) % (unsigned int)task->participants);
+            if (victim != self)
+                found = pmap_pop(&task->deques[victim], range, true);
+        }
+
+        if (!found)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // Leave the upper halves for thieves, bounded by the deque's capacity
+        while (range->hi - range->lo > task->grain)
+        {
+            size_t mid = range->lo + (range->hi - range->lo) / 2;
+            if (!pmap_push(own, (PmapRange){mid, range->hi}))
+                break;
+            range->hi = mid;
+        }
+        return true;
+    }
+    return false;
+}
+
+static void pmap_participate(PmapTask *task, int self)
+{
+    Interp *saved = interp;
+    interp_enter(task->forks[self]);
+
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+
+    char *message = NULL;
+    size_t message_len = 0;
+    interp->err = open_memstream(&message, &message_len);
+
+    if (setjmp(on_error) == 0)
+    {
+        PmapRange range;
+        while (pmap_next(task, self, &range))
+        {
+            for (size_t i = range.lo; i < range.hi; i++)
+                task->results[i] = apply_function(task->fn, cons(task->items[i], nil()), task->env);
+            atomic_fetch_add(&task->completed, range.hi - range.lo);
+        }
+    }
+    else
+    {
+        atomic_store(&task->cancelled, true);
+    }
+
+    fclose(interp->err);
+    pthread_mutex_lock(&task->error_lock);
+    if (message_len > 0 && !task->error)
+    {
+        task->error = message;
+        message = NULL;
+    }
+    pthread_mutex_unlock(&task->error_lock);
+    free(message);
+
+    interp->on_error = NULL;
+    interp_enter(saved);
+}
+
+static void *pmap_worker(void *arg)
+{
+    int self = (int)(size_t)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pmap_pool.lock);
+    while (true)
+    {
+        while (pmap_pool.generation == seen)
+            pthread_cond_wait(&pmap_pool.wake, &pmap_pool.lock);
+        seen = pmap_pool.generation;
+        PmapTask *task = pmap_pool.task;
+        pthread_mutex_unlock(&pmap_pool.lock);
+
+        // Participant 0 is the calling thread
+        if (self + 1 < task->participants)
+            pmap_participate(task, self + 1);
+
+        pthread_mutex_lock(&pmap_pool.lock);
+        if (--pmap_pool.running == 0)
+            pthread_cond_signal(&pmap_pool.idle);
+    }
+    return NULL;
+}
+
+static void pmap_pool_start()
+{
+    int size = pmap_threads;
+    if (size < 0)
+        size = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (size < 0)
+        size = 0;
+    if (size > PMAP_MAX_THREADS)
+        size = PMAP_MAX_THREADS;
+
+    pmap_pool.size = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (pthread_create(&pmap_pool.threads[i], NULL, pmap_worker, (void *)(size_t)i) != 0)
+            break;
+        pthread_detach(pmap_pool.threads[i]);
+        pmap_pool.size++;
+    }
+}
+
+// Evaluates items [first, count) on the pool, the calling thread included
+static void pmap_parallel(PmapTask *task, size_t first)
+{
+    Interp *parent = interp;
+    int participants = task->participants;
+
+    task->forks = malloc(participants * sizeof(Interp *));
+    task->deques = calloc(participants, sizeof(PmapDeque));
+    atomic_init(&task->completed, first);
+    atomic_init(&task->cancelled, false);
+    pthread_mutex_init(&task->error_lock, NULL);
+
+    size_t remaining = task->count - first;
+    for (int i = 0; i < participants; i++)
+    {
+        task->forks[i] = interp_fork(parent);
+        pthread_mutex_init(&task->deques[i].lock, NULL);
+
+        PmapRange slice = {first + remaining * i / participants, first + remaining * (i + 1) / participants};
+        if (slice.hi > slice.lo)
+            pmap_push(&task->deques[i], slice);
+    }
+
+    pthread_mutex_lock(&pmap_pool.lock);
+    pmap_pool.task = task;
+    pmap_pool.running = pmap_pool.size;
+    pmap_pool.generation++;
+    pthread_cond_broadcast(&pmap_pool.wake);
+    pthread_mutex_unlock(&pmap_pool.lock);
+
+    pmap_participate(task, 0);
+
+    pthread_mutex_lock(&pmap_pool.lock);
+    while (pmap_pool.running > 0)
+        pthread_cond_wait(&pmap_pool.idle, &pmap_pool.lock);
+    pmap_pool.task = NULL;
+    pthread_mutex_unlock(&pmap_pool.lock);
+
+    for (int i = 0; i < participants; i++)
+    {
+        interp_join(parent, task->forks[i]);
+        pthread_mutex_destroy(&task->deques[i].lock);
+    }
+    free(task->forks);
+    free(task->deques);
+    pthread_mutex_destroy(&task->error_lock);
+}
+
+// (pmap f list): like mapping f over list, evaluated in parallel
+SExpr *builtin_pmap(SExpr *args, Env *env)
+{
+    SExpr *fn = car(args);
+    SExpr *list = car(cdr(args));
+
+    size_t count = 0;
+    for (SExpr *it = list; it->type == TYPE_CONS; it = it->cons.cdr)
+        count++;
+    if (count == 0)
+        return nil();
+
+    // Workers cannot see this thread's frame stack, so they get heap frames.
+    // The arrays live in the arena, so an error raised by f leaks nothing.
+    PmapTask task = {.fn = fn, .count = count, .env = frame_promote(env)};
+    task.items = heap_alloc(HEAP_CONS, 2 * count * sizeof(SExpr *));
+    task.results = task.items + count;
+
+    size_t i = 0;
+    for (SExpr *it = list; it->type == TYPE_CONS; it = it->cons.cdr)
+        task.items[i++] = it->cons.car;
+
+    // Time the first element to decide whether the rest is worth spreading
+    unsigned long long start = pmap_now_ns();
+    task.results[0] = apply_function(fn, cons(task.items[0], nil()), env);
+    unsigned long long per_item = pmap_now_ns() - start + 1;
+
+    pthread_once(&pmap_pool_once, pmap_pool_start);
+
+    // Profiler state is per process, so profiled runs stay on one thread. A
+    // pmap inside a pmap, or from another --jobs file, finds the pool busy.
+    bool parallel = pmap_pool.size > 0 && count > 1 && per_item * (count - 1) >= PMAP_SERIAL_NS &&
+                    !profile_enabled && !sample_enabled && pthread_mutex_trylock(&pmap_pool.busy) == 0;
+
+    if (parallel)
+    {
+        task.grain = PMAP_CHUNK_NS / per_item;
+        if (task.grain == 0)
+            task.grain = 1;
+        task.participants = pmap_pool.size + 1;
+        if ((size_t)task.participants > count - 1)
+            task.participants = (int)(count - 1);
+
+        pmap_parallel(&task, 1);
+        pthread_mutex_unlock(&pmap_pool.busy);
+
+        if (task.error)
+        {
+            // The message was already formatted as "Error: ...\n"
+            size_t len = strlen(task.error);
+            if (len > 0 && task.error[len - 1] == '\n')
+                task.error[len - 1] = '\0';
+            SExpr *message = string(strncmp(task.error, "Error: ", 7) == 0 ? task.error + 7 : task.error);
+            free(task.error);
+            yisp_error("%s", message->string);
+        }
+    }
+    else
+    {
+        for (i = 1; i < count; i++)
+            task.results[i] = apply_function(fn, cons(task.items[i], nil()), env);
+    }
+
+    SExpr *result = nil();
+    for (i = count; i-- > 0;)
+        result = cons(task.results[i], result);
+    return result;
+}
+
+#endif // PMAP_H
@@ -0,0 +1,370 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "sexpr.h"
+
+// ==================== DETERMINISTIC PROFILER ====================
+
+// Enabled by --profile. eval_lambda_call and dispatch_builtin report every
+// activation through profile_enter/profile_exit; entries are keyed by the
+// interned name of the callee, so lookups compare pointers only.
+
+typedef struct ProfileEntry
+{
+    const char *name;
+    ProfileKind kind;
+    unsigned long calls;
+    unsigned long long inclusive_ns; // counted for outermost activations only
+    unsigned long long exclusive_ns; // time not spent in profiled callees
+    unsigned long allocations;       // objects allocated outside profiled callees
+    int depth;                       // active recursive activations
+} ProfileEntry;
+
+typedef struct ProfileFrame
+{
+    ProfileEntry *entry;
+    unsigned long long start_ns;
+    unsigned long long child_ns;
+    unsigned long start_allocs;
+    unsigned long child_allocs;
+} ProfileFrame;
+
+bool profile_enabled = false;
+const char *profile_csv_path = NULL;
+
+static ProfileEntry *profile_entries = NULL;
+static size_t profile_capacity = 0;
+static size_t profile_count = 0;
+
+static ProfileFrame *profile_stack = NULL;
+static size_t profile_stack_capacity = 0;
+static size_t profile_depth = 0;
+
+static unsigned long long profile_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static ProfileEntry *profile_entry(const char *name, ProfileKind kind)
+{
+    if ((profile_count + 1) * 2 > profile_capacity)
+    {
+        size_t old_capacity = profile_capacity;
+        ProfileEntry *old_entries = profile_entries;
+
+        profile_capacity = old_capacity ? old_capacity * 2 : 256;
+        profile_entries = calloc(profile_capacity, sizeof(ProfileEntry));
+
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (!old_entries[i].name)
+                continue;
+            size_t slot = ((size_t)old_entries[i].name >> 3) & (profile_capacity - 1);
+            while (profile_entries[slot].name)
+                slot = (slot + 1) & (profile_capacity - 1);
+            profile_entries[slot] = old_entries[i];
+        }
+
+        free(old_entries);
+
+        // Frames on the stack point into the old table; re-resolve them
+        for (size_t i = 0; i < profile_depth; i++)
+        {
+            ProfileEntry *old = profile_stack[i].entry;
+            size_t slot = ((size_t)old->name >> 3) & (profile_capacity - 1);
+            while (profile_entries[slot].name != old->name || profile_entries[slot].kind != old->kind)
+                slot = (slot + 1) & (profile_capacity - 1);
+            profile_stack[i].entry = &profile_entries[slot];
+        }
+    }
+
+    size_t slot = ((size_t)name >> 3) & (profile_capacity - 1);
+    while (profile_entries[slot].name)
+    {
+        if (profile_entries[slot].name == name && profile_entries[slot].kind == kind)
+            return &profile_entries[slot];
+        slot = (slot + 1) & (profile_capacity - 1);
+    }
+
+    profile_entries[slot].name = name;
+    profile_entries[slot].kind = kind;
+    profile_count++;
+    return &profile_entries[slot];
+}
+
+static int profile_compare(const void *a, const void *b)
+{
+    const ProfileEntry *x = *(const ProfileEntry *const *)a;
+    const ProfileEntry *y = *(const ProfileEntry *const *)b;
+    if (x->exclusive_ns != y->exclusive_ns)
+        return x->exclusive_ns < y->exclusive_ns ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+// Prints the report sorted by exclusive time; registered with atexit so it
+// also runs when evaluation stops on an error.
+void profile_report()
+{
+    ProfileEntry **sorted = malloc((profile_count + 1) * sizeof(ProfileEntry *));
+    size_t n = 0;
+    for (size_t i = 0; i < profile_capacity; i++)
+    {
+        if (profile_entries[i].name)
+            sorted[n++] = &profile_entries[i];
+    }
+    qsort(sorted, n, sizeof(ProfileEntry *), profile_compare);
+
+    fprintf(stderr, "\nProfile (sorted by exclusive time)\n");
+    fprintf(stderr, "%-9s %12s %14s %14s %12s  %s\n", "kind", "calls", "incl ms", "excl ms", "allocs", "name");
+    for (size_t i = 0; i < n; i++)
+    {
+        ProfileEntry *e = sorted[i];
+        fprintf(stderr, "%-9s %12lu %14.3f %14.3f %12lu  %s\n",
+                e->kind == PROFILE_LAMBDA ? "lambda" : "primitive", e->calls,
+                e->inclusive_ns / 1e6, e->exclusive_ns / 1e6, e->allocations, e->name);
+    }
+
+    if (profile_csv_path)
+    {
+        FILE *csv = fopen(profile_csv_path, "w");
+        if (!csv)
+        {
+            fprintf(stderr, "Error opening profile output: %s\n", profile_csv_path);
+        }
+        else
+        {
+            fprintf(csv, "kind,name,calls,inclusive_ns,exclusive_ns,allocations\n");
+            for (size_t i = 0; i < n; i++)
+            {
+                ProfileEntry *e = sorted[i];
+                fprintf(csv, "%s,\"%s\",%lu,%llu,%llu,%lu\n",
+                        e->kind == PROFILE_LAMBDA ? "lambda" : "primitive", e->name, e->calls,
+                        e->inclusive_ns, e->exclusive_ns, e->allocations);
+            }
+            fclose(csv);
+        }
+    }
+
+    free(sorted);
+}
+
+// ==================== SAMPLING PROFILER ====================
+
+// Enabled by --sample. eval_lambda_call keeps the names of the active lambdas
+// on sample_stack; a SIGPROF timer walks that stack into a call tree built
+// from a preallocated node pool, so the handler never allocates. At exit the
+// tree is written as folded stacks ("yisp;f;g 42") for flame-graph tools.
+
+#define SAMPLE_STACK_MAX 4096
+#define SAMPLE_NODE_MAX (1 << 18)
+
+typedef struct SampleNode
+{
+    const char *name;
+    struct SampleNode *parent;
+    struct SampleNode *child;   // first child
+    struct SampleNode *sibling; // next child of the same parent
+    unsigned long samples;      // samples whose innermost frame is this node
+} SampleNode;
+
+bool sample_enabled = false;
+const char *sample_path = NULL;
+int sample_hz = 997;
+
+static const char *sample_stack[SAMPLE_STACK_MAX];
+static volatile sig_atomic_t sample_depth = 0;
+
+static SampleNode *sample_nodes = NULL;
+static size_t sample_node_count = 0;
+static volatile unsigned long sample_total = 0;
+static volatile unsigned long sample_dropped = 0;
+
+static SampleNode *sample_child(SampleNode *parent, const char *name)
+{
+    for (SampleNode *c = parent->child; c; c = c->sibling)
+    {
+        if (c->name == name)
+            return c;
+    }
+
+    if (sample_node_count == SAMPLE_NODE_MAX)
+        return NULL;
+
+    SampleNode *node = &sample_nodes[sample_node_count++];
+    node->name = name;
+    node->parent = parent;
+    node->child = NULL;
+    node->samples = 0;
+    node->sibling = parent->child;
+    parent->child = node;
+    return node;
+}
+
+static void sample_handler(int sig)
+{
+    (void)sig;
+
+    int depth = sample_depth;
+    if (depth > SAMPLE_STACK_MAX)
+        depth = SAMPLE_STACK_MAX; // deeper frames are folded into the deepest recorded one
+
+    SampleNode *node = &sample_nodes[0];
+    for (int i = 0; i < depth && node; i++)
+        node = sample_child(node, sample_stack[i]);
+
+    if (node)
+    {
+        node->samples++;
+        sample_total++;
+    }
+    else
+    {
+        sample_dropped++;
+    }
+}
+
+void sample_start()
+{
+    sample_nodes = calloc(SAMPLE_NODE_MAX, sizeof(SampleNode));
+    sample_nodes[0].name = "yisp";
+    sample_node_count = 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sample_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / sample_hz;
+    if (timer.it_interval.tv_usec == 0)
+        timer.it_interval.tv_usec = 1;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void sample_write_node(FILE *out, SampleNode *node, const char **path, int depth)
+{
+    path[depth] = node->name;
+
+    if (node->samples)
+    {
+        for (int i = 0; i <= depth; i++)
+            fprintf(out, i ? ";%s" : "%s", path[i]);
+        fprintf(out, " %lu\n", node->samples);
+    }
+
+    for (SampleNode *c = node->child; c; c = c->sibling)
+        sample_write_node(out, c, path, depth + 1);
+}
+
+// Stops the timer and writes the folded stacks; registered with atexit
+void sample_report()
+{
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    FILE *out = fopen(sample_path, "w");
+    if (!out)
+    {
+        fprintf(stderr, "Error opening sample output: %s\n", sample_path);
+        return;
+    }
+
+    const char **path = malloc((SAMPLE_STACK_MAX + 1) * sizeof(const char *));
+    sample_write_node(out, &sample_nodes[0], path, 0);
+    free(path);
+    fclose(out);
+
+    fprintf(stderr, "sampler: %lu samples at %d Hz written to %s", sample_total, sample_hz, sample_path);
+    if (sample_dropped)
+        fprintf(stderr, " (%lu dropped, node pool full)", sample_dropped);
+    fprintf(stderr, "\n");
+}
+
+// ==================== PROFILER HOOKS ====================
+
+void profile_enter(const char *name, ProfileKind kind)
+{
+    if (sample_enabled && kind == PROFILE_LAMBDA)
+    {
+        if (sample_depth < SAMPLE_STACK_MAX)
+            sample_stack[sample_depth] = name;
+        // Publish the name before the depth that makes it visible to the handler
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        sample_depth++;
+    }
+
+    if (!profile_enabled)
+        return;
+
+    if (profile_depth == profile_stack_capacity)
+    {
+        profile_stack_capacity = profile_stack_capacity ? profile_stack_capacity * 2 : 256;
+        profile_stack = realloc(profile_stack, profile_stack_capacity * sizeof(ProfileFrame));
+    }
+
+    // Resolve the entry before reading the clock so table growth is not billed
+    ProfileEntry *entry = profile_entry(name, kind);
+    ProfileFrame *frame = &profile_stack[profile_depth++];
+    frame->entry = entry;
+    frame->child_ns = 0;
+    frame->child_allocs = 0;
+    frame->start_allocs = interp->heap_stats.total_objects;
+    frame->start_ns = profile_now_ns();
+
+    entry->calls++;
+    entry->depth++;
+}
+
+void profile_exit(ProfileKind kind)
+{
+    if (sample_enabled && kind == PROFILE_LAMBDA && sample_depth > 0)
+        sample_depth--;
+
+    if (!profile_enabled || profile_depth == 0)
+        return;
+
+    unsigned long long now = profile_now_ns();
+    ProfileFrame *frame = &profile_stack[--profile_depth];
+    ProfileEntry *entry = frame->entry;
+
+    unsigned long long elapsed = now - frame->start_ns;
+    unsigned long allocs = interp->heap_stats.total_objects - frame->start_allocs;
+
+    entry->exclusive_ns += elapsed - frame->child_ns;
+    entry->allocations += allocs - frame->child_allocs;
+    if (--entry->depth == 0)
+        entry->inclusive_ns += elapsed;
+
+    if (profile_depth > 0)
+    {
+        profile_stack[profile_depth - 1].child_ns += elapsed;
+        profile_stack[profile_depth - 1].child_allocs += allocs;
+    }
+}
+
+// Ends every call still being profiled or sampled, as an error unwinds them
+// all to a handler outside of any evaluation; they are billed up to this point
+void profile_unwind()
+{
+    if (sample_enabled)
+        sample_depth = 0;
+    while (profile_enabled && profile_depth > 0)
+        profile_exit(PROFILE_PRIMITIVE);
+}
+
+#endif // PROFILE_H
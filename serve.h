@@ -0,0 +1,470 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "sexpr.h"
+#include "utils.h"
+
+// ==================== SERVER MODE ====================
+
+// With --serve, the interpreter stays up after loading its definitions and
+// answers requests on a Unix domain socket. A request is one line holding one
+// or more expressions; each result is sent back on its own line as soon as it
+// is evaluated, and an empty line ends the response. Errors are answered with
+// their "Error: ..." line. The line ":metrics" returns the server counters.
+//
+// Connections are multiplexed with epoll and their requests evaluated one at a
+// time on the warm interpreter. Every request runs in a fresh child frame of
+// the global environment, so its definitions are gone when it ends, and under
+// a deadline of serve_timeout_ms. Its allocations are released afterwards
+// unless it interned new symbols or hash-consed new nodes.
+
+#define SERVE_MAX_EVENTS 64
+#define SERVE_LINE_MAX (1 << 20)
+#define SERVE_LATENCY_BUCKETS 40
+
+// Deadline of one request; 0 disables it
+long serve_timeout_ms = 5000;
+
+typedef struct ServeConn
+{
+    int fd;
+    char *in; // received bytes not yet forming a full line
+    size_t in_len;
+    size_t in_capacity;
+    char *out; // response bytes not yet accepted by the socket
+    size_t out_len;
+    size_t out_sent;
+    size_t out_capacity;
+    bool closing; // close once out has drained
+} ServeConn;
+
+typedef struct ServeMetrics
+{
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long timeouts;
+    unsigned long long connections; // currently open
+    unsigned long long connections_total;
+    unsigned long long latency[SERVE_LATENCY_BUCKETS]; // by powers of two of microseconds
+    unsigned long long latency_max_us;
+} ServeMetrics;
+
+static ServeMetrics serve_metrics;
+static volatile sig_atomic_t serve_stopping = 0;
+static volatile sig_atomic_t serve_expired = 0; // the current request's deadline passed
+
+static void serve_on_alarm(int sig)
+{
+    (void)sig;
+    serve_expired = 1;
+    eval_timed_out = 1;
+}
+
+static void serve_on_stop(int sig)
+{
+    (void)sig;
+    serve_stopping = 1;
+}
+
+static unsigned long long serve_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void serve_arm_timer(long ms)
+{
+    struct itimerval timer = {0};
+    timer.it_value.tv_sec = ms / 1000;
+    timer.it_value.tv_usec = (ms % 1000) * 1000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static void serve_record_latency(unsigned long long us)
+{
+    int bucket = 0;
+    while (bucket < SERVE_LATENCY_BUCKETS - 1 && (1ULL << bucket) <= us)
+        bucket++;
+    serve_metrics.latency[bucket]++;
+    if (us > serve_metrics.latency_max_us)
+        serve_metrics.latency_max_us = us;
+}
+
+// Upper bound of the bucket holding the given fraction of requests
+static unsigned long long serve_latency_percentile(double fraction)
+{
+    unsigned long long total = 0;
+    for (int i = 0; i < SERVE_LATENCY_BUCKETS; i++)
+        total += serve_metrics.latency[i];
+    if (total == 0)
+        return 0;
+
+    unsigned long long rank = (unsigned long long)(fraction * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < SERVE_LATENCY_BUCKETS; i++)
+    {
+        seen += serve_metrics.latency[i];
+        if (seen >= rank)
+            return 1ULL << i;
+    }
+    return serve_metrics.latency_max_us;
+}
+
+static void serve_report_metrics(FILE *out)
+{
+    fprintf(out, "requests %llu\n", serve_metrics.requests);
+    fprintf(out, "errors %llu\n", serve_metrics.errors);
+    fprintf(out, "timeouts %llu\n", serve_metrics.timeouts);
+    fprintf(out, "connections %llu\n", serve_metrics.connections);
+    fprintf(out, "connections_total %llu\n", serve_metrics.connections_total);
+    fprintf(out, "latency_us p50<=%llu p99<=%llu max %llu\n", serve_latency_percentile(0.50),
+            serve_latency_percentile(0.99), serve_metrics.latency_max_us);
+    fprintf(out, "heap_live_bytes %zu\n", interp->heap_stats.live_bytes);
+}
+
+static void serve_queue(ServeConn *conn, const char *data, size_t len)
+{
+    if (conn->out_len + len > conn->out_capacity)
+    {
+        conn->out_capacity = (conn->out_len + len) * 2;
+        conn->out = realloc(conn->out, conn->out_capacity);
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+}
+
+// Sends as much of the pending response as the socket takes without blocking.
+// Returns false if the connection is broken.
+static bool serve_flush(ServeConn *conn)
+{
+    while (conn->out_sent < conn->out_len)
+    {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        conn->out_sent += (size_t)sent;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return true;
+}
+
+// Output of the request being evaluated
+typedef struct ServeCapture
+{
+    FILE *out;
+    char *text;
+    size_t len;
+    size_t streamed; // bytes already moved to the connection
+} ServeCapture;
+
+// Moves what the request printed since the last call onto the connection
+static void serve_stream(ServeConn *conn, ServeCapture *capture)
+{
+    fflush(capture->out);
+    if (capture->len > capture->streamed)
+    {
+        serve_queue(conn, capture->text + capture->streamed, capture->len - capture->streamed);
+        capture->streamed = capture->len;
+        serve_flush(conn);
+    }
+}
+
+static void serve_request(ServeConn *conn, const char *line)
+{
+    if (strcmp(line, ":metrics") == 0)
+    {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&text, &len);
+        serve_report_metrics(out);
+        fputc('\n', out);
+        fclose(out);
+        serve_queue(conn, text, len);
+        free(text);
+        return;
+    }
+
+    unsigned long long start = serve_now_us();
+    FILE *saved_out = interp->out;
+    FILE *saved_err = interp->err;
+
+    ServeCapture capture = {0};
+    capture.out = open_memstream(&capture.text, &capture.len);
+    interp->out = capture.out;
+    interp->err = capture.out;
+
+    ArenaMark mark = arena_mark();
+    Env *env = make_env(interp->global_env);
+
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    eval_timed_out = 0;
+    serve_expired = 0;
+    if (serve_timeout_ms > 0)
+        serve_arm_timer(serve_timeout_ms);
+
+    bool failed = false;
+    if (setjmp(on_error) == 0)
+    {
+        const char *ptr = line;
+        while (true)
+        {
+            skipWhitespace(&ptr);
+            if (*ptr == '\0')
+                break;
+
+            SExpr *form = parseSExpr(&ptr);
+            if (!form)
+                yisp_error("cannot parse request");
+
+            SExpr *result = eval(form, env);
+            fprintSExpr(capture.out, result);
+            fputc('\n', capture.out);
+            serve_stream(conn, &capture);
+        }
+    }
+    else
+    {
+        failed = true;
+    }
+
+    if (serve_timeout_ms > 0)
+        serve_arm_timer(0);
+    bool timed_out = failed && serve_expired;
+    eval_timed_out = 0;
+
+    fputc('\n', capture.out);
+    serve_stream(conn, &capture);
+    fclose(capture.out);
+    free(capture.text);
+
+    interp->on_error = NULL;
+    interp->out = saved_out;
+    interp->err = saved_err;
+    arena_release(&mark);
+
+    serve_metrics.requests++;
+    if (failed)
+        serve_metrics.errors++;
+    if (timed_out)
+        serve_metrics.timeouts++;
+    serve_record_latency(serve_now_us() - start);
+}
+
+// Evaluates every complete line received so far
+static void serve_process(ServeConn *conn)
+{
+    size_t begin = 0;
+    for (size_t i = 0; i < conn->in_len; i++)
+    {
+        if (conn->in[i] != '\n')
+            continue;
+
+        conn->in[i] = '\0';
+        if (i > begin && conn->in[i - 1] == '\r')
+            conn->in[i - 1] = '\0';
+        serve_request(conn, conn->in + begin);
+        begin = i + 1;
+    }
+
+    memmove(conn->in, conn->in + begin, conn->in_len - begin);
+    conn->in_len -= begin;
+
+    if (conn->in_len >= SERVE_LINE_MAX)
+    {
+        const char *message = "Error: request line too long\n\n";
+        serve_queue(conn, message, strlen(message));
+        conn->in_len = 0;
+        conn->closing = true;
+    }
+}
+
+// Reads what the client sent. Returns false once the connection should close.
+static bool serve_receive(ServeConn *conn)
+{
+    while (true)
+    {
+        if (conn->in_capacity - conn->in_len < 4096)
+        {
+            conn->in_capacity = conn->in_capacity * 2 + 4096;
+            conn->in = realloc(conn->in, conn->in_capacity);
+        }
+
+        ssize_t got = recv(conn->fd, conn->in + conn->in_len, conn->in_capacity - conn->in_len - 1, 0);
+        if (got > 0)
+        {
+            // Answer complete lines before buffering more, so a client that
+            // keeps sending cannot grow the buffer past one line's limit
+            conn->in_len += (size_t)got;
+            if (conn->in_len >= SERVE_LINE_MAX)
+            {
+                serve_process(conn);
+                if (conn->closing)
+                    return true;
+            }
+            continue;
+        }
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            serve_process(conn);
+            return true;
+        }
+
+        // End of stream: answer what is complete, then close after sending it
+        serve_process(conn);
+        conn->closing = true;
+        return true;
+    }
+}
+
+static void serve_close(int epoll_fd, ServeConn *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+    serve_metrics.connections--;
+}
+
+static int serve_listen(const char *socket_path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void serve_accept(int epoll_fd, int listen_fd)
+{
+    while (true)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        ServeConn *conn = calloc(1, sizeof(ServeConn));
+        conn->fd = fd;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        serve_metrics.connections++;
+        serve_metrics.connections_total++;
+    }
+}
+
+// Serves requests on socket_path until SIGINT or SIGTERM. Returns the exit
+// status for main.
+int runServer(const char *socket_path)
+{
+    int listen_fd = serve_listen(socket_path);
+    if (listen_fd < 0)
+        return 1;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    // Stop signals must interrupt epoll_wait; the timer must not disturb I/O
+    struct sigaction action = {0};
+    action.sa_handler = serve_on_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = serve_on_alarm;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &action, NULL);
+
+    fprintf(stderr, "Serving on %s\n", socket_path);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    while (!serve_stopping)
+    {
+        int ready = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        for (int i = 0; i < ready; i++)
+        {
+            ServeConn *conn = events[i].data.ptr;
+            if (!conn)
+            {
+                serve_accept(epoll_fd, listen_fd);
+                continue;
+            }
+
+            bool open = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                open = serve_receive(conn);
+            if (open)
+                open = serve_flush(conn);
+            if (open && conn->closing && conn->out_len == 0)
+                open = false;
+
+            if (!open)
+            {
+                serve_close(epoll_fd, conn);
+                continue;
+            }
+
+            // Only wait for writability while a response is backed up
+            struct epoll_event update = {.events = EPOLLIN, .data.ptr = conn};
+            if (conn->out_len > 0)
+                update.events |= EPOLLOUT;
+            if (conn->closing)
+                update.events &= ~EPOLLIN;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &update);
+        }
+    }
+
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+
+    fprintf(stderr, "Server stopped\n");
+    serve_report_metrics(stderr);
+    return 0;
+}
+
+#endif // SERVE_H
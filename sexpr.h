@@ -2,10 +2,21 @@
 #define SEXPR_H
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef __USE_GNU
+// Only declared with _GNU_SOURCE, which includes before this one may not have set
+extern int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
+#endif
 
 // ==================== DATA STRUCTURES ====================
 
@@ -16,20 +27,32 @@ typedef enum SExprType
     TYPE_ATOM_SYMBOL, // Symbol atom
     TYPE_CONS,        // Cons cell
     TYPE_NIL,         // Represents nil / empty list
+    TYPE_PROMISE,     // Delayed expression, evaluated once when forced
 } SExprType;
 
 typedef struct SExpr
 {
     SExprType type;
+    bool bound_locally; // symbols: some frame has bound it, so it may not resolve to its global cell
+    bool assumed;       // symbols: a simplified definition relies on its global meaning
     union
     {
         double number; // For numeric atoms
-        char *string;  // For strings or symbols
+        struct
+        {
+            char *string;         // For strings or symbols
+            struct SExpr *global; // Global value cell of an interned symbol (NULL if unbound)
+        };
         struct cons
         {
             struct SExpr *car; // Head of the list
             struct SExpr *cdr; // Tail of the list
         } cons;
+        struct promise
+        {
+            struct SExpr *expr; // Delayed expression, or its value once forced
+            struct Env *env;    // Environment to evaluate it in, NULL once forced
+        } promise;
     };
 } SExpr;
 
@@ -40,6 +63,188 @@ typedef struct Env
     struct Env *parent; // enclosing environment (NULL for global)
 } Env;
 
+typedef enum HeapKind
+{
+    HEAP_CONS,
+    HEAP_NUMBER,
+    HEAP_STRING,
+    HEAP_SYMBOL,
+    HEAP_ENV,
+    HEAP_KINDS,
+} HeapKind;
+
+// Maintained by make_env and the SExpr constructors. Byte counts include
+// string payloads; live_bytes drops only when an object is actually freed.
+typedef struct HeapStats
+{
+    unsigned long objects[HEAP_KINDS]; // objects allocated, by kind
+    unsigned long bytes[HEAP_KINDS];   // bytes allocated, by kind
+    unsigned long total_objects;
+    unsigned long total_bytes;
+    unsigned long live_bytes;
+    unsigned long peak_bytes;
+} HeapStats;
+
+typedef struct HashConsStats
+{
+    unsigned long nodes;       // quoted nodes examined
+    unsigned long shared;      // nodes replaced by an existing canonical cell
+    unsigned long bytes_saved; // memory released by dropping duplicates
+} HashConsStats;
+
+// Direct-mapped cache indexed by call-site address. An entry remembers what the
+// head symbol of the call resolved to through its global cell, and is valid
+// for the same site while env_version is unchanged and no frame has ever
+// bound the head, whatever frame the call is made from.
+typedef struct CallCache
+{
+    SExpr *site; // the (fn args...) cons cell
+    unsigned long version;
+    SExpr *fn_val; // result of evaluating the head symbol
+    SExpr *callee; // result of the second lookup, NULL until resolved
+} CallCache;
+
+#define CALL_CACHE_SIZE 4096
+
+// Direct-mapped cache of whether a lambda or let form may capture its frame,
+// valid while env_version is unchanged (code may be released and reused)
+typedef struct EscapeCache
+{
+    SExpr *code;
+    unsigned long version;
+    bool captures;
+} EscapeCache;
+
+#define ESCAPE_CACHE_SIZE 1024
+
+// Direct-mapped table of lambdas counted toward, and compiled by, the JIT
+typedef struct JitEntry
+{
+    SExpr *lambda;
+    SExpr *self; // the name the code calls itself by
+    unsigned long version;
+    unsigned calls;
+    bool rejected; // not compilable, or its code bailed out
+    void *code;
+    size_t size;
+} JitEntry;
+
+#define JIT_CACHE_SIZE 256
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+// A heap image mapped into an interpreter; its objects live in the mapping
+typedef struct ImageMapping
+{
+    void *base;
+    size_t size;
+    struct ImageMapping *next;
+} ImageMapping;
+
+// A position in the current interpreter's arena that can be returned to
+typedef struct ArenaMark
+{
+    ArenaChunk *chunk;      // chunk being filled when the mark was taken
+    ArenaChunk *chunk_next; // what followed it then
+    size_t used;
+    void *free_cells;
+    size_t live_bytes;
+    size_t symbol_count;
+    size_t hashcons_count;
+    unsigned long heap_writes;
+} ArenaMark;
+
+// A mark that a loop or stream consumer keeps open over many steps, releasing
+// what the steps left behind as it goes. Slots older than the window that are
+// written meanwhile are remembered, and their values kept by each release.
+typedef struct ArenaWindow
+{
+    ArenaMark mark;
+    struct ArenaWindow *outer; // window open when this one was opened
+    size_t remembered_base;    // first entry of interp->remembered it owns
+    char *frame_top;           // top of the frame stack when it was opened
+    size_t kept_bytes;         // what the last release kept after the mark
+    bool streaming;            // older promises are recomputed, not remembered
+} ArenaWindow;
+
+// All state of one interpreter. Each thread works in its own interpreter, so
+// several can run in parallel without sharing anything mutable.
+typedef struct Interp
+{
+    SExpr *nil;      // the nil singleton
+    SExpr *sym_true; // the interned symbol t
+    Env *global_env;
+
+    FILE *out;          // results and print output
+    FILE *err;          // error messages
+    jmp_buf *on_error;  // where yisp_error unwinds to, NULL to exit instead
+
+    ArenaChunk *arena; // every object of this interpreter lives here
+    void *free_cells;  // released SExpr-sized cells, reused first
+    HeapStats heap_stats;
+    ImageMapping *images; // loaded heap images, unmapped with the interpreter
+
+    SExpr **symbol_table;
+    size_t symbol_capacity;
+    size_t symbol_count;
+
+    // Set on a forked worker: the interpreter whose symbols, nil and globals
+    // it borrows. Interning then goes to the owner's table under a lock.
+    struct Interp *shared;
+
+    // Bumped whenever an existing frame gains or changes a binding; call-site
+    // caches are only trusted while the version they recorded is current.
+    unsigned long env_version;
+    CallCache call_cache[CALL_CACHE_SIZE];
+    unsigned long call_cache_hits;
+    unsigned long call_cache_lookups;
+
+    // Definitions the optimizer simplified by relying on a global name, as
+    // (name lambda . source) entries; they are simplified again once it changes
+    SExpr *simplified;
+
+    // Bumped when an existing object is changed to point at newer ones (a
+    // binding being set, a promise remembering its value), which
+    // arena_release must not free
+    unsigned long heap_writes;
+    // The innermost open window, and the slots written while windows were
+    // open, each window owning the entries from its remembered_base on
+    struct ArenaWindow *window;
+    SExpr ***remembered;
+    size_t remembered_count;
+    size_t remembered_capacity;
+    SExpr **window_roots; // scratch of window_step
+    size_t window_roots_capacity;
+
+    // LIFO stack of frames that cannot be captured, mapped on first use
+    char *frames;
+    char *frame_top;
+    EscapeCache escape_cache[ESCAPE_CACHE_SIZE];
+
+    // Native code of hot lambdas, the stack address below which it bails
+    // out, and where it bails out to
+    JitEntry jit_cache[JIT_CACHE_SIZE];
+    uintptr_t jit_floor;
+    jmp_buf *jit_bail;
+
+    SExpr **hashcons_table;
+    size_t hashcons_capacity;
+    size_t hashcons_count;
+    HashConsStats hashcons_stats;
+} Interp;
+
+typedef enum ProfileKind
+{
+    PROFILE_LAMBDA,    // user-defined lambda, named after the call head
+    PROFILE_PRIMITIVE, // built-in function
+} ProfileKind;
+
 typedef struct TestCase
 {
     const char *input;
@@ -53,26 +258,57 @@ typedef struct TestCase
 
 // ==================== FUNCTION DECLARATIONS ====================
 
+Interp *interp_new();
+void interp_enter(Interp *in);
+void interp_free(Interp *in);
+Interp *interp_fork(Interp *parent);
+void interp_join(Interp *parent, Interp *child);
+void *heap_alloc(HeapKind kind, size_t bytes);
+void *heap_alloc_array(HeapKind kind, size_t count, size_t bytes);
+void heap_free(void *ptr, size_t bytes);
+ArenaMark arena_mark();
+bool arena_release(ArenaMark *mark);
+bool arena_release_keeping(ArenaMark *mark, SExpr **roots, size_t count);
+void arena_keep(ArenaMark *mark);
+bool arena_is_young(ArenaMark *mark, const void *ptr);
+void window_open(ArenaWindow *window, bool streaming);
+void window_step(ArenaWindow *window, SExpr **roots, size_t count);
+void window_close(ArenaWindow *window);
+void heap_write(SExpr **slot, SExpr *value);
+_Noreturn void yisp_error(const char *fmt, ...);
+
 Env *make_env(Env *parent);
+Env *frame_enter(Env *parent, size_t count, SExpr *code);
+void frame_bind(Env *frame, size_t index, SExpr *symbol, SExpr *value);
+void frame_leave(Env *frame);
+Env *frame_promote(Env *env);
 void set(Env *env, SExpr *symbol, SExpr *value);
+void env_bind(Env *env, SExpr *symbol, SExpr *value);
 SExpr *lookup(Env *env, SExpr *symbol);
 
 SExpr *nil();
 SExpr *number(double value);
 SExpr *string(const char *val);
 SExpr *symbol(const char *val);
+SExpr *intern(const char *name, size_t len);
 SExpr *cons(SExpr *car, SExpr *cdr);
+SExpr *promise(SExpr *expr, Env *env);
+SExpr *force(SExpr *value);
 SExpr *car(SExpr *list);
 SExpr *cdr(SExpr *list);
 
 void skipWhitespace(const char **input);
 
+size_t numeral_length(const char *s);
 SExpr *parseNumber(const char **input);
 SExpr *parseString(const char **input);
 SExpr *parseSymbol(const char **input);
 SExpr *parseList(const char **input);
 SExpr *parseSExpr(const char **input);
 
+SExpr *hashcons(SExpr *sexp);
+void hashcons_report(FILE *out);
+
 SExpr *add(SExpr *a, SExpr *b);
 SExpr *sub(SExpr *a, SExpr *b);
 SExpr *mul(SExpr *a, SExpr *b);
@@ -96,779 +332,2909 @@ bool isSExpr(const char *input);
 
 SExpr *eval(SExpr *sexp, Env *env);
 SExpr *eval_list(SExpr *args, Env *env);
-SExpr *dispatch_builtin(const char *fn_name, SExpr *args);
+SExpr *dispatch_builtin(const char *fn_name, SExpr *args, Env *env);
 SExpr *eval_lambda_call(SExpr *lambda, SExpr *call_expr, Env *env);
+SExpr *apply_lambda(SExpr *lambda, SExpr *actuals, const char *name, Env *env);
+SExpr *apply_function(SExpr *fn, SExpr *args, Env *env);
+SExpr *builtin_pmap(SExpr *args, Env *env);
+SExpr *builtin_write_binary(SExpr *args);
+SExpr *builtin_read_binary(SExpr *args);
+SExpr *builtin_fields(SExpr *args);
+SExpr *builtin_stream(const char *fn_name, SExpr *args, Env *env);
+SExpr *builtin_list(const char *fn_name, SExpr *args, Env *env);
+SExpr *optimize_lambda(SExpr *lambda, Env *env);
+void optimize_rebound(SExpr *name);
+void profile_unwind();
+JitEntry *jit_entry(SExpr *lambda, SExpr *head, Env *env);
+SExpr *jit_eval_call(SExpr *lambda, SExpr *call_expr, Env *env);
+void jit_free(Interp *in);
 
 void printList(SExpr *s);
 void printSExpr(SExpr *s);
+void fprintList(FILE *out, SExpr *s);
+void fprintSExpr(FILE *out, SExpr *s);
 
-// ==================== MANAGE ENVIRONMENT ====================
+void profile_enter(const char *name, ProfileKind kind);
+void profile_exit(ProfileKind kind);
 
-SExpr *sym_true;
-SExpr *sym_nil;
+// ==================== INTERPRETER CONTEXT ====================
 
-void init_symbols()
-{
-    sym_true = symbol("t"); // true symbol
-    sym_nil = nil();        // nil singleton from your code
-}
+// The interpreter the calling thread evaluates in
+_Thread_local Interp *interp = NULL;
 
-Env *make_env(Env *parent)
+// Set from a timer signal once the evaluation in progress has run out of
+// time; eval checks it on every call, and the loop forms on every iteration
+// since a loop over atoms makes no calls, and raises an error
+volatile sig_atomic_t eval_timed_out = 0;
+
+static inline void timeout_check()
 {
-    Env *env = malloc(sizeof(Env));
-    env->symbols = nil();
-    env->values = nil();
-    env->parent = parent;
-    return env;
+    if (eval_timed_out)
+    {
+        eval_timed_out = 0;
+        yisp_error("evaluation timed out");
+    }
 }
 
-void set(Env *env, SExpr *symbol, SExpr *value)
+// ==================== STACK LIMIT ====================
+
+// eval, and the reader, recurse on the C stack. Each thread looks up the end
+// of its stack on its first check, and evaluation raises an error once it
+// comes within STACK_HEADROOM of it, so recursion too deep for the stack is
+// an error the caller can recover from rather than a crash. How deep that is
+// depends on the stack: main evaluates on a thread with a stack of --stack
+// MiB, backed by memory only as far as recursion reaches.
+
+#define STACK_HEADROOM (256 << 10)
+
+// Stack of the threads that run whole programs: main's and the --jobs workers
+size_t program_stack_size = (size_t)1024 << 20;
+
+static _Thread_local uintptr_t stack_floor = UINTPTR_MAX;
+static _Thread_local size_t stack_size;
+
+static void stack_exhausted(void)
 {
-    if (!env)
+    if (stack_floor != UINTPTR_MAX)
     {
-        fprintf(stderr, "Error: no current environment\n");
-        exit(1);
+        if (stack_size >= (1 << 20))
+            yisp_error("recursion too deep for the %zu MiB stack", stack_size >> 20);
+        yisp_error("recursion too deep for the %zu KiB stack", stack_size >> 10);
     }
 
-    // Add symbol and value to current env frame (head of lists)
-    env->symbols = cons(symbol, env->symbols);
-    env->values = cons(value, env->values);
+    // First check on this thread
+    stack_floor = 0;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return;
+    void *base;
+    if (pthread_attr_getstack(&attr, &base, &stack_size) == 0 && stack_size > 2 * STACK_HEADROOM)
+        stack_floor = (uintptr_t)base + STACK_HEADROOM;
+    pthread_attr_destroy(&attr);
 }
 
-SExpr *lookup(Env *env, SExpr *symbol)
-{
-    while (env)
-    {
-        SExpr *syms = env->symbols;
-        SExpr *vals = env->values;
+#define STACK_CHECK()                                                                                                  \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if ((uintptr_t)__builtin_frame_address(0) < stack_floor)                                                       \
+            stack_exhausted();                                                                                         \
+    } while (0)
 
-        while (syms && syms->type == TYPE_CONS)
-        {
-            SExpr *cur_sym = car(syms);
-            if (cur_sym->type == TYPE_ATOM_SYMBOL && strcmp(cur_sym->string, symbol->string) == 0)
-            {
-                return car(vals); // return corresponding value
-            }
-            syms = cdr(syms);
-            vals = cdr(vals);
-        }
+#define ARENA_CHUNK_SIZE (1 << 20)
 
-        env = env->parent;
-    }
-    if (symbol->type == TYPE_ATOM_SYMBOL && strcmp(symbol->string, "nil") == 0)
+static const char *heap_kind_names[HEAP_KINDS] = {"cons", "number", "string", "symbol", "env"};
+bool heap_stats_enabled = false;
+
+static unsigned long hash_string(const char *str, size_t len)
+{
+    unsigned long h = 1469598103934665603UL;
+    for (size_t i = 0; i < len; i++)
     {
-        return nil(); // Return canonical nil for symbol "nil"
+        h ^= (unsigned char)str[i];
+        h *= 1099511628211UL;
     }
-    return symbol; // else return symbol itself
+    return h;
 }
 
-// ==================== MANAGE S-EXPRESSION ====================
-
-bool is_truthy(SExpr *sexp)
+static ArenaChunk *arena_chunk(size_t size)
 {
-    return sexp != NULL && sexp->type != TYPE_NIL;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (!chunk)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    chunk->used = 0;
+    chunk->size = size;
+    return chunk;
 }
 
-SExpr *nil()
+// Bump-allocates from the current interpreter's arena
+void *heap_alloc(HeapKind kind, size_t bytes)
 {
-    static SExpr *singletonNil = NULL;
+    HeapStats *stats = &interp->heap_stats;
+    stats->objects[kind]++;
+    stats->bytes[kind] += bytes;
+    stats->total_objects++;
+    stats->total_bytes += bytes;
+    stats->live_bytes += bytes;
+    if (stats->live_bytes > stats->peak_bytes)
+        stats->peak_bytes = stats->live_bytes;
+
+    if (bytes == sizeof(SExpr) && interp->free_cells)
+    {
+        void *cell = interp->free_cells;
+        interp->free_cells = *(void **)cell;
+        return cell;
+    }
+
+    bytes = (bytes + 7) & ~(size_t)7;
 
-    if (singletonNil == NULL)
+    ArenaChunk *chunk = interp->arena;
+    if (!chunk || chunk->used + bytes > chunk->size)
     {
-        singletonNil = malloc(sizeof(SExpr));
-        singletonNil->type = TYPE_NIL;
+        if (bytes > ARENA_CHUNK_SIZE / 4)
+        {
+            // Large objects get a chunk of their own behind the current one
+            ArenaChunk *large = arena_chunk(bytes);
+            large->used = bytes;
+            if (chunk)
+            {
+                large->next = chunk->next;
+                chunk->next = large;
+            }
+            else
+            {
+                large->next = NULL;
+                interp->arena = large;
+            }
+            return large->data;
+        }
+
+        chunk = arena_chunk(ARENA_CHUNK_SIZE);
+        chunk->next = interp->arena;
+        interp->arena = chunk;
     }
 
-    return singletonNil;
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += bytes;
+    return ptr;
 }
 
-SExpr *number(double value)
+// Allocates count adjacent objects of the given size in one step
+void *heap_alloc_array(HeapKind kind, size_t count, size_t bytes)
 {
-    SExpr *a = malloc(sizeof(SExpr));
-    a->type = TYPE_ATOM_NUMBER;
-    a->number = value;
-    return a;
+    void *first = heap_alloc(kind, count * bytes);
+    interp->heap_stats.objects[kind] += count - 1;
+    interp->heap_stats.total_objects += count - 1;
+    return first;
 }
 
-SExpr *string(const char *val)
+// Returns an object to the interpreter; its first SExpr-sized cell is reused
+void heap_free(void *ptr, size_t bytes)
 {
-    SExpr *a = malloc(sizeof(SExpr));
-    a->type = TYPE_ATOM_STRING;
-    a->string = strdup(val);
-    return a;
+    interp->heap_stats.live_bytes -= bytes;
+    *(void **)ptr = interp->free_cells;
+    interp->free_cells = ptr;
 }
 
-SExpr *symbol(const char *val)
+// Remembers the arena position so that a self-contained evaluation can be
+// discarded with arena_release. The free list is set aside until then.
+ArenaMark arena_mark()
 {
-    SExpr *a = malloc(sizeof(SExpr));
-    a->type = TYPE_ATOM_SYMBOL;
-    a->string = strdup(val);
-    return a;
+    ArenaMark mark = {
+        .chunk = interp->arena,
+        .chunk_next = interp->arena ? interp->arena->next : NULL,
+        .used = interp->arena ? interp->arena->used : 0,
+        .free_cells = interp->free_cells,
+        .live_bytes = interp->heap_stats.live_bytes,
+        .symbol_count = interp->symbol_count,
+        .hashcons_count = interp->hashcons_count,
+        .heap_writes = interp->heap_writes,
+    };
+    interp->free_cells = NULL;
+    return mark;
 }
 
-SExpr *cons(SExpr *car, SExpr *cdr)
+// Whether nothing allocated since the mark can be reachable from older objects
+static bool arena_sealed(ArenaMark *mark)
 {
-    SExpr *node = malloc(sizeof(SExpr));
-    node->type = TYPE_CONS;
-    node->cons.car = car;
-    node->cons.cdr = cdr;
-    return node;
+    return interp->heap_writes == mark->heap_writes && interp->symbol_count == mark->symbol_count &&
+           interp->hashcons_count == mark->hashcons_count;
 }
 
-SExpr *car(SExpr *list)
+// Frees everything allocated since the mark, unless something allocated since
+// may still be reachable: a binding was set, a symbol or hash-consed node was
+// registered, or a promise remembered a value. Returns whether the memory was
+// released.
+bool arena_release(ArenaMark *mark)
 {
-    if (list == NULL || list->type != TYPE_CONS)
+    if (!arena_sealed(mark))
     {
-        printf("Error: car called on non-cons\n");
-        return NULL; // or makeNil()
+        interp->free_cells = mark->free_cells;
+        return false;
     }
-    return list->cons.car;
-}
 
-SExpr *cdr(SExpr *list)
-{
-    if (list == NULL || list->type != TYPE_CONS)
+    // New chunks are pushed in front of the marked one; large objects are
+    // inserted right behind whichever chunk was current
+    ArenaChunk *chunk = interp->arena;
+    while (chunk != mark->chunk)
     {
-        printf("Error: cdr called on non-cons\n");
-        return NULL; // or makeNil()
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-    return list->cons.cdr;
-}
-
-SExpr *cddr(SExpr *sexp)
-{
-    return cdr(cdr(sexp));
-}
+    if (chunk)
+    {
+        ArenaChunk *large = chunk->next;
+        while (large != mark->chunk_next)
+        {
+            ArenaChunk *next = large->next;
+            free(large);
+            large = next;
+        }
+        chunk->next = mark->chunk_next;
+        chunk->used = mark->used;
+    }
+    interp->arena = mark->chunk;
 
-SExpr *cadr(SExpr *sexp)
-{
-    return car(cdr(sexp));
-}
+    interp->free_cells = mark->free_cells;
+    interp->heap_stats.live_bytes = mark->live_bytes;
 
-SExpr *caddr(SExpr *sexp)
-{
-    return car(cdr(cdr(sexp)));
+    // Call-site caches may remember call sites and values that no longer exist
+    interp->env_version++;
+    return true;
 }
 
-SExpr *cadddr(SExpr *sexp)
+// Ends a mark without releasing anything: what was allocated since stays live
+void arena_keep(ArenaMark *mark)
 {
-    return car(cdr(cdr(cdr(sexp))));
+    interp->free_cells = mark->free_cells;
 }
 
-// ==================== PARSER ====================
-
-void skipWhitespace(const char **input)
+// Whether ptr points into memory allocated since the mark
+bool arena_is_young(ArenaMark *mark, const void *ptr)
 {
-    while (**input != '\0')
+    const char *p = ptr;
+    for (ArenaChunk *chunk = interp->arena; chunk; chunk = chunk->next)
     {
-        // Skip regular whitespace
-        if (isspace(**input))
-{
-        (*input)++;
-continue;
-        }
-
-        // Skip comments starting with ';'
-        if (**input == ';')
+        if (chunk != mark->chunk)
         {
-            // Skip until end of line or end of string
-            while (**input != '\n' && **input != '\0')
-            {
-                (*input)++;
-            }
+            if (p >= chunk->data && p < chunk->data + chunk->used)
+                return true;
             continue;
         }
 
-        // Stop when non-whitespace/non-comment character found
-        break;
+        if (p >= chunk->data + mark->used && p < chunk->data + chunk->used)
+            return true;
+        for (ArenaChunk *large = chunk->next; large != mark->chunk_next; large = large->next)
+            if (p >= large->data && p < large->data + large->used)
+                return true;
+        return false;
     }
+    return false;
 }
 
-SExpr *parseNumber(const char **input)
+// One object carried over a release by arena_release_keeping
+typedef struct Survivor
 {
-    char *end;
-    double val = strtod(*input, &end);
-    *input = end;
-
-    return number(val);
+    void *from;    // address before the release
+    void *to;      // address after it
+    size_t offset; // copy of its bytes in the scratch buffer
+    size_t size;
+    HeapKind kind;
+} Survivor;
+
+typedef struct Evacuation
+{
+    ArenaMark *mark;
+    Survivor *survivors;
+    size_t count;
+    size_t capacity;
+    size_t *table; // address -> survivor index + 1, open addressing
+    size_t table_capacity;
+    char *scratch;
+    size_t scratch_len;
+    size_t scratch_capacity;
+    void **pending; // objects still to be scanned
+    bool *pending_env;
+    size_t pending_count;
+    size_t pending_capacity;
+} Evacuation;
+
+static size_t evacuation_slot(Evacuation *ev, const void *from)
+{
+    // Survivors are often adjacent cells, which a plain shift would cluster
+    unsigned long long h = (unsigned long long)(size_t)from * 0x9E3779B97F4A7C15ULL;
+    size_t slot = (size_t)(h >> 32) & (ev->table_capacity - 1);
+    while (ev->table[slot] && ev->survivors[ev->table[slot] - 1].from != from)
+        slot = (slot + 1) & (ev->table_capacity - 1);
+    return slot;
 }
 
-SExpr *parseQuote(const char **input)
+static Survivor *evacuation_find(Evacuation *ev, const void *from)
 {
-    // skip the quote character
-    (*input)++;
-    // parse the next s-expression
-    SExpr *quoted = parseSExpr(input);
-    // construct (quote quoted)
-    return cons(symbol("quote"), cons(quoted, nil()));
+    if (!ev->table_capacity)
+        return NULL;
+    size_t index = ev->table[evacuation_slot(ev, from)];
+    return index ? &ev->survivors[index - 1] : NULL;
 }
 
-SExpr *parseString(const char **input)
+static void evacuation_push(Evacuation *ev, void *ptr, bool is_env)
 {
-    (*input)++; // skip opening "
-
-    const char *start = *input;
+    if (!ptr || !arena_is_young(ev->mark, ptr) || evacuation_find(ev, ptr))
+        return;
 
-    while (**input && **input != '"')
+    size_t size = sizeof(Env);
+    HeapKind kind = HEAP_ENV;
+    if (!is_env)
     {
-        (*input)++;
+        SExpr *x = ptr;
+        size = sizeof(SExpr);
+        kind = x->type == TYPE_ATOM_NUMBER ? HEAP_NUMBER : HEAP_CONS;
+        if (x->type == TYPE_ATOM_STRING)
+        {
+            kind = HEAP_STRING;
+            if (x->string == (char *)(x + 1))
+                size += strlen(x->string) + 1;
+        }
     }
 
-    int len = *input - start;
-    char *buf = malloc(len + 1); // +1 for storing null bit
-    strncpy(buf, start, len);
-    buf[len] = '\0';
-
-    if (**input == '"')
+    if (ev->count == ev->capacity)
     {
-        (*input)++; // skip closing "
+        ev->capacity = ev->capacity ? ev->capacity * 2 : 64;
+        ev->survivors = realloc(ev->survivors, ev->capacity * sizeof(Survivor));
+    }
+    if ((ev->count + 1) * 2 > ev->table_capacity)
+    {
+        ev->table_capacity = ev->table_capacity ? ev->table_capacity * 2 : 128;
+        free(ev->table);
+        ev->table = calloc(ev->table_capacity, sizeof(size_t));
+        for (size_t i = 0; i < ev->count; i++)
+            ev->table[evacuation_slot(ev, ev->survivors[i].from)] = i + 1;
+    }
+    while (ev->scratch_len + size > ev->scratch_capacity)
+    {
+        ev->scratch_capacity = ev->scratch_capacity ? ev->scratch_capacity * 2 : 4096;
+        ev->scratch = realloc(ev->scratch, ev->scratch_capacity);
+    }
+    if (ev->pending_count == ev->pending_capacity)
+    {
+        ev->pending_capacity = ev->pending_capacity ? ev->pending_capacity * 2 : 64;
+        ev->pending = realloc(ev->pending, ev->pending_capacity * sizeof(void *));
+        ev->pending_env = realloc(ev->pending_env, ev->pending_capacity * sizeof(bool));
     }
 
-    SExpr *str = string(buf);
-
-    free(buf);
+    ev->survivors[ev->count] = (Survivor){.from = ptr, .offset = ev->scratch_len, .size = size, .kind = kind};
+    memcpy(ev->scratch + ev->scratch_len, ptr, size);
+    ev->scratch_len += size;
+    ev->count++;
+    ev->table[evacuation_slot(ev, ptr)] = ev->count;
 
-    return str;
+    ev->pending[ev->pending_count] = ptr;
+    ev->pending_env[ev->pending_count] = is_env;
+    ev->pending_count++;
 }
 
-SExpr *parseSymbol(const char **input)
+// Whether every binding of frame is shadowed by one in env, so that lookups
+// from env can never reach it
+static bool env_shadows(Env *env, Env *frame)
 {
-    const char *start = *input;
-
-    while (**input && !isspace(**input) && **input != '(' && **input != ')')
+    for (SExpr *it = frame->symbols; it->type == TYPE_CONS; it = it->cons.cdr)
     {
-        (*input)++;
+        SExpr *found = env->symbols;
+        while (found->type == TYPE_CONS && found->cons.car != it->cons.car)
+            found = found->cons.cdr;
+        if (found->type != TYPE_CONS)
+            return false;
     }
-
-    int len = *input - start;
-    char *buf = malloc(len + 1); // +1 for storing null bit
-    strncpy(buf, start, len);
-    buf[len] = '\0';
-
-    SExpr *sym = symbol(buf);
-
-    free(buf);
-
-    return sym;
+    return true;
 }
 
-SExpr *parseList(const char **input)
+static void *evacuation_forward(Evacuation *ev, void *ptr)
 {
-    (*input)++; // skip '('
-    skipWhitespace(input);
+    Survivor *survivor = ptr ? evacuation_find(ev, ptr) : NULL;
+    return survivor ? survivor->to : ptr;
+}
 
-    if (**input == ')')
+// Like arena_release, but first copies what roots still reference out of the
+// memory being freed, and puts it back right after the mark; roots are updated
+// in place. The mark stays set, so the survivors are released or kept again
+// next time, and the free list stays set aside until arena_keep. A stream
+// consumer calls this after every step, so its memory is bounded by its
+// state however many steps it takes.
+//
+// Frames whose bindings are all shadowed by a surviving frame are dropped from
+// its parent chain: under dynamic scoping, a recursive stream would otherwise
+// keep the frame of every element it has produced.
+bool arena_release_keeping(ArenaMark *mark, SExpr **roots, size_t count)
+{
+    if (!arena_sealed(mark))
     {
-        (*input)++;
-        return nil(); // empty list
+        interp->free_cells = mark->free_cells;
+        return false;
     }
 
-    SExpr *head = NULL;
-    SExpr *tail = NULL;
-
-    while (**input && **input != ')')
+    // Older objects cannot reference younger ones while the mark is sealed,
+    // so only young objects are scanned
+    Evacuation ev = {.mark = mark};
+    for (size_t i = 0; i < count; i++)
+        evacuation_push(&ev, roots[i], false);
+    while (ev.pending_count > 0)
     {
-        SExpr *elem = parseSExpr(input);
-        if (!head)
+        ev.pending_count--;
+        void *ptr = ev.pending[ev.pending_count];
+        if (ev.pending_env[ev.pending_count])
         {
-            head = tail = cons(elem, nil());
+            Env *env = ptr;
+            Env *parent = env->parent;
+            while (parent && parent->parent && env_shadows(env, parent))
+                parent = parent->parent;
+            ((Env *)(ev.scratch + evacuation_find(&ev, env)->offset))->parent = parent;
+
+            evacuation_push(&ev, env->symbols, false);
+            evacuation_push(&ev, env->values, false);
+            evacuation_push(&ev, parent, true);
+            continue;
         }
-        else
+
+        SExpr *x = ptr;
+        if (x->type == TYPE_CONS)
         {
-            tail->cons.cdr = cons(elem, nil());
-            tail = tail->cons.cdr;
+            evacuation_push(&ev, x->cons.car, false);
+            evacuation_push(&ev, x->cons.cdr, false);
+        }
+        else if (x->type == TYPE_PROMISE)
+        {
+            evacuation_push(&ev, x->promise.expr, false);
+            evacuation_push(&ev, x->promise.env, true);
         }
-
-        skipWhitespace(input);
     }
 
-    if (**input == ')')
+    arena_release(mark);
+    interp->free_cells = NULL;
+
+    for (size_t i = 0; i < ev.count; i++)
     {
-        (*input)++; // skip closing ')'
+        Survivor *survivor = &ev.survivors[i];
+        survivor->to = heap_alloc(survivor->kind, survivor->size);
+        memcpy(survivor->to, ev.scratch + survivor->offset, survivor->size);
     }
+    for (size_t i = 0; i < ev.count; i++)
+    {
+        Survivor *survivor = &ev.survivors[i];
+        if (survivor->kind == HEAP_ENV)
+        {
+            Env *env = survivor->to;
+            env->symbols = evacuation_forward(&ev, env->symbols);
+            env->values = evacuation_forward(&ev, env->values);
+            env->parent = evacuation_forward(&ev, env->parent);
+            continue;
+        }
 
-    return head ? head : nil();
+        SExpr *x = survivor->to;
+        if (x->type == TYPE_CONS)
+        {
+            x->cons.car = evacuation_forward(&ev, x->cons.car);
+            x->cons.cdr = evacuation_forward(&ev, x->cons.cdr);
+        }
+        else if (x->type == TYPE_PROMISE)
+        {
+            x->promise.expr = evacuation_forward(&ev, x->promise.expr);
+            x->promise.env = evacuation_forward(&ev, x->promise.env);
+        }
+        else if (x->type == TYPE_ATOM_STRING && survivor->size > sizeof(SExpr))
+        {
+            x->string = (char *)(x + 1);
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        roots[i] = evacuation_forward(&ev, roots[i]);
+
+    free(ev.survivors);
+    free(ev.table);
+    free(ev.scratch);
+    free(ev.pending);
+    free(ev.pending_env);
+    return true;
 }
 
-SExpr *parseSExpr(const char **input)
+#define FRAME_STACK_SIZE (16 << 20)
+#define WINDOW_STEP_BYTES (64 * 1024)
+#define WINDOW_REMEMBERED_MAX 1024
+
+void window_open(ArenaWindow *window, bool streaming)
 {
-    skipWhitespace(input);
+    window->mark = arena_mark();
+    window->outer = interp->window;
+    window->remembered_base = interp->remembered_count;
+    window->frame_top = interp->frame_top;
+    window->kept_bytes = 0;
+    window->streaming = streaming;
+    interp->window = window;
+}
 
-    if (**input == '\0')
-    {
-        return nil();
-    }
+// Whether slot was allocated since the window opened, on the heap or in a
+// frame on the frame stack
+static bool window_holds(ArenaWindow *window, const void *slot)
+{
+    const char *p = slot;
+    if (interp->frames && p >= window->frame_top && p < interp->frame_top)
+        return true;
+    return arena_is_young(&window->mark, slot);
+}
 
-    if (**input == '\'')
+// Stores value in slot. Outside windows this is a heap write that keeps marks
+// from releasing; inside one, a slot older than the window is remembered
+// instead, so that its value survives the window's releases.
+void heap_write(SExpr **slot, SExpr *value)
+{
+    *slot = value;
+
+    ArenaWindow *window = interp->window;
+    if (!window)
     {
-        return parseQuote(input);
+        interp->heap_writes++;
+        return;
     }
+    if (window_holds(window, slot))
+        return;
 
-    if (**input == '(')
+    for (size_t i = window->remembered_base; i < interp->remembered_count; i++)
+        if (interp->remembered[i] == slot)
+            return;
+    if (interp->remembered_count - window->remembered_base == WINDOW_REMEMBERED_MAX)
     {
-        return parseList(input);
+        // Too many to keep track of: this window and those around it stop
+        // releasing until they are opened again
+        interp->heap_writes++;
+        return;
     }
 
-    if (**input == '"')
+    if (interp->remembered_count == interp->remembered_capacity)
     {
-        return parseString(input);
+        interp->remembered_capacity = interp->remembered_capacity ? interp->remembered_capacity * 2 : 64;
+        interp->remembered = realloc(interp->remembered, interp->remembered_capacity * sizeof(SExpr **));
     }
+    interp->remembered[interp->remembered_count++] = slot;
+}
 
-    if (isdigit(**input) || **input == '-' || **input == '+')
+// Drops the window's remembered slots, except those the window around it must
+// still keep; with no window around, they become a heap write
+static void window_forget(ArenaWindow *window)
+{
+    size_t kept = window->remembered_base;
+    for (size_t i = window->remembered_base; i < interp->remembered_count; i++)
     {
-        return parseNumber(input);
+        SExpr **slot = interp->remembered[i];
+        if (window->outer && !window_holds(window->outer, slot))
+            interp->remembered[kept++] = slot;
     }
-
-    return parseSymbol(input);
+    if (!window->outer && interp->remembered_count > window->remembered_base)
+        interp->heap_writes++;
+    interp->remembered_count = kept;
 }
 
-// ==================== CORE FUNCTIONALITY ====================
-
-SExpr *add(SExpr *a, SExpr *b)
+// Ends one step of the window's owner, whose state is only roots. Once the
+// steps have allocated enough, everything else allocated since the window
+// opened is released; if a step wrote somewhere it cannot track, the window
+// starts over from the current position instead. Releases wait for twice
+// what the last one kept, so state that keeps growing is copied a bounded
+// number of times per byte.
+void window_step(ArenaWindow *window, SExpr **roots, size_t count)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    if (interp->heap_stats.live_bytes < window->mark.live_bytes + window->kept_bytes * 2 + WINDOW_STEP_BYTES)
+        return;
+
+    size_t remembered = interp->remembered_count - window->remembered_base;
+    size_t total = count + remembered;
+    if (total > interp->window_roots_capacity)
     {
-        fprintf(stderr, "Error: add expects number atoms\n");
-        exit(1);
+        interp->window_roots_capacity = total * 2;
+        interp->window_roots = realloc(interp->window_roots, interp->window_roots_capacity * sizeof(SExpr *));
     }
+    SExpr **kept = interp->window_roots;
 
-    return number(a->number + b->number);
+    SExpr ***slots = interp->remembered + window->remembered_base;
+    for (size_t i = 0; i < count; i++)
+        kept[i] = roots[i];
+    for (size_t i = 0; i < remembered; i++)
+        kept[count + i] = *slots[i];
+
+    size_t young = interp->heap_stats.live_bytes - window->mark.live_bytes;
+    if (arena_release_keeping(&window->mark, kept, total))
+    {
+        for (size_t i = 0; i < count; i++)
+            roots[i] = kept[i];
+        for (size_t i = 0; i < remembered; i++)
+            *slots[i] = kept[count + i];
+        window->kept_bytes = interp->heap_stats.live_bytes - window->mark.live_bytes;
+
+        // When most of it is still in use, the state is growing: it is moved
+        // behind the mark rather than copied again by every later release
+        if (window->kept_bytes * 2 > young)
+        {
+            void *free_cells = window->mark.free_cells;
+            window->mark = arena_mark();
+            window->mark.free_cells = free_cells;
+            window->kept_bytes = 0;
+        }
+        return;
+    }
+
+    window_forget(window);
+    window->mark = arena_mark();
+    window->kept_bytes = 0;
 }
 
-SExpr *sub(SExpr *a, SExpr *b)
+// Closes the window, keeping everything allocated since it opened
+void window_close(ArenaWindow *window)
+{
+    window_forget(window);
+    interp->window = window->outer;
+    arena_keep(&window->mark);
+}
+
+Interp *interp_new()
+{
+    Interp *in = calloc(1, sizeof(Interp));
+    Interp *saved = interp;
+    interp = in;
+
+    in->nil = heap_alloc(HEAP_CONS, sizeof(SExpr));
+    in->nil->type = TYPE_NIL;
+    in->sym_true = symbol("t"); // true symbol
+    in->global_env = make_env(NULL);
+    in->simplified = in->nil;
+    in->out = stdout;
+    in->err = stderr;
+
+    // Bootstrap objects are not charged to programs
+    memset(&in->heap_stats, 0, sizeof(in->heap_stats));
+
+    interp = saved;
+    return in;
+}
+
+void interp_enter(Interp *in)
+{
+    interp = in;
+}
+
+// Reports an error and abandons the current evaluation: control returns to
+// the handler installed in interp->on_error, or the process exits.
+_Noreturn void yisp_error(const char *fmt, ...)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    va_list args;
+    va_start(args, fmt);
+    fprintf(interp->err, "Error: ");
+    vfprintf(interp->err, fmt, args);
+    fprintf(interp->err, "\n");
+    va_end(args);
+
+    // Error handlers are installed outside of any evaluation, so no frame on
+    // the stack is live once control reaches one
+    interp->frame_top = interp->frames;
+    profile_unwind();
+
+    // Open windows are abandoned with the evaluation; what they remembered
+    // must now keep any enclosing mark from releasing
+    if (interp->window)
     {
-        fprintf(stderr, "Error: sub expects number atoms\n");
-        exit(1);
+        interp->window = NULL;
+        interp->remembered_count = 0;
+        interp->heap_writes++;
     }
-    return number(a->number - b->number);
+
+    if (interp->on_error)
+        longjmp(*interp->on_error, 1);
+
+    fflush(interp->out);
+    exit(1);
 }
 
-SExpr *mul(SExpr *a, SExpr *b)
+// Releases an interpreter and every object it allocated
+void interp_free(Interp *in)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    ArenaChunk *chunk = in->arena;
+    while (chunk)
     {
-        fprintf(stderr, "Error: mul expects number atoms\n");
-        exit(1);
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-    return number(a->number * b->number);
+
+    ImageMapping *image = in->images;
+    while (image)
+    {
+        ImageMapping *next = image->next;
+        munmap(image->base, image->size);
+        free(image);
+        image = next;
+    }
+
+    free(in->symbol_table);
+    free(in->hashcons_table);
+    free(in->remembered);
+    free(in->window_roots);
+    jit_free(in);
+    if (in->frames)
+        munmap(in->frames, FRAME_STACK_SIZE);
+
+    if (interp == in)
+        interp = NULL;
+    free(in);
 }
 
-SExpr *division(SExpr *a, SExpr *b)
+// Creates a worker interpreter that allocates into its own arena but shares
+// the parent's symbols and globals, for evaluating on another thread
+Interp *interp_fork(Interp *parent)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    Interp *child = calloc(1, sizeof(Interp));
+    child->nil = parent->nil;
+    child->sym_true = parent->sym_true;
+    child->global_env = parent->global_env;
+    child->simplified = parent->nil;
+    child->out = parent->out;
+    child->err = parent->err;
+    child->shared = parent->shared ? parent->shared : parent;
+    return child;
+}
+
+// Hands everything a worker allocated over to its parent and releases the worker
+void interp_join(Interp *parent, Interp *child)
+{
+    if (child->arena)
     {
-        fprintf(stderr, "Error: div expects number atoms\n");
-        exit(1);
+        ArenaChunk *tail = child->arena;
+        while (tail->next)
+            tail = tail->next;
+
+        // Keep the parent's current chunk in front so it keeps bump-allocating
+        if (parent->arena)
+        {
+            tail->next = parent->arena->next;
+            parent->arena->next = child->arena;
+        }
+        else
+        {
+            parent->arena = child->arena;
+        }
     }
-    if (b->number == 0)
+
+    HeapStats *to = &parent->heap_stats;
+    HeapStats *from = &child->heap_stats;
+    for (int kind = 0; kind < HEAP_KINDS; kind++)
     {
-        fprintf(stderr, "Error: division by zero\n");
-        exit(1);
+        to->objects[kind] += from->objects[kind];
+        to->bytes[kind] += from->bytes[kind];
     }
-    return number(a->number / b->number);
+    to->total_objects += from->total_objects;
+    to->total_bytes += from->total_bytes;
+    if (to->live_bytes + from->peak_bytes > to->peak_bytes)
+        to->peak_bytes = to->live_bytes + from->peak_bytes;
+    to->live_bytes += from->live_bytes;
+
+    // What the worker rebound, the parent's caches may still assume
+    if (child->env_version)
+        parent->env_version++;
+
+    free(child->hashcons_table);
+    free(child->remembered);
+    free(child->window_roots);
+    jit_free(child);
+    if (child->frames)
+        munmap(child->frames, FRAME_STACK_SIZE);
+    if (interp == child)
+        interp = parent;
+    free(child);
 }
 
-SExpr *mod(SExpr *a, SExpr *b)
+// ==================== HEAP STATISTICS ====================
+
+// Returns ((kind objects bytes)... (total-bytes n) (live-bytes n) (peak-bytes n))
+SExpr *builtin_heap_stats()
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    // Snapshot first, building the result allocates
+    HeapStats snap = interp->heap_stats;
+
+    SExpr *result = cons(cons(symbol("peak-bytes"), cons(number(snap.peak_bytes), nil())), nil());
+    result = cons(cons(symbol("live-bytes"), cons(number(snap.live_bytes), nil())), result);
+    result = cons(cons(symbol("total-bytes"), cons(number(snap.total_bytes), nil())), result);
+
+    for (int kind = HEAP_KINDS - 1; kind >= 0; kind--)
     {
-        fprintf(stderr, "Error: mod expects number atoms\n");
-        exit(1);
+        SExpr *entry = cons(symbol(heap_kind_names[kind]),
+                            cons(number(snap.objects[kind]), cons(number(snap.bytes[kind]), nil())));
+        result = cons(entry, result);
     }
-    int ia = (int)a->number;
-    int ib = (int)b->number;
-    if (ib == 0)
+
+    return result;
+}
+
+void heap_stats_report()
+{
+    HeapStats *heap_stats = &interp->heap_stats;
+
+    fprintf(stderr, "\nHeap statistics\n");
+    fprintf(stderr, "%-8s %14s %16s\n", "kind", "objects", "bytes");
+    for (int kind = 0; kind < HEAP_KINDS; kind++)
+        fprintf(stderr, "%-8s %14lu %16lu\n", heap_kind_names[kind], heap_stats->objects[kind], heap_stats->bytes[kind]);
+    fprintf(stderr, "%-8s %14lu %16lu\n", "total", heap_stats->total_objects, heap_stats->total_bytes);
+    fprintf(stderr, "live bytes: %lu, peak live bytes: %lu\n", heap_stats->live_bytes, heap_stats->peak_bytes);
+}
+
+// ==================== MANAGE ENVIRONMENT ====================
+
+// Makes sure the calling thread has an interpreter to work in
+void init_symbols()
+{
+    if (!interp)
+        interp_enter(interp_new());
+}
+
+Env *make_env(Env *parent)
+{
+    Env *env = heap_alloc(HEAP_ENV, sizeof(Env));
+    env->symbols = nil();
+    env->values = nil();
+    env->parent = parent;
+    return env;
+}
+
+// Records that a frame binds symbol, which from then on is always looked up.
+// Compiled code that assumed it named its primitive is checked again.
+static inline void bound_locally(SExpr *symbol)
+{
+    // Read first: the flag is set once, then only read by every thread
+    if (!symbol->bound_locally)
     {
-        fprintf(stderr, "Error: modulus by zero\n");
-        exit(1);
+        symbol->bound_locally = true;
+        interp->env_version++;
     }
-    return number(ia % ib);
 }
 
-SExpr *lt(SExpr *a, SExpr *b)
+// Adds a binding to a frame that no call-site cache can have seen yet
+void env_bind(Env *env, SExpr *symbol, SExpr *value)
+{
+    // Add symbol and value to current env frame (head of lists)
+    bound_locally(symbol);
+    env->symbols = cons(symbol, env->symbols);
+    env->values = cons(value, env->values);
+}
+
+// Call-site caches remember what call heads resolved to, which a binding can
+// only change if it held or now holds something callable
+static void binding_changed(SExpr *old, SExpr *value)
+{
+    if (!old || old->type == TYPE_ATOM_SYMBOL || old->type == TYPE_CONS || value->type == TYPE_ATOM_SYMBOL ||
+        value->type == TYPE_CONS)
+        interp->env_version++;
+}
+
+// Overwrites the value of an existing binding
+static void rebind(SExpr **slot, SExpr *value)
+{
+    binding_changed(*slot, value);
+    heap_write(slot, value);
+}
+
+void set(Env *env, SExpr *symbol, SExpr *value)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    if (!env)
     {
-        fprintf(stderr, "Error: lt expects number atoms\n");
-        exit(1);
+        yisp_error("no current environment");
     }
-    return number(a->number < b->number ? 1 : 0);
+
+    // Top-level bindings live in the symbol's own cell and are overwritten in place
+    if (!env->parent && symbol->type == TYPE_ATOM_SYMBOL)
+    {
+        rebind(&symbol->global, value);
+        if (symbol->assumed)
+            optimize_rebound(symbol);
+        return;
+    }
+
+    // So is a binding the frame already has, so loops do not grow it
+    SExpr *vals = env->values;
+    for (SExpr *syms = env->symbols; syms->type == TYPE_CONS; syms = syms->cons.cdr, vals = vals->cons.cdr)
+    {
+        if (syms->cons.car == symbol)
+        {
+            rebind(&vals->cons.car, value);
+            return;
+        }
+    }
+
+    interp->env_version++;
+    bound_locally(symbol);
+    heap_write(&env->symbols, cons(symbol, env->symbols));
+    heap_write(&env->values, cons(value, env->values));
 }
 
-SExpr *gt(SExpr *a, SExpr *b)
+SExpr *lookup(Env *env, SExpr *symbol)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    // Symbols are interned, so identity comparison is enough
+    while (env)
     {
-        fprintf(stderr, "Error: gt expects number atoms\n");
-        exit(1);
+        SExpr *syms = env->symbols;
+        SExpr *vals = env->values;
+
+        while (syms && syms->type == TYPE_CONS)
+        {
+            if (syms->cons.car == symbol)
+            {
+                return vals->cons.car; // return corresponding value
+            }
+            syms = syms->cons.cdr;
+            vals = vals->cons.cdr;
+        }
+
+        env = env->parent;
     }
-    return number(a->number > b->number ? 1 : 0);
+    if (symbol->type == TYPE_ATOM_SYMBOL && symbol->global)
+    {
+        return symbol->global;
+    }
+    if (symbol->type == TYPE_ATOM_SYMBOL && strcmp(symbol->string, "nil") == 0)
+    {
+        return nil(); // Return canonical nil for symbol "nil"
+    }
+    return symbol; // else return symbol itself
 }
 
-SExpr *lte(SExpr *a, SExpr *b)
+// ==================== FRAME STACK ====================
+
+// Frames of lambda calls and let forms live on a per-interpreter LIFO stack,
+// and are popped when the call returns, unless something may keep them
+// longer. Lambdas are plain code under dynamic scoping and capture nothing;
+// only a promise holds on to the frame it was created in, and through it to
+// every frame of the callers. So code that creates promises in its own frame
+// (delay, stream-cons, the stream builtins) gets a heap frame, and a promise
+// created below frames on the stack gets heap copies of them instead.
+//
+// A stack frame is its Env followed by the cells of its bindings.
+
+static size_t list_length(SExpr *list)
+{
+    size_t n = 0;
+    for (; list->type == TYPE_CONS; list = list->cons.cdr)
+        n++;
+    return n;
+}
+
+// Whether ptr lies in a frame currently on the stack
+static bool frame_on_stack(const void *ptr)
+{
+    const char *p = ptr;
+    return p >= interp->frames && p < interp->frame_top;
+}
+
+static bool code_captures_walk(SExpr *code)
+{
+    static const char *capturing[] = {"delay", "stream-cons", "stream-map", "stream-filter", "stream-take",
+                                      "file-lines"};
+    for (; code && code->type == TYPE_CONS; code = code->cons.cdr)
+        if (code_captures_walk(code->cons.car))
+            return true;
+    if (!code || code->type != TYPE_ATOM_SYMBOL)
+        return false;
+    for (size_t i = 0; i < sizeof(capturing) / sizeof(capturing[0]); i++)
+        if (strcmp(code->string, capturing[i]) == 0)
+            return true;
+    return false;
+}
+
+// Whether evaluating code may create a promise in its own frame. Any mention
+// of a capturing form counts, quoted or not, so the answer errs on the side
+// of the heap.
+static bool code_captures_frame(SExpr *code)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    size_t h = (size_t)code;
+    EscapeCache *entry = &interp->escape_cache[((h >> 4) ^ (h >> 14)) & (ESCAPE_CACHE_SIZE - 1)];
+    if (entry->code != code || entry->version != interp->env_version)
     {
-        fprintf(stderr, "Error: lte expects number atoms\n");
-        exit(1);
+        entry->code = code;
+        entry->version = interp->env_version;
+        entry->captures = code_captures_walk(code);
     }
-    return number(a->number <= b->number ? 1 : 0);
+    return entry->captures;
 }
 
-SExpr *gte(SExpr *a, SExpr *b)
+// A frame on top of parent for count bindings, made with frame_bind. It is
+// on the stack unless code may capture it or the stack is full.
+Env *frame_enter(Env *parent, size_t count, SExpr *code)
 {
-    if (a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    size_t bytes = sizeof(Env) + 2 * count * sizeof(SExpr);
+    if (!interp->frames)
     {
-        fprintf(stderr, "Error: gte expects number atoms\n");
-        exit(1);
+        void *base = mmap(NULL, FRAME_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                          -1, 0);
+        if (base == MAP_FAILED)
+            return make_env(parent);
+        interp->frames = interp->frame_top = base;
     }
-    return number(a->number >= b->number ? 1 : 0);
+    if (interp->frame_top + bytes > interp->frames + FRAME_STACK_SIZE || code_captures_frame(code))
+        return make_env(parent);
+
+    Env *frame = (Env *)interp->frame_top;
+    interp->frame_top += bytes;
+    frame->symbols = nil();
+    frame->values = nil();
+    frame->parent = parent;
+    return frame;
 }
 
-SExpr *eq(SExpr *a, SExpr *b)
+// Makes the index-th binding of a frame from frame_enter
+void frame_bind(Env *frame, size_t index, SExpr *symbol, SExpr *value)
 {
-    if (a == NULL || b == NULL)
-        return sym_nil;
-    if (a->type != b->type)
-        return sym_nil;
-    switch (a->type)
+    if (!frame_on_stack(frame))
     {
-    case TYPE_ATOM_NUMBER:
-        return (a->number == b->number) ? sym_true : sym_nil;
-    case TYPE_ATOM_STRING:
-    case TYPE_ATOM_SYMBOL:
-        return (strcmp(a->string, b->string) == 0) ? sym_true : sym_nil;
-    case TYPE_NIL:
-        return sym_true;
-    default:
-        return (a == b) ? sym_true : sym_nil;
+        env_bind(frame, symbol, value);
+        return;
     }
+
+    bound_locally(symbol);
+    SExpr *cells = (SExpr *)(frame + 1) + 2 * index;
+    cells[0].type = TYPE_CONS;
+    cells[0].cons.car = symbol;
+    cells[0].cons.cdr = frame->symbols;
+    cells[1].type = TYPE_CONS;
+    cells[1].cons.car = value;
+    cells[1].cons.cdr = frame->values;
+    frame->symbols = &cells[0];
+    frame->values = &cells[1];
 }
 
-SExpr *not(SExpr *a)
+// Pops a frame from frame_enter, with any frames above it
+void frame_leave(Env *frame)
+{
+    if (frame_on_stack(frame))
+        interp->frame_top = (char *)frame;
+}
+
+// Returns env, or if it reaches frames on the stack, a heap copy of its chain
+// down to the last of them. The copies hold the bindings as they are now.
+Env *frame_promote(Env *env)
 {
-    if (a->type != TYPE_ATOM_NUMBER)
+    if (interp->frame_top == interp->frames)
+        return env;
+
+    Env *last = NULL;
+    for (Env *it = env; it; it = it->parent)
+        if (frame_on_stack(it))
+            last = it;
+    if (!last)
+        return env;
+
+    Env *head = NULL;
+    Env *prev = NULL;
+    for (Env *it = env;; it = it->parent)
     {
-        fprintf(stderr, "Error: not expects a number atom\n");
-        exit(1);
+        Env *copy = make_env(NULL);
+        SExpr **sym_tail = &copy->symbols;
+        SExpr **val_tail = &copy->values;
+        SExpr *vals = it->values;
+        for (SExpr *syms = it->symbols; syms->type == TYPE_CONS; syms = syms->cons.cdr, vals = vals->cons.cdr)
+        {
+            *sym_tail = cons(syms->cons.car, nil());
+            *val_tail = cons(vals->cons.car, nil());
+            sym_tail = &(*sym_tail)->cons.cdr;
+            val_tail = &(*val_tail)->cons.cdr;
+        }
+
+        if (prev)
+            prev->parent = copy;
+        else
+            head = copy;
+        prev = copy;
+        if (it == last)
+        {
+            copy->parent = last->parent;
+            return head;
+        }
     }
+}
 
-    return number(a->number == 0 ? 1 : 0);
+// ==================== CALL-SITE CACHES ====================
+
+static CallCache *call_cache_slot(SExpr *site)
+{
+    size_t h = (size_t)site;
+    return &interp->call_cache[((h >> 4) ^ (h >> 16)) & (CALL_CACHE_SIZE - 1)];
 }
 
-// ==================== PRINT ====================
+static bool call_cache_valid(CallCache *entry, SExpr *site)
+{
+    return entry->site == site && entry->version == interp->env_version && !site->cons.car->bound_locally;
+}
 
-void printList(SExpr *s)
+// Returns (hits lookups) of the call-site cache so far
+SExpr *builtin_call_cache_stats()
 {
-    if (!s)
-        return;
+    return cons(number(interp->call_cache_hits), cons(number(interp->call_cache_lookups), nil()));
+}
 
-    printf("(");
+// ==================== SYMBOL TABLE ====================
 
-    while (s && s->type == TYPE_CONS)
-    {
-        printSExpr(s->cons.car);
-        s = s->cons.cdr;
+// Every symbol is interned in the current interpreter, so each name maps to
+// exactly one SExpr whose global cell holds its top-level value. Forked
+// workers intern into their owner's table, serialised by symbol_share_lock.
 
-        if (s && s->type == TYPE_CONS)
-            printf(" ");
-        else if (s && s->type != TYPE_NIL)
-            printf(" . ");
-    }
+static pthread_mutex_t symbol_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void symbol_table_grow(Interp *owner)
+{
+    size_t old_capacity = owner->symbol_capacity;
+    SExpr **old_table = owner->symbol_table;
+
+    owner->symbol_capacity = old_capacity ? old_capacity * 2 : 1024;
+    owner->symbol_table = calloc(owner->symbol_capacity, sizeof(SExpr *));
 
-    if (s && s->type != TYPE_NIL)
+    for (size_t i = 0; i < old_capacity; i++)
     {
-        printSExpr(s);
+        SExpr *sym = old_table[i];
+        if (!sym)
+            continue;
+
+        size_t slot = hash_string(sym->string, strlen(sym->string)) & (owner->symbol_capacity - 1);
+        while (owner->symbol_table[slot])
+            slot = (slot + 1) & (owner->symbol_capacity - 1);
+        owner->symbol_table[slot] = sym;
     }
 
-    printf(")");
+    free(old_table);
 }
 
-void printSExpr(SExpr *s)
+SExpr *intern(const char *name, size_t len)
 {
-    if (!s)
-    {
-        printf("()");
-        return;
-    }
+    Interp *owner = interp->shared ? interp->shared : interp;
+    if (interp->shared)
+        pthread_mutex_lock(&symbol_share_lock);
 
-    switch (s->type)
+    if ((owner->symbol_count + 1) * 2 > owner->symbol_capacity)
+        symbol_table_grow(owner);
+
+    size_t slot = hash_string(name, len) & (owner->symbol_capacity - 1);
+    SExpr *sym;
+    while ((sym = owner->symbol_table[slot]))
     {
-    case TYPE_ATOM_NUMBER:
-        // use %g for floating or %d for integers depending on your number type
-        printf("%g", s->number);
-        break;
-    case TYPE_ATOM_SYMBOL:
-        printf("%s", s->string);
-        break;
-    case TYPE_ATOM_STRING:
-        printf("\"%s\"", s->string); // Print with surrounding quotes
-        break;
-    case TYPE_CONS:
-        printList(s);
-        break;
-    case TYPE_NIL:
-        printf("()");
-        break;
-    default:
-        printf("<unknown>");
-        break;
+        if (strncmp(sym->string, name, len) == 0 && sym->string[len] == '\0')
+            goto done;
+        slot = (slot + 1) & (owner->symbol_capacity - 1);
     }
+
+    sym = heap_alloc(HEAP_SYMBOL, sizeof(SExpr) + len + 1);
+    sym->type = TYPE_ATOM_SYMBOL;
+    sym->bound_locally = false;
+    sym->assumed = false;
+    sym->string = (char *)(sym + 1);
+    memcpy(sym->string, name, len);
+    sym->string[len] = '\0';
+    sym->global = NULL;
+
+    owner->symbol_table[slot] = sym;
+    owner->symbol_count++;
+
+    // A worker allocated the symbol in its own arena; its marks must not free it
+    if (interp != owner)
+        interp->symbol_count++;
+
+done:
+    if (interp->shared)
+        pthread_mutex_unlock(&symbol_share_lock);
+    return sym;
 }
 
-// ==================== PREDICATE FUNCTIONS ACCEPTING SExpr* ====================
+// ==================== MANAGE S-EXPRESSION ====================
 
-bool isNilSExpr(SExpr *sexp)
+bool is_truthy(SExpr *sexp)
 {
-    return sexp != NULL && sexp->type == TYPE_NIL;
+    return sexp != NULL && sexp->type != TYPE_NIL;
 }
 
-bool isNumberSExpr(SExpr *sexp)
+SExpr *nil()
 {
-    if (!sexp)
-        return false;
-    return sexp->type == TYPE_ATOM_NUMBER;
+    return interp->nil;
 }
 
-bool isSymbolSExpr(SExpr *sexp)
+SExpr *number(double value)
 {
-    if (!sexp)
-        return false;
-    return sexp->type == TYPE_ATOM_SYMBOL;
+    SExpr *a = heap_alloc(HEAP_NUMBER, sizeof(SExpr));
+    a->type = TYPE_ATOM_NUMBER;
+    a->number = value;
+    return a;
+}
+
+SExpr *string(const char *val)
+{
+    // The characters are stored right after the node
+    size_t len = strlen(val);
+    SExpr *a = heap_alloc(HEAP_STRING, sizeof(SExpr) + len + 1);
+    a->type = TYPE_ATOM_STRING;
+    a->string = (char *)(a + 1);
+    memcpy(a->string, val, len + 1);
+    return a;
+}
+
+SExpr *symbol(const char *val)
+{
+    return intern(val, strlen(val));
+}
+
+SExpr *cons(SExpr *car, SExpr *cdr)
+{
+    SExpr *node = heap_alloc(HEAP_CONS, sizeof(SExpr));
+    node->type = TYPE_CONS;
+    node->cons.car = car;
+    node->cons.cdr = cdr;
+    return node;
+}
+
+SExpr *promise(SExpr *expr, Env *env)
+{
+    SExpr *node = heap_alloc(HEAP_CONS, sizeof(SExpr));
+    node->type = TYPE_PROMISE;
+    node->promise.expr = expr;
+    node->promise.env = env ? frame_promote(env) : NULL;
+    return node;
+}
+
+// Evaluates a promise the first time and returns the remembered value after;
+// any other value is returned as is
+SExpr *force(SExpr *value)
+{
+    if (!value || value->type != TYPE_PROMISE)
+        return value;
+
+    while (value->promise.env)
+    {
+        SExpr *result = eval(value->promise.expr, value->promise.env);
+        if (!value->promise.env)
+            break; // forced again while it was being evaluated
+
+        // Inside a stream consumer, remembering a value in an older promise
+        // would keep the consumer's memory alive; it is recomputed instead
+        ArenaWindow *window = interp->window;
+        if (window && window->streaming && !arena_is_young(&window->mark, value))
+            return result;
+        heap_write(&value->promise.expr, result);
+        value->promise.env = NULL;
+    }
+    return value->promise.expr;
+}
+
+SExpr *car(SExpr *list)
+{
+    if (list == NULL || list->type != TYPE_CONS)
+    {
+        fprintf(interp->out, "Error: car called on non-cons\n");
+        return NULL; // or makeNil()
+    }
+    return list->cons.car;
+}
+
+SExpr *cdr(SExpr *list)
+{
+    if (list == NULL || list->type != TYPE_CONS)
+    {
+        fprintf(interp->out, "Error: cdr called on non-cons\n");
+        return NULL; // or makeNil()
+    }
+    return list->cons.cdr;
+}
+
+SExpr *cddr(SExpr *sexp)
+{
+    return cdr(cdr(sexp));
+}
+
+SExpr *cadr(SExpr *sexp)
+{
+    return car(cdr(sexp));
+}
+
+SExpr *caddr(SExpr *sexp)
+{
+    return car(cdr(cdr(sexp)));
+}
+
+SExpr *cadddr(SExpr *sexp)
+{
+    return car(cdr(cdr(cdr(sexp))));
+}
+
+// ==================== HASH-CONSING ====================
+
+// When enabled, the reader replaces quoted constant data with shared canonical
+// cells, so repeated literals such as '(a b c) are stored only once. The table
+// and statistics belong to the current interpreter.
+bool hashcons_enabled = false;
+
+static unsigned long hashcons_hash(SExpr *sexp)
+{
+    unsigned long h = 1469598103934665603UL ^ (unsigned long)sexp->type;
+
+    switch (sexp->type)
+    {
+    case TYPE_ATOM_NUMBER:
+    {
+        unsigned long bits;
+        memcpy(&bits, &sexp->number, sizeof(bits));
+        h ^= bits;
+        h *= 1099511628211UL;
+        break;
+    }
+    case TYPE_ATOM_STRING:
+        h ^= hash_string(sexp->string, strlen(sexp->string));
+        h *= 1099511628211UL;
+        break;
+    case TYPE_CONS:
+        // Children are canonical already, so their addresses identify them
+        h ^= (unsigned long)(size_t)sexp->cons.car;
+        h *= 1099511628211UL;
+        h ^= (unsigned long)(size_t)sexp->cons.cdr;
+        h *= 1099511628211UL;
+        break;
+    default:
+        break;
+    }
+
+    return h ^ (h >> 29);
+}
+
+static bool hashcons_equal(SExpr *a, SExpr *b)
+{
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type)
+    {
+    case TYPE_ATOM_NUMBER:
+        return memcmp(&a->number, &b->number, sizeof(double)) == 0;
+    case TYPE_ATOM_STRING:
+        return strcmp(a->string, b->string) == 0;
+    case TYPE_CONS:
+        return a->cons.car == b->cons.car && a->cons.cdr == b->cons.cdr;
+    default:
+        return a == b;
+    }
+}
+
+static void hashcons_grow()
+{
+    size_t old_capacity = interp->hashcons_capacity;
+    SExpr **old_table = interp->hashcons_table;
+
+    interp->hashcons_capacity = old_capacity ? old_capacity * 2 : 1024;
+    interp->hashcons_table = calloc(interp->hashcons_capacity, sizeof(SExpr *));
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        SExpr *entry = old_table[i];
+        if (!entry)
+            continue;
+
+        size_t slot = hashcons_hash(entry) & (interp->hashcons_capacity - 1);
+        while (interp->hashcons_table[slot])
+            slot = (slot + 1) & (interp->hashcons_capacity - 1);
+        interp->hashcons_table[slot] = entry;
+    }
+
+    free(old_table);
+}
+
+// Returns the canonical cell equal to node, registering node if it is new.
+// A duplicate is released; its children are canonical and stay shared.
+static SExpr *hashcons_intern(SExpr *node)
+{
+    // nil is a singleton and symbols are interned, so both are canonical
+    if (node->type == TYPE_NIL || node->type == TYPE_ATOM_SYMBOL)
+        return node;
+
+    interp->hashcons_stats.nodes++;
+
+    if ((interp->hashcons_count + 1) * 2 > interp->hashcons_capacity)
+        hashcons_grow();
+
+    size_t slot = hashcons_hash(node) & (interp->hashcons_capacity - 1);
+    while (interp->hashcons_table[slot])
+    {
+        SExpr *entry = interp->hashcons_table[slot];
+        if (entry == node)
+            return node;
+
+        if (hashcons_equal(entry, node))
+        {
+            // Only the node's cell is freed for reuse; a string payload stays
+            // in the arena, so it is neither live bytes dropped nor saved
+            heap_free(node, sizeof(SExpr));
+
+            interp->hashcons_stats.shared++;
+            interp->hashcons_stats.bytes_saved += sizeof(SExpr);
+            return entry;
+        }
+
+        slot = (slot + 1) & (interp->hashcons_capacity - 1);
+    }
+
+    interp->hashcons_table[slot] = node;
+    interp->hashcons_count++;
+    return node;
+}
+
+// Canonicalizes a freshly parsed, immutable subtree bottom-up. List spines are
+// walked iteratively so long quoted lists do not recurse once per element.
+SExpr *hashcons(SExpr *sexp)
+{
+    if (!sexp)
+        return sexp;
+
+    if (sexp->type != TYPE_CONS)
+        return hashcons_intern(sexp);
+
+    size_t len = 0;
+    size_t cap = 16;
+    SExpr **spine = malloc(cap * sizeof(SExpr *));
+
+    SExpr *cur = sexp;
+    while (cur && cur->type == TYPE_CONS)
+    {
+        if (len == cap)
+        {
+            cap *= 2;
+            spine = realloc(spine, cap * sizeof(SExpr *));
+        }
+        spine[len++] = cur;
+        cur->cons.car = hashcons(cur->cons.car);
+        cur = cur->cons.cdr;
+    }
+
+    SExpr *tail = cur ? hashcons_intern(cur) : cur;
+    for (size_t i = len; i > 0; i--)
+    {
+        spine[i - 1]->cons.cdr = tail;
+        tail = hashcons_intern(spine[i - 1]);
+    }
+
+    free(spine);
+    return tail;
+}
+
+void hashcons_report(FILE *out)
+{
+    fprintf(out, "hash-consing: %lu quoted nodes, %lu shared, %lu bytes saved, %zu canonical cells\n",
+            interp->hashcons_stats.nodes, interp->hashcons_stats.shared, interp->hashcons_stats.bytes_saved, interp->hashcons_count);
+}
+
+// ==================== PARSER ====================
+
+void skipWhitespace(const char **input)
+{
+    while (**input != '\0')
+    {
+        // Skip regular whitespace
+        if (isspace(**input))
+{
+        (*input)++;
+continue;
+        }
+
+        // Skip comments starting with ';'
+        if (**input == ';')
+        {
+            // Skip until end of line or end of string
+            while (**input != '\n' && **input != '\0')
+            {
+                (*input)++;
+            }
+            continue;
+        }
+
+        // Stop when non-whitespace/non-comment character found
+        break;
+    }
+}
+
+// Length of the decimal numeral s starts with, such as 42, -4.5 or 1e-3, or 0
+// if it starts with none. Hexadecimal, inf and nan are not numerals.
+size_t numeral_length(const char *s)
+{
+    const char *p = s;
+    if (*p == '-' || *p == '+')
+        p++;
+
+    size_t digits = 0;
+    for (; isdigit((unsigned char)*p); p++)
+        digits++;
+    if (*p == '.')
+        for (p++; isdigit((unsigned char)*p); p++)
+            digits++;
+    if (digits == 0)
+        return 0;
+
+    if (*p == 'e' || *p == 'E')
+    {
+        const char *exponent = p + 1;
+        if (*exponent == '-' || *exponent == '+')
+            exponent++;
+        if (isdigit((unsigned char)*exponent))
+            for (p = exponent; isdigit((unsigned char)*p); p++)
+                ;
+    }
+    return (size_t)(p - s);
+}
+
+SExpr *parseNumber(const char **input)
+{
+    char *end;
+    double val = strtod(*input, &end);
+    *input = end;
+
+    return number(val);
+}
+
+SExpr *parseQuote(const char **input)
+{
+    // skip the quote character
+    (*input)++;
+    // parse the next s-expression
+    SExpr *quoted = parseSExpr(input);
+    if (hashcons_enabled)
+        quoted = hashcons(quoted);
+    // construct (quote quoted)
+    return cons(symbol("quote"), cons(quoted, nil()));
+}
+
+SExpr *parseString(const char **input)
+{
+    (*input)++; // skip opening "
+
+    const char *start = *input;
+
+    while (**input && **input != '"')
+    {
+        (*input)++;
+    }
+
+    int len = *input - start;
+    char *buf = malloc(len + 1); // +1 for storing null bit
+    strncpy(buf, start, len);
+    buf[len] = '\0';
+
+    if (**input == '"')
+    {
+        (*input)++; // skip closing "
+    }
+
+    SExpr *str = string(buf);
+
+    free(buf);
+
+    return str;
+}
+
+SExpr *parseSymbol(const char **input)
+{
+    const char *start = *input;
+
+    while (**input && !isspace(**input) && **input != '(' && **input != ')')
+    {
+        (*input)++;
+    }
+
+    return intern(start, *input - start);
+}
+
+SExpr *parseList(const char **input)
+{
+    STACK_CHECK();
+    (*input)++; // skip '('
+    skipWhitespace(input);
+
+    if (**input == ')')
+    {
+        (*input)++;
+        return nil(); // empty list
+    }
+
+    SExpr *head = NULL;
+    SExpr *tail = NULL;
+
+    while (**input && **input != ')')
+    {
+        SExpr *elem = parseSExpr(input);
+        if (!head)
+        {
+            head = tail = cons(elem, nil());
+        }
+        else
+        {
+            tail->cons.cdr = cons(elem, nil());
+            tail = tail->cons.cdr;
+        }
+
+        skipWhitespace(input);
+    }
+
+    if (**input == ')')
+    {
+        (*input)++; // skip closing ')'
+    }
+
+    // Share the datum of a literal (quote x) form as well
+    if (hashcons_enabled && head && head->cons.car->type == TYPE_ATOM_SYMBOL &&
+        strcmp(head->cons.car->string, "quote") == 0 && head->cons.cdr->type == TYPE_CONS)
+    {
+        head->cons.cdr->cons.car = hashcons(head->cons.cdr->cons.car);
+    }
+
+    return head ? head : nil();
+}
+
+SExpr *parseSExpr(const char **input)
+{
+    skipWhitespace(input);
+
+    if (**input == '\0')
+    {
+        return nil();
+    }
+
+    if (**input == '\'')
+    {
+        return parseQuote(input);
+    }
+
+    if (**input == '(')
+    {
+        return parseList(input);
+    }
+
+    if (**input == '"')
+    {
+        return parseString(input);
+    }
+
+    // A token is a number only if all of it is a numeral, so "-" and "1+"
+    // are symbols
+    if (isdigit(**input) || **input == '-' || **input == '+')
+    {
+        char next = (*input)[numeral_length(*input)];
+        if (numeral_length(*input) > 0 && (next == '\0' || isspace(next) || next == '(' || next == ')'))
+            return parseNumber(input);
+    }
+
+    return parseSymbol(input);
+}
+
+// ==================== CORE FUNCTIONALITY ====================
+
+SExpr *add(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("add expects number atoms");
+    }
+
+    return number(a->number + b->number);
+}
+
+SExpr *sub(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("sub expects number atoms");
+    }
+    return number(a->number - b->number);
+}
+
+SExpr *mul(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("mul expects number atoms");
+    }
+    return number(a->number * b->number);
+}
+
+SExpr *division(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("div expects number atoms");
+    }
+    if (b->number == 0)
+    {
+        yisp_error("division by zero");
+    }
+    return number(a->number / b->number);
+}
+
+SExpr *mod(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("mod expects number atoms");
+    }
+    int ia = (int)a->number;
+    int ib = (int)b->number;
+    if (ib == 0)
+    {
+        yisp_error("modulus by zero");
+    }
+    return number(ia % ib);
+}
+
+SExpr *lt(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("lt expects number atoms");
+    }
+    return number(a->number < b->number ? 1 : 0);
+}
+
+SExpr *gt(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("gt expects number atoms");
+    }
+    return number(a->number > b->number ? 1 : 0);
+}
+
+SExpr *lte(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("lte expects number atoms");
+    }
+    return number(a->number <= b->number ? 1 : 0);
+}
+
+SExpr *gte(SExpr *a, SExpr *b)
+{
+    if (!a || !b || a->type != TYPE_ATOM_NUMBER || b->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("gte expects number atoms");
+    }
+    return number(a->number >= b->number ? 1 : 0);
+}
+
+SExpr *eq(SExpr *a, SExpr *b)
+{
+    if (a == NULL || b == NULL)
+        return interp->nil;
+    if (a->type != b->type)
+        return interp->nil;
+    switch (a->type)
+    {
+    case TYPE_ATOM_NUMBER:
+        return (a->number == b->number) ? interp->sym_true : interp->nil;
+    case TYPE_ATOM_STRING:
+    case TYPE_ATOM_SYMBOL:
+        return (strcmp(a->string, b->string) == 0) ? interp->sym_true : interp->nil;
+    case TYPE_NIL:
+        return interp->sym_true;
+    default:
+        return (a == b) ? interp->sym_true : interp->nil;
+    }
+}
+
+SExpr *not(SExpr *a)
+{
+    if (!a || a->type != TYPE_ATOM_NUMBER)
+    {
+        yisp_error("not expects a number atom");
+    }
+
+    return number(a->number == 0 ? 1 : 0);
+}
+
+// ==================== PRINT ====================
+
+// Printing walks nested lists with a stack of its own, on the heap, so a deep
+// structure such as the result of (foldl cons nil l) costs memory rather than
+// C stack. Every entry is a value still to print, or the rest of a list
+// whose earlier elements are printed.
+
+typedef struct PrintEntry
+{
+    SExpr *value;
+    bool rest;
+} PrintEntry;
+
+// Called with an atom, or with NULL and punctuation; returns false to stop
+typedef bool (*PrintEmit)(void *ctx, SExpr *atom, const char *text);
+
+void print_walk(SExpr *s, PrintEmit emit, void *ctx)
+{
+    PrintEntry small[64];
+    PrintEntry *stack = small;
+    size_t capacity = sizeof(small) / sizeof(small[0]);
+    size_t count = 0;
+    stack[count++] = (PrintEntry){s, false};
+
+    while (count > 0)
+    {
+        // An entry pushes at most two in its place
+        if (count + 2 > capacity)
+        {
+            capacity *= 2;
+            if (stack == small)
+            {
+                stack = malloc(capacity * sizeof(PrintEntry));
+                memcpy(stack, small, sizeof(small));
+            }
+            else
+            {
+                stack = realloc(stack, capacity * sizeof(PrintEntry));
+            }
+        }
+
+        PrintEntry entry = stack[--count];
+        SExpr *x = entry.value;
+        bool more = true;
+
+        if (!x)
+        {
+            more = emit(ctx, NULL, entry.rest ? ")" : "()");
+        }
+        else if (entry.rest && x->type == TYPE_NIL)
+        {
+            more = emit(ctx, NULL, ")");
+        }
+        else if (entry.rest && x->type != TYPE_CONS)
+        {
+            // The tail of an improper list, then the close of the list
+            more = emit(ctx, NULL, " . ");
+            stack[count++] = (PrintEntry){NULL, true};
+            stack[count++] = (PrintEntry){x, false};
+        }
+        else if (x->type == TYPE_CONS)
+        {
+            more = emit(ctx, NULL, entry.rest ? " " : "(");
+            stack[count++] = (PrintEntry){x->cons.cdr, true};
+            stack[count++] = (PrintEntry){x->cons.car, false};
+        }
+        else
+        {
+            more = emit(ctx, x, NULL);
+        }
+
+        if (!more)
+            break;
+    }
+
+    if (stack != small)
+        free(stack);
+}
+
+static bool fprint_emit(void *ctx, SExpr *atom, const char *text)
+{
+    FILE *out = ctx;
+    if (!atom)
+    {
+        fputs(text, out);
+        return true;
+    }
+
+    switch (atom->type)
+    {
+    case TYPE_ATOM_NUMBER:
+        fprintf(out, "%g", atom->number);
+        break;
+    case TYPE_ATOM_SYMBOL:
+        fputs(atom->string, out);
+        break;
+    case TYPE_ATOM_STRING:
+        fprintf(out, "\"%s\"", atom->string); // Print with surrounding quotes
+        break;
+    case TYPE_NIL:
+        fputs("()", out);
+        break;
+    case TYPE_PROMISE:
+        fputs("#<promise>", out);
+        break;
+    default:
+        fputs("<unknown>", out);
+        break;
+    }
+    return true;
+}
+
+void fprintList(FILE *out, SExpr *s)
+{
+    if (s)
+        print_walk(s, fprint_emit, out);
+}
+
+void fprintSExpr(FILE *out, SExpr *s)
+{
+    print_walk(s, fprint_emit, out);
+}
+
+void printList(SExpr *s)
+{
+    fprintList(interp->out, s);
+}
+
+void printSExpr(SExpr *s)
+{
+    fprintSExpr(interp->out, s);
+}
+
+// ==================== PREDICATE FUNCTIONS ACCEPTING SExpr* ====================
+
+bool isNilSExpr(SExpr *sexp)
+{
+    return sexp != NULL && sexp->type == TYPE_NIL;
+}
+
+bool isNumberSExpr(SExpr *sexp)
+{
+    if (!sexp)
+        return false;
+    return sexp->type == TYPE_ATOM_NUMBER;
+}
+
+bool isSymbolSExpr(SExpr *sexp)
+{
+    if (!sexp)
+        return false;
+    return sexp->type == TYPE_ATOM_SYMBOL;
+}
+
+bool isStringSExpr(SExpr *sexp)
+{
+    if (!sexp)
+        return false;
+    return sexp->type == TYPE_ATOM_STRING;
+}
+
+bool isListSExpr(SExpr *sexp)
+{
+    if (!sexp)
+        return false;
+    // Lists are nil or cons cells
+    return sexp->type == TYPE_NIL || sexp->type == TYPE_CONS;
+}
+
+bool isSExprSExpr(SExpr *sexp)
+{
+    if (!sexp)
+        return false;
+
+    switch (sexp->type)
+    {
+    case TYPE_NIL:
+    case TYPE_ATOM_NUMBER:
+    case TYPE_ATOM_STRING:
+    case TYPE_ATOM_SYMBOL:
+    case TYPE_CONS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Maps any SExpr to boolean Lisp value: only nil is false, all else true (t)
+SExpr *sexp_to_bool(SExpr *sexp)
+{
+    if (sexp == NULL || sexp->type == TYPE_NIL)
+    {
+        return interp->nil; // false
+    }
+    else
+    {
+        return interp->sym_true; // true
+    }
+}
+
+// ==================== BUILTIN PREDICATE WRAPPERS ====================
+
+SExpr *pred_bool(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    SExpr *b = sexp_to_bool(arg);
+    return b;
+}
+
+SExpr *pred_nil(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    return isNilSExpr(arg) ? interp->sym_true : interp->nil;
+}
+
+SExpr *pred_number(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    return isNumberSExpr(arg) ? interp->sym_true : interp->nil;
+}
+
+SExpr *pred_symbol(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    return isSymbolSExpr(arg) ? interp->sym_true : interp->nil;
+}
+
+SExpr *pred_string(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    return isStringSExpr(arg) ? interp->sym_true : interp->nil;
+}
+
+SExpr *pred_list(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    return isListSExpr(arg) ? interp->sym_true : interp->nil;
+}
+
+SExpr *pred_sexpr(SExpr *args)
+{
+    if (args->type != TYPE_CONS)
+        return interp->nil;
+
+    SExpr *arg = car(args);
+    return isSExprSExpr(arg) ? interp->sym_true : interp->nil;
+}
+
+// Helper to recursively evaluate all arguments in a list
+SExpr *eval_list(SExpr *args, Env *env)
+{
+    SExpr *head = nil();
+    SExpr *tail = NULL;
+    for (; args->type == TYPE_CONS; args = args->cons.cdr)
+    {
+        SExpr *cell = cons(eval(args->cons.car, env), nil());
+        if (tail)
+            tail->cons.cdr = cell;
+        else
+            head = cell;
+        tail = cell;
+    }
+    return head;
+}
+
+SExpr *builtin_print(SExpr *args)
+{
+    if (!args || args->type == TYPE_NIL)
+    {
+        fputs("()\n", interp->out);
+        return interp->nil;
+    }
+
+    SExpr *cur = args;
+    SExpr *last = interp->nil;
+
+    while (cur && cur->type == TYPE_CONS)
+    {
+        SExpr *arg = car(cur);
+        fprintSExpr(interp->out, arg);
+        fputc(' ', interp->out); // space between printed items
+        last = arg;  // remember last printed
+        cur = cdr(cur);
+    }
+
+    fputc('\n', interp->out);
+    fflush(interp->out);
+
+    return interp->nil;
+}
+
+static SExpr *call_builtin(const char *fn_name, SExpr *args, Env *env)
+{
+    if (strcmp(fn_name, "print") == 0 || strcmp(fn_name, "display") == 0)
+        return builtin_print(args);
+    if (strcmp(fn_name, "+") == 0 || strcmp(fn_name, "add") == 0)
+        return add(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "-") == 0 || strcmp(fn_name, "sub") == 0)
+        return sub(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "mul") == 0 || strcmp(fn_name, "*") == 0)
+        return mul(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "div") == 0 || strcmp(fn_name, "/") == 0)
+        return division(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "mod") == 0 || strcmp(fn_name, "%") == 0)
+        return mod(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "=") == 0 || strcmp(fn_name, "eq") == 0)
+        return eq(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "not") == 0)
+        return not(car(args));
+    if (strcmp(fn_name, "lt") == 0)
+        return lt(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "lte") == 0)
+        return lte(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "gt") == 0)
+        return gt(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "gte") == 0)
+        return gte(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "cons") == 0)
+        return cons(car(args), car(cdr(args)));
+    if (strcmp(fn_name, "car") == 0)
+        return car(car(args));
+    if (strcmp(fn_name, "cdr") == 0)
+        return cdr(car(args));
+    if (strcmp(fn_name, "cons") == 0)
+        return cons(car(args), car(cdr(args)));
+    // Predicate built-ins
+    if (strcmp(fn_name, "nil?") == 0)
+        return pred_nil(args);
+    if (strcmp(fn_name, "number?") == 0)
+        return pred_number(args);
+    if (strcmp(fn_name, "symbol?") == 0)
+        return pred_symbol(args);
+    if (strcmp(fn_name, "string?") == 0)
+        return pred_string(args);
+    if (strcmp(fn_name, "list?") == 0)
+        return pred_list(args);
+    if (strcmp(fn_name, "sexpr?") == 0)
+        return pred_sexpr(args);
+    if (strcmp(fn_name, "sexp_to_bool") == 0)
+        return pred_bool(args);
+    if (strcmp(fn_name, "heap-stats") == 0)
+        return builtin_heap_stats();
+    if (strcmp(fn_name, "call-cache-stats") == 0)
+        return builtin_call_cache_stats();
+    if (strcmp(fn_name, "pmap") == 0)
+        return builtin_pmap(args, env);
+    if (strcmp(fn_name, "write-binary") == 0)
+        return builtin_write_binary(args);
+    if (strcmp(fn_name, "read-binary") == 0)
+        return builtin_read_binary(args);
+    if (strcmp(fn_name, "fields") == 0)
+        return builtin_fields(args);
+    if (strcmp(fn_name, "force") == 0)
+        return force(car(args));
+    if (strncmp(fn_name, "stream-", 7) == 0 || strcmp(fn_name, "file-lines") == 0)
+        return builtin_stream(fn_name, args, env);
+
+    return builtin_list(fn_name, args, env);
+}
+
+// Helper: Dispatch built-in functions by name and evaluated args
+SExpr *dispatch_builtin(const char *fn_name, SExpr *args, Env *env)
+{
+    profile_enter(fn_name, PROFILE_PRIMITIVE);
+    SExpr *result = call_builtin(fn_name, args, env);
+    profile_exit(PROFILE_PRIMITIVE);
+    return result;
+}
+
+// Evaluates the body of a lambda in its bound frame, then pops the frame
+static SExpr *run_lambda(SExpr *lambda, Env *frame, const char *name)
+{
+    // The frame of a recursive call binds every name its caller's does, so
+    // lookups from it skip the caller's: their cost does not grow with depth
+    Env *parent = frame->parent;
+    while (parent && parent->parent && env_shadows(frame, parent))
+        parent = parent->parent;
+    frame->parent = parent;
+
+    profile_enter(name, PROFILE_LAMBDA);
+    SExpr *result = eval(caddr(lambda), frame);
+    profile_exit(PROFILE_LAMBDA);
+
+    frame_leave(frame);
+    return result;
+}
+
+// Helper: Apply a lambda to evaluated arguments in a new frame on top of env
+SExpr *apply_lambda(SExpr *lambda, SExpr *actuals, const char *name, Env *env)
+{
+    SExpr *formals = cadr(lambda);
+    size_t count = list_length(formals);
+    size_t given = list_length(actuals);
+
+    // Extra arguments are ignored and missing ones left unbound
+    Env *frame = frame_enter(env, count < given ? count : given, lambda);
+    size_t index = 0;
+    SExpr *sym_it = formals;
+    SExpr *val_it = actuals;
+    while (sym_it->type == TYPE_CONS && val_it->type == TYPE_CONS)
+    {
+        frame_bind(frame, index++, sym_it->cons.car, val_it->cons.car);
+        sym_it = sym_it->cons.cdr;
+        val_it = val_it->cons.cdr;
+    }
+
+    return run_lambda(lambda, frame, name);
+}
+
+// Helper: Evaluate a user-defined lambda function call. The arguments are
+// evaluated straight into the new frame, without an argument list.
+SExpr *eval_lambda_call(SExpr *lambda, SExpr *call_expr, Env *env)
+{
+    SExpr *head = car(call_expr);
+    SExpr *formals = cadr(lambda);
+    SExpr *args = cdr(call_expr);
+    size_t count = list_length(formals);
+    size_t given = list_length(args);
+
+    // Hot numeric lambdas run as native code
+    if (given == count && jit_entry(lambda, head, env))
+        return jit_eval_call(lambda, call_expr, env);
+
+    Env *frame = frame_enter(env, count < given ? count : given, lambda);
+    size_t index = 0;
+    for (; args->type == TYPE_CONS; args = args->cons.cdr)
+    {
+        SExpr *value = eval(args->cons.car, env);
+        if (formals->type == TYPE_CONS)
+        {
+            frame_bind(frame, index++, formals->cons.car, value);
+            formals = formals->cons.cdr;
+        }
+    }
+
+    return run_lambda(lambda, frame, head->type == TYPE_ATOM_SYMBOL ? head->string : "<lambda>");
+}
+
+// Helper: Call a function value (a lambda, or a symbol naming a lambda or a
+// primitive) on a list of already evaluated arguments
+SExpr *apply_function(SExpr *fn, SExpr *args, Env *env)
+{
+    const char *name = "<lambda>";
+    if (fn->type == TYPE_ATOM_SYMBOL)
+    {
+        name = fn->string;
+        SExpr *value = lookup(env, fn);
+        if (value->type == TYPE_CONS)
+            fn = value;
+    }
+
+    if (fn->type == TYPE_CONS && car(fn)->type == TYPE_ATOM_SYMBOL && strcmp(car(fn)->string, "lambda") == 0)
+        return apply_lambda(fn, args, name, env);
+
+    if (fn->type == TYPE_ATOM_SYMBOL)
+        return dispatch_builtin(fn->string, args, env);
+
+    yisp_error("cannot apply a non-function");
+}
+
+// ==================== OPTIMIZER ====================
+
+// Define-time simplification of lambda bodies. A symbol counts as a primitive
+// or special form only when it is neither a parameter of an enclosing lambda
+// nor bound in the defining environment, so user definitions are respected,
+// and no frame has bound it so far. Under dynamic scoping a caller's
+// parameter would otherwise rebind it for the callee; names a caller only
+// starts binding after the definition are not seen (see README). A global
+// name a fold or an inlined call relied on is remembered, and the definitions
+// that did are simplified again from their source when it is rebound.
+
+// Names the definition being simplified relies on
+static _Thread_local SExpr *optimize_assumed;
+
+static void optimize_assume(SExpr *name)
+{
+    for (SExpr *n = optimize_assumed; n->type == TYPE_CONS; n = n->cons.cdr)
+        if (n->cons.car == name)
+            return;
+    optimize_assumed = cons(name, optimize_assumed);
 }
 
-bool isStringSExpr(SExpr *sexp)
+static bool sym_in_list(SExpr *sym, SExpr *list)
 {
-    if (!sexp)
-        return false;
-    return sexp->type == TYPE_ATOM_STRING;
+    for (; list && list->type == TYPE_CONS; list = list->cons.cdr)
+    {
+        SExpr *cur = list->cons.car;
+        if (cur->type == TYPE_ATOM_SYMBOL && strcmp(cur->string, sym->string) == 0)
+            return true;
+    }
+    return false;
 }
 
-bool isListSExpr(SExpr *sexp)
+static bool is_primitive_name(SExpr *sym, const char *name, SExpr *bound, Env *env)
 {
-    if (!sexp)
-        return false;
-    // Lists are nil or cons cells
-    return sexp->type == TYPE_NIL || sexp->type == TYPE_CONS;
+    return sym->type == TYPE_ATOM_SYMBOL && strcmp(sym->string, name) == 0 && !sym->bound_locally &&
+           !sym_in_list(sym, bound) && lookup(env, sym) == sym;
 }
 
-bool isSExprSExpr(SExpr *sexp)
+// Collects every symbol assigned by set/define inside expr, since those
+// names may be rebound at run time and must not be treated as constants.
+static SExpr *collect_assigned(SExpr *expr, SExpr *acc)
 {
-    if (!sexp)
-        return false;
+    while (expr && expr->type == TYPE_CONS)
+    {
+        SExpr *head = expr->cons.car;
+        if (head->type == TYPE_ATOM_SYMBOL && expr->cons.cdr->type == TYPE_CONS &&
+            (strcmp(head->string, "set") == 0 || strcmp(head->string, "define") == 0))
+        {
+            SExpr *target = cadr(expr);
+            if (target->type == TYPE_CONS)
+                target = car(target);
+            if (target->type == TYPE_ATOM_SYMBOL)
+                acc = cons(target, acc);
+        }
+        if (head->type == TYPE_CONS)
+            acc = collect_assigned(head, acc);
+        expr = expr->cons.cdr;
+    }
+    return acc;
+}
 
-    switch (sexp->type)
+// Returns the value of a constant expression, or NULL if expr is not constant
+static SExpr *constant_value(SExpr *expr, SExpr *bound, Env *env)
+{
+    switch (expr->type)
     {
-    case TYPE_NIL:
     case TYPE_ATOM_NUMBER:
     case TYPE_ATOM_STRING:
+    case TYPE_NIL:
+        return expr;
     case TYPE_ATOM_SYMBOL:
+        if (is_primitive_name(expr, "t", bound, env))
+            return expr;
+        if (strcmp(expr->string, "nil") == 0 && !sym_in_list(expr, bound) &&
+            lookup(env, expr)->type == TYPE_NIL)
+            return nil();
+        return NULL;
     case TYPE_CONS:
-        return true;
+        if (is_primitive_name(expr->cons.car, "quote", bound, env) && expr->cons.cdr->type == TYPE_CONS)
+            return cadr(expr);
+        return NULL;
     default:
-        return false;
+        return NULL;
     }
 }
 
-// Maps any SExpr to boolean Lisp value: only nil is false, all else true (t)
-SExpr *sexp_to_bool(SExpr *sexp)
+// Turns a folded value back into an expression that evaluates to it
+static SExpr *constant_expr(SExpr *value)
 {
-    if (sexp == NULL || sexp->type == TYPE_NIL)
+    if (value->type == TYPE_ATOM_NUMBER || value->type == TYPE_ATOM_STRING || value->type == TYPE_NIL)
+        return value;
+    if (value->type == TYPE_ATOM_SYMBOL && strcmp(value->string, "t") == 0)
+        return value;
+    return cons(symbol("quote"), cons(value, nil()));
+}
+
+// Arguments that can be dropped or duplicated without changing behaviour
+static bool is_pure_arg(SExpr *expr, SExpr *bound, Env *env)
+{
+    return expr->type == TYPE_ATOM_SYMBOL || constant_value(expr, bound, env) != NULL;
+}
+
+static SExpr *fold_primitive(SExpr *head, SExpr *args, SExpr *bound, Env *env)
+{
+    static const char *binary_ops[] = {"add", "+", "sub", "-", "mul", "*", "div", "/", "mod", "%",
+                                       "lt", "gt", "lte", "gte", "=", "eq"};
+    int n = 0;
+    SExpr *vals[2];
+
+    for (SExpr *a = args; a->type == TYPE_CONS; a = a->cons.cdr)
     {
-        return sym_nil; // false
+        if (n == 2 || !(vals[n] = constant_value(a->cons.car, bound, env)))
+            return NULL;
+        n++;
     }
-    else
+
+    if (n == 1 && is_primitive_name(head, "not", bound, env) && vals[0]->type == TYPE_ATOM_NUMBER)
     {
-        return sym_true; // true
+        optimize_assume(head);
+        return not(vals[0]);
     }
-}
 
-// ==================== BUILTIN PREDICATE WRAPPERS ====================
+    if (n != 2)
+        return NULL;
 
-SExpr *pred_bool(SExpr *args)
-{
-    if (args->type != TYPE_CONS)
-        return sym_nil;
+    for (size_t i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++)
+    {
+        if (!is_primitive_name(head, binary_ops[i], bound, env))
+            continue;
 
-    SExpr *arg = car(args);
-    SExpr *b = sexp_to_bool(arg);
-    return b;
+        if (i < 14 && (vals[0]->type != TYPE_ATOM_NUMBER || vals[1]->type != TYPE_ATOM_NUMBER))
+            return NULL;
+
+        // Leave division by zero to raise its error at run time
+        if (i >= 6 && i < 10 && (int)vals[1]->number == 0)
+            return NULL;
+
+        optimize_assume(head);
+        if (i >= 14)
+            return eq(vals[0], vals[1]);
+        return call_builtin(head->string, cons(vals[0], cons(vals[1], nil())), env);
+    }
+
+    return NULL;
 }
 
-SExpr *pred_nil(SExpr *args)
+// Inlines calls to known lambdas whose body is a parameter or a constant
+static SExpr *inline_trivial_call(SExpr *head, SExpr *args, SExpr *bound, Env *env)
 {
-    if (args->type != TYPE_CONS)
-        return sym_nil;
+    if (head->type != TYPE_ATOM_SYMBOL || head->bound_locally || sym_in_list(head, bound))
+        return NULL;
 
-    SExpr *arg = car(args);
-    return isNilSExpr(arg) ? sym_true : sym_nil;
+    SExpr *callee = lookup(env, head);
+    if (callee->type != TYPE_CONS || car(callee)->type != TYPE_ATOM_SYMBOL ||
+        strcmp(car(callee)->string, "lambda") != 0 || cddr(callee)->type != TYPE_CONS)
+        return NULL;
+
+    SExpr *formals = cadr(callee);
+    SExpr *body = caddr(callee);
+    SExpr *projected = NULL;
+
+    SExpr *f = formals;
+    SExpr *a = args;
+    for (; f->type == TYPE_CONS && a->type == TYPE_CONS; f = f->cons.cdr, a = a->cons.cdr)
+    {
+        if (body->type == TYPE_ATOM_SYMBOL && strcmp(body->string, car(f)->string) == 0)
+            projected = car(a);
+        else if (!is_pure_arg(car(a), bound, env))
+            return NULL;
+    }
+
+    if (f->type == TYPE_CONS || a->type == TYPE_CONS)
+        return NULL; // arity mismatch, keep the call
+
+    SExpr *value = projected ? NULL : constant_value(body, formals, env);
+    if (!projected && !value)
+        return NULL;
+
+    optimize_assume(head);
+    return projected ? projected : constant_expr(value);
 }
 
-SExpr *pred_number(SExpr *args)
-{
-    if (args->type != TYPE_CONS)
-        return sym_nil;
+SExpr *optimize_expr(SExpr *expr, SExpr *bound, Env *env);
 
-    SExpr *arg = car(args);
-    return isNumberSExpr(arg) ? sym_true : sym_nil;
+static SExpr *optimize_each(SExpr *list, SExpr *bound, Env *env)
+{
+    if (!list || list->type != TYPE_CONS)
+        return list;
+
+    SExpr *first = optimize_expr(list->cons.car, bound, env);
+    SExpr *rest = optimize_each(list->cons.cdr, bound, env);
+    if (first == list->cons.car && rest == list->cons.cdr)
+        return list;
+    return cons(first, rest);
 }
 
-SExpr *pred_symbol(SExpr *args)
+static SExpr *optimize_cond(SExpr *expr, SExpr *bound, Env *env)
 {
-    if (args->type != TYPE_CONS)
-        return sym_nil;
+    SExpr *head = NULL;
+    SExpr *tail = NULL;
 
-    SExpr *arg = car(args);
-    return isSymbolSExpr(arg) ? sym_true : sym_nil;
+    for (SExpr *b = cdr(expr); b->type == TYPE_CONS; b = b->cons.cdr)
+    {
+        SExpr *clause = b->cons.car;
+        if (clause->type != TYPE_CONS || clause->cons.cdr->type != TYPE_CONS)
+            return expr;
+
+        SExpr *test = clause->cons.car;
+        bool is_else = test->type == TYPE_ATOM_SYMBOL && strcmp(test->string, "else") == 0;
+        SExpr *value = NULL;
+
+        if (!is_else)
+        {
+            test = optimize_expr(test, bound, env);
+            value = constant_value(test, bound, env);
+            if (value && !is_truthy(value))
+                continue; // branch can never be taken
+        }
+
+        SExpr *body = optimize_expr(cadr(clause), bound, env);
+        if ((is_else || value) && !head)
+            return body; // first reachable branch always taken
+
+        SExpr *cell = cons(cons(is_else || value ? symbol("else") : test, cons(body, nil())), nil());
+        if (!head)
+            head = tail = cell;
+        else
+        {
+            tail->cons.cdr = cell;
+            tail = cell;
+        }
+
+        if (is_else || value)
+            break;
+    }
+
+    return head ? cons(car(expr), head) : nil();
 }
 
-SExpr *pred_string(SExpr *args)
+SExpr *optimize_expr(SExpr *expr, SExpr *bound, Env *env)
 {
-    if (args->type != TYPE_CONS)
-        return sym_nil;
+    if (!expr || expr->type != TYPE_CONS)
+        return expr;
 
-    SExpr *arg = car(args);
-    return isStringSExpr(arg) ? sym_true : sym_nil;
+    SExpr *head = expr->cons.car;
+
+    if (is_primitive_name(head, "quote", bound, env))
+        return expr;
+
+    if (is_primitive_name(head, "lambda", bound, env))
+    {
+        if (cdr(expr)->type != TYPE_CONS || cddr(expr)->type != TYPE_CONS)
+            return expr;
+
+        SExpr *formals = cadr(expr);
+        SExpr *inner = bound;
+        for (SExpr *f = formals; f->type == TYPE_CONS; f = f->cons.cdr)
+            inner = cons(f->cons.car, inner);
+
+        SExpr *body = optimize_expr(caddr(expr), inner, env);
+        if (body == caddr(expr))
+            return expr;
+        return cons(head, cons(formals, cons(body, cdr(cddr(expr)))));
+    }
+
+    if (is_primitive_name(head, "set", bound, env) || is_primitive_name(head, "define", bound, env))
+    {
+        if (cdr(expr)->type != TYPE_CONS || cadr(expr)->type != TYPE_ATOM_SYMBOL ||
+            cddr(expr)->type != TYPE_CONS)
+            return expr;
+
+        SExpr *value = optimize_expr(caddr(expr), bound, env);
+        if (value == caddr(expr))
+            return expr;
+        return cons(head, cons(cadr(expr), cons(value, cdr(cddr(expr)))));
+    }
+
+    if (is_primitive_name(head, "if", bound, env) && cdr(expr)->type == TYPE_CONS &&
+        cddr(expr)->type == TYPE_CONS)
+    {
+        SExpr *test = optimize_expr(cadr(expr), bound, env);
+        SExpr *value = constant_value(test, bound, env);
+        SExpr *rest = cdr(cddr(expr));
+
+        if (value && is_truthy(value))
+            return optimize_expr(caddr(expr), bound, env);
+        if (value)
+            return rest->type == TYPE_CONS ? optimize_expr(car(rest), bound, env) : nil();
+
+        return cons(head, cons(test, optimize_each(cddr(expr), bound, env)));
+    }
+
+    if (is_primitive_name(head, "cond", bound, env))
+        return optimize_cond(expr, bound, env);
+
+    // Binding lists are not expressions, so these loops are kept as written
+    if (is_primitive_name(head, "do", bound, env) || is_primitive_name(head, "let", bound, env) ||
+        is_primitive_name(head, "let*", bound, env))
+        return expr;
+
+    if ((is_primitive_name(head, "and", bound, env) || is_primitive_name(head, "or", bound, env)) &&
+        cdr(expr)->type == TYPE_CONS && cddr(expr)->type == TYPE_CONS)
+    {
+        SExpr *first = optimize_expr(cadr(expr), bound, env);
+        SExpr *value = constant_value(first, bound, env);
+        bool is_and = strcmp(head->string, "and") == 0;
+
+        if (value && is_truthy(value) == is_and)
+            return optimize_expr(caddr(expr), bound, env);
+        if (value)
+            return first;
+
+        return cons(head, cons(first, optimize_each(cddr(expr), bound, env)));
+    }
+
+    SExpr *new_head = optimize_expr(head, bound, env);
+    SExpr *args = optimize_each(cdr(expr), bound, env);
+
+    SExpr *folded = fold_primitive(head, args, bound, env);
+    if (folded)
+        return constant_expr(folded);
+
+    SExpr *inlined = inline_trivial_call(head, args, bound, env);
+    if (inlined)
+        return inlined;
+
+    if (new_head == head && args == cdr(expr))
+        return expr;
+    return cons(new_head, args);
 }
 
-SExpr *pred_list(SExpr *args)
+// The simplified body of a (lambda formals body) list, collecting in
+// optimize_assumed the global names it relies on
+static SExpr *optimize_body(SExpr *lambda, Env *env)
 {
-    if (args->type != TYPE_CONS)
-        return sym_nil;
+    SExpr *formals = cadr(lambda);
+    SExpr *bound = collect_assigned(caddr(lambda), nil());
+    for (SExpr *f = formals; f->type == TYPE_CONS; f = f->cons.cdr)
+        bound = cons(f->cons.car, bound);
 
-    SExpr *arg = car(args);
-    return isListSExpr(arg) ? sym_true : sym_nil;
+    optimize_assumed = nil();
+    return optimize_expr(caddr(lambda), bound, env);
 }
 
-SExpr *pred_sexpr(SExpr *args)
+// Records what a simplified lambda relies on, so a change can undo it
+static void optimize_remember(SExpr *lambda, SExpr *source)
 {
-    if (args->type != TYPE_CONS)
-        return sym_nil;
-
-    SExpr *arg = car(args);
-    return isSExprSExpr(arg) ? sym_true : sym_nil;
+    for (SExpr *n = optimize_assumed; n->type == TYPE_CONS; n = n->cons.cdr)
+    {
+        n->cons.car->assumed = true;
+        heap_write(&interp->simplified, cons(cons(n->cons.car, cons(lambda, source)), interp->simplified));
+    }
 }
 
-// Helper to recursively evaluate all arguments in a list
-SExpr *eval_list(SExpr *args, Env *env)
+// Returns a copy of a (lambda formals body) list with a simplified body
+SExpr *optimize_lambda(SExpr *lambda, Env *env)
 {
-    if (args->type == TYPE_NIL)
-        return nil();
+    if (cdr(lambda)->type != TYPE_CONS || cddr(lambda)->type != TYPE_CONS)
+        return lambda;
 
-    SExpr *first_eval = eval(car(args), env);
-    SExpr *rest_eval = eval_list(cdr(args), env);
-    return cons(first_eval, rest_eval);
+    SExpr *body = optimize_body(lambda, env);
+    if (body == caddr(lambda))
+        return lambda;
+
+    SExpr *result = cons(car(lambda), cons(cadr(lambda), cons(body, cdr(cddr(lambda)))));
+    optimize_remember(result, lambda);
+    return result;
 }
 
-SExpr *builtin_print(SExpr *args)
+// The global name was rebound: every lambda simplified by relying on it gets
+// a body simplified again from its source, in place, so callers holding the
+// lambda see the change as they would with the code as written
+void optimize_rebound(SExpr *name)
 {
-    if (!args || args->type == TYPE_NIL)
+    SExpr *redo = nil();
+    for (SExpr *e = interp->simplified; e->type == TYPE_CONS; e = e->cons.cdr)
+        if (car(e->cons.car) == name)
+            redo = cons(cdr(e->cons.car), redo);
+
+    // A lambda is remembered again under all the names it now relies on
+    SExpr **link = &interp->simplified;
+    while ((*link)->type == TYPE_CONS)
     {
-        printf("()\n");
-        return sym_nil;
+        bool stale = false;
+        for (SExpr *r = redo; r->type == TYPE_CONS && !stale; r = r->cons.cdr)
+            stale = car(r->cons.car) == cadr((*link)->cons.car);
+        if (stale)
+            heap_write(link, (*link)->cons.cdr);
+        else
+            link = &(*link)->cons.cdr;
     }
 
-    SExpr *cur = args;
-    SExpr *last = sym_nil;
-
-    while (cur && cur->type == TYPE_CONS)
+    for (; redo->type == TYPE_CONS; redo = redo->cons.cdr)
     {
-        SExpr *arg = car(cur);
-        printSExpr(arg);
-        printf(" "); // space between printed items
-        last = arg;  // remember last printed
-        cur = cdr(cur);
+        SExpr *lambda = car(redo->cons.car);
+        SExpr *source = cdr(redo->cons.car);
+        heap_write(&cddr(lambda)->cons.car, optimize_body(source, interp->global_env));
+        optimize_remember(lambda, source);
     }
 
-    printf("\n");
-    fflush(stdout);
+    // Slot counts and compiled code were derived from the old bodies
+    interp->env_version++;
+}
+
+// ==================== LOOPS ====================
+
+// Loops run in one frame whose bindings are overwritten in place on every
+// iteration, without nesting C calls, inside an arena window that releases
+// what the iterations leave behind. Counting to any bound therefore takes
+// constant memory.
 
-    return sym_nil;
+// Evaluates a list of expressions in turn and returns the last value
+static SExpr *eval_body(SExpr *body, Env *env)
+{
+    SExpr *result = nil();
+    for (; body->type == TYPE_CONS; body = body->cons.cdr)
+        result = eval(body->cons.car, env);
+    return result;
 }
 
-// Helper: Dispatch built-in functions by name and evaluated args
-SExpr *dispatch_builtin(const char *fn_name, SExpr *args)
+// The value slot of the most recent binding in frame
+static SExpr **frame_slot(Env *frame)
 {
-    if (strcmp(fn_name, "print") == 0 || strcmp(fn_name, "display") == 0)
-        return builtin_print(args);
-    if (strcmp(fn_name, "+") == 0 || strcmp(fn_name, "add") == 0)
-        return add(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "-") == 0 || strcmp(fn_name, "sub") == 0)
-        return sub(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "mul") == 0 || strcmp(fn_name, "*") == 0)
-        return mul(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "div") == 0 || strcmp(fn_name, "/") == 0)
-        return division(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "mod") == 0 || strcmp(fn_name, "%") == 0)
-        return mod(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "=") == 0 || strcmp(fn_name, "eq") == 0)
-        return eq(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "not") == 0)
-        return not(car(args));
-    if (strcmp(fn_name, "lt") == 0)
-        return lt(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "lte") == 0)
-        return lte(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "gt") == 0)
-        return gt(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "gte") == 0)
-        return gte(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "cons") == 0)
-        return cons(car(args), car(cdr(args)));
-    if (strcmp(fn_name, "car") == 0)
-        return car(car(args));
-    if (strcmp(fn_name, "cdr") == 0)
-        return cdr(car(args));
-    if (strcmp(fn_name, "cons") == 0)
-        return cons(car(args), car(cdr(args)));
-    // Predicate built-ins
-    if (strcmp(fn_name, "nil?") == 0)
-        return pred_nil(args);
-    if (strcmp(fn_name, "number?") == 0)
-        return pred_number(args);
-    if (strcmp(fn_name, "symbol?") == 0)
-        return pred_symbol(args);
-    if (strcmp(fn_name, "string?") == 0)
-        return pred_string(args);
-    if (strcmp(fn_name, "list?") == 0)
-        return pred_list(args);
-    if (strcmp(fn_name, "sexpr?") == 0)
-        return pred_sexpr(args);
-    if (strcmp(fn_name, "sexp_to_bool") == 0)
-        return pred_bool(args);
+    return &frame->values->cons.car;
+}
+
+// (while test body...): evaluates body for as long as test holds; returns nil
+static SExpr *eval_while(SExpr *sexp, Env *env)
+{
+    if (cdr(sexp)->type != TYPE_CONS)
+        yisp_error("while expects a test");
+
+    SExpr *test = cadr(sexp);
+    SExpr *body = cddr(sexp);
+    ArenaWindow window;
+    window_open(&window, false);
+    while (is_truthy(eval(test, env)))
+    {
+        timeout_check();
+        eval_body(body, env);
+        window_step(&window, NULL, 0);
+    }
+    window_close(&window);
+    return nil();
+}
+
+// (do ((var init step)...) (test result...) body...): binds every var to its
+// init in a new frame, then until test holds evaluates body and gives each var
+// with a step the value of that step, all steps seeing the previous values.
+// Returns the value of the last result expression, or nil.
+static SExpr *eval_do(SExpr *sexp, Env *env)
+{
+    SExpr *specs = cdr(sexp)->type == TYPE_CONS ? cadr(sexp) : NULL;
+    SExpr *exit = specs && cddr(sexp)->type == TYPE_CONS ? caddr(sexp) : NULL;
+    if (!exit || exit->type != TYPE_CONS || (specs->type != TYPE_CONS && specs->type != TYPE_NIL))
+        yisp_error("do expects ((var init step)...) (test result...) body...");
+
+    size_t n = list_length(specs);
+    SExpr **slots[n + 1];
+    SExpr *steps[n + 1];
+    SExpr *values[n + 1];
+    size_t stepped = 0;
+
+    Env *frame = make_env(env);
+    for (SExpr *it = specs; it->type == TYPE_CONS; it = it->cons.cdr)
+    {
+        SExpr *spec = it->cons.car;
+        if (spec->type != TYPE_CONS || spec->cons.car->type != TYPE_ATOM_SYMBOL)
+            yisp_error("do expects (var init step) bindings");
+
+        SExpr *init = cdr(spec)->type == TYPE_CONS ? cadr(spec) : nil();
+        env_bind(frame, spec->cons.car, eval(init, env));
+        if (cdr(spec)->type == TYPE_CONS && cddr(spec)->type == TYPE_CONS)
+        {
+            slots[stepped] = frame_slot(frame);
+            steps[stepped] = caddr(spec);
+            stepped++;
+        }
+    }
 
-    return symbol("Error: unrecognized function");
+    SExpr *test = exit->cons.car;
+    SExpr *body = cdr(cddr(sexp));
+    ArenaWindow window;
+    window_open(&window, false);
+    while (!is_truthy(eval(test, frame)))
+    {
+        timeout_check();
+        eval_body(body, frame);
+        for (size_t i = 0; i < stepped; i++)
+            values[i] = eval(steps[i], frame);
+        for (size_t i = 0; i < stepped; i++)
+            rebind(slots[i], values[i]);
+        window_step(&window, NULL, 0);
+    }
+    SExpr *result = eval_body(exit->cons.cdr, frame);
+    window_close(&window);
+    return result;
 }
 
-// Helper: Evaluate a user-defined lambda function call
-SExpr *eval_lambda_call(SExpr *lambda, SExpr *call_expr, Env *env)
+// (let ((var init)...) body): binds every var to the value of its init in a
+// new frame and evaluates body there. let* evaluates each init in the frame
+// as bound so far, so it sees the vars before it.
+static SExpr *eval_let(SExpr *sexp, Env *env, bool sequential)
 {
-    SExpr *formals = cadr(lambda);
-    SExpr *body = caddr(lambda);
+    SExpr *specs = cdr(sexp)->type == TYPE_CONS ? cadr(sexp) : NULL;
+    if (!specs || (specs->type != TYPE_CONS && specs->type != TYPE_NIL) || cddr(sexp)->type != TYPE_CONS)
+        yisp_error("%s expects ((var init)...) and a body", sequential ? "let*" : "let");
+
+    Env *frame = frame_enter(env, list_length(specs), sexp);
+    size_t index = 0;
+    for (SExpr *it = specs; it->type == TYPE_CONS; it = it->cons.cdr)
+    {
+        SExpr *spec = it->cons.car;
+        if (spec->type != TYPE_CONS || spec->cons.car->type != TYPE_ATOM_SYMBOL)
+            yisp_error("let expects (var init) bindings");
+        SExpr *init = cdr(spec)->type == TYPE_CONS ? cadr(spec) : nil();
+        frame_bind(frame, index++, spec->cons.car, eval(init, sequential ? frame : env));
+    }
 
-    SExpr *actuals = eval_list(cdr(call_expr), env);
+    SExpr *result = eval(caddr(sexp), frame);
+    frame_leave(frame);
+    return result;
+}
 
-    Env *new_env = make_env(env);
-    SExpr *sym_it = formals;
-    SExpr *val_it = actuals;
+// Whether expr is a call of the special form named name in env
+static bool is_form(SExpr *expr, const char *name, Env *env)
+{
+    if (expr->type != TYPE_CONS || expr->cons.car->type != TYPE_ATOM_SYMBOL)
+        return false;
+    SExpr *fn_val = lookup(env, expr->cons.car);
+    return fn_val->type == TYPE_ATOM_SYMBOL && strcmp(fn_val->string, name) == 0;
+}
 
-    while (sym_it->type == TYPE_CONS && val_it->type == TYPE_CONS)
+// (let name ((var init)...) body): binds every var to its init in a new frame,
+// and name to a lambda over the vars, then evaluates body. A call of name in
+// tail position of body, through if and cond, overwrites the vars with its
+// arguments and evaluates body again; any other call of name is an ordinary
+// call of the lambda.
+static SExpr *eval_named_let(SExpr *sexp, Env *env)
+{
+    SExpr *name = cadr(sexp);
+    SExpr *specs = cddr(sexp)->type == TYPE_CONS ? caddr(sexp) : NULL;
+    if (!specs || (specs->type != TYPE_CONS && specs->type != TYPE_NIL) || cdr(cddr(sexp))->type != TYPE_CONS)
+        yisp_error("let expects a name, ((var init)...) and a body");
+
+    size_t n = list_length(specs);
+    SExpr **slots[n + 1];
+    SExpr *values[n + 1];
+
+    // Bindings are prepended, so the formals are collected back to front
+    Env *frame = make_env(env);
+    SExpr *formals = nil();
+    size_t i = 0;
+    for (SExpr *it = specs; it->type == TYPE_CONS; it = it->cons.cdr)
     {
-        set(new_env, car(sym_it), car(val_it));
-        sym_it = cdr(sym_it);
-        val_it = cdr(val_it);
+        SExpr *spec = it->cons.car;
+        if (spec->type != TYPE_CONS || spec->cons.car->type != TYPE_ATOM_SYMBOL)
+            yisp_error("let expects (var init) bindings");
+        env_bind(frame, spec->cons.car, eval(cdr(spec)->type == TYPE_CONS ? cadr(spec) : nil(), env));
+        slots[i++] = frame_slot(frame);
     }
-    // Optional: error if arg counts don't match
+    for (SExpr *it = frame->symbols; it->type == TYPE_CONS; it = it->cons.cdr)
+        formals = cons(it->cons.car, formals);
+
+    SExpr *body = car(cdr(cddr(sexp)));
+    SExpr *lambda = cons(symbol("lambda"), cons(formals, cons(body, nil())));
+    env_bind(frame, name, lambda);
+
+    ArenaWindow window;
+    window_open(&window, false);
+    SExpr *expr = body;
+    SExpr *result;
+    while (true)
+    {
+        timeout_check();
+        if (is_form(expr, "if", frame) && cdr(expr)->type == TYPE_CONS && cddr(expr)->type == TYPE_CONS)
+        {
+            SExpr *rest = cdr(cddr(expr));
+            if (is_truthy(eval(cadr(expr), frame)))
+                expr = caddr(expr);
+            else
+                expr = rest->type == TYPE_CONS ? rest->cons.car : nil();
+            continue;
+        }
 
-    SExpr *result = eval(body, new_env);
+        if (is_form(expr, "cond", frame))
+        {
+            SExpr *branch = NULL;
+            for (SExpr *it = cdr(expr); it->type == TYPE_CONS && !branch; it = it->cons.cdr)
+            {
+                SExpr *clause = it->cons.car;
+                if (clause->type != TYPE_CONS || clause->cons.cdr->type != TYPE_CONS)
+                    continue;
+                SExpr *test = clause->cons.car;
+                if ((test->type == TYPE_ATOM_SYMBOL && strcmp(test->string, "else") == 0) ||
+                    is_truthy(eval(test, frame)))
+                    branch = cadr(clause);
+            }
+            expr = branch ? branch : nil();
+            continue;
+        }
 
-    // Optional: free new_env if needed
+        if (expr->type == TYPE_CONS && expr->cons.car == name && lookup(frame, name) == lambda &&
+            list_length(expr->cons.cdr) == n)
+        {
+            i = 0;
+            for (SExpr *it = expr->cons.cdr; it->type == TYPE_CONS; it = it->cons.cdr)
+                values[i++] = eval(it->cons.car, frame);
+            for (i = 0; i < n; i++)
+                rebind(slots[i], values[i]);
+            window_step(&window, NULL, 0);
+            expr = body;
+            continue;
+        }
 
+        result = eval(expr, frame);
+        break;
+    }
+    window_close(&window);
     return result;
 }
 
+// ==================== EVAL ====================
+
 // Main eval function
 SExpr *eval(SExpr *sexp, Env *env)
 {
@@ -886,10 +3252,42 @@ SExpr *eval(SExpr *sexp, Env *env)
 
     if (sexp->type == TYPE_CONS)
     {
+        timeout_check();
+        STACK_CHECK();
+
         SExpr *fn = car(sexp);
+        SExpr *fn_val;
+        CallCache *cache = NULL;
 
-        // Evaluate function position before dispatch
-        SExpr *fn_val = eval(fn, env);
+        // Evaluate function position before dispatch, reusing the resolution
+        // cached for this call site when the head is only bound globally
+        if (fn->type == TYPE_ATOM_SYMBOL)
+        {
+            interp->call_cache_lookups++;
+            cache = call_cache_slot(sexp);
+            if (call_cache_valid(cache, sexp))
+            {
+                interp->call_cache_hits++;
+                fn_val = cache->fn_val;
+            }
+            else if (fn->bound_locally)
+            {
+                fn_val = lookup(env, fn);
+                cache = NULL;
+            }
+            else
+            {
+                fn_val = lookup(env, fn);
+                cache->site = sexp;
+                cache->version = interp->env_version;
+                cache->fn_val = fn_val;
+                cache->callee = NULL;
+            }
+        }
+        else
+        {
+            fn_val = eval(fn, env);
+        }
 
         if (fn_val->type == TYPE_ATOM_SYMBOL)
         {
@@ -897,6 +3295,12 @@ SExpr *eval(SExpr *sexp, Env *env)
             if (strcmp(fn_val->string, "quote") == 0)
                 return cadr(sexp);
 
+            if (strcmp(fn_val->string, "delay") == 0)
+                return promise(cadr(sexp), env);
+
+            if (strcmp(fn_val->string, "stream-cons") == 0)
+                return cons(eval(cadr(sexp), env), promise(caddr(sexp), env));
+
             if (strcmp(fn_val->string, "set") == 0)
             {
                 SExpr *var = cadr(sexp);
@@ -913,6 +3317,9 @@ SExpr *eval(SExpr *sexp, Env *env)
                 {
                     // Simple variable definition: (define x expr)
                     SExpr *val = eval(caddr(sexp), env);
+                    if (val->type == TYPE_CONS && car(val)->type == TYPE_ATOM_SYMBOL &&
+                        strcmp(car(val)->string, "lambda") == 0)
+                        val = optimize_lambda(val, env);
                     set(env, name, val);
                     return name;
                 }
@@ -925,6 +3332,7 @@ SExpr *eval(SExpr *sexp, Env *env)
 
                     SExpr *lambda_sym = symbol("lambda");
                     SExpr *lambda_list = cons(lambda_sym, cons(args, cons(body, nil())));
+                    lambda_list = optimize_lambda(lambda_list, env);
 
                     set(env, fn_name, lambda_list);
                     return fn_name;
@@ -963,6 +3371,19 @@ SExpr *eval(SExpr *sexp, Env *env)
                 return eval(if_false, env);
             }
 
+            if (strcmp(fn_val->string, "while") == 0)
+                return eval_while(sexp, env);
+
+            if (strcmp(fn_val->string, "do") == 0)
+                return eval_do(sexp, env);
+
+            if (strcmp(fn_val->string, "let") == 0 && cdr(sexp)->type == TYPE_CONS &&
+                cadr(sexp)->type == TYPE_ATOM_SYMBOL)
+                return eval_named_let(sexp, env);
+
+            if (strcmp(fn_val->string, "let") == 0 || strcmp(fn_val->string, "let*") == 0)
+                return eval_let(sexp, env, fn_val->string[3] == '*');
+
             if (strcmp(fn_val->string, "cond") == 0)
             {
                 SExpr *branches = cdr(sexp);
@@ -981,7 +3402,17 @@ SExpr *eval(SExpr *sexp, Env *env)
             }
 
             // Lookup function value again for built-in dispatch
-            SExpr *builtin_fn_val = lookup(env, fn_val);
+            SExpr *builtin_fn_val;
+            if (cache && call_cache_valid(cache, sexp) && cache->callee && !fn_val->bound_locally)
+            {
+                builtin_fn_val = cache->callee;
+            }
+            else
+            {
+                builtin_fn_val = lookup(env, fn_val);
+                if (cache && call_cache_valid(cache, sexp) && !fn_val->bound_locally)
+                    cache->callee = builtin_fn_val;
+            }
 
             // User-defined lambda function call
             if (builtin_fn_val->type == TYPE_CONS && car(builtin_fn_val)->type == TYPE_ATOM_SYMBOL &&
@@ -994,7 +3425,7 @@ SExpr *eval(SExpr *sexp, Env *env)
             SExpr *evaled_args = eval_list(cdr(sexp), env);
 
             // Dispatch built-in function
-            return dispatch_builtin(fn_val->string, evaled_args);
+            return dispatch_builtin(fn_val->string, evaled_args, env);
         }
         else if (fn_val->type == TYPE_CONS && car(fn_val)->type == TYPE_ATOM_SYMBOL &&
                  strcmp(car(fn_val)->string, "lambda") == 0)
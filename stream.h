@@ -0,0 +1,313 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "sexpr.h"
+#include "utils.h"
+
+// ==================== RECORD STREAMS ====================
+
+// With --map, --filter or --fold, a lambda given on the command line is
+// compiled once and applied to every line of stdin, awk style:
+//
+//     yisp --map '(lambda (line) (fields line))' < data
+//     yisp --filter '(lambda (line) (eq (car (fields line)) "GET"))' < log
+//     yisp --fold '(lambda (acc line) (add acc 1))' --init 0 < data
+//
+// Input is read in large blocks and split in place: a line is handed to the
+// lambda as a string that points into the block, without copying. Map and
+// filter release everything a record allocated once it is written out, so
+// memory stays constant however long the input is. A record that keeps
+// something, by setting a global, gets its line copied out of the block.
+
+#define STREAM_BLOCK_SIZE (1 << 20)
+#define STREAM_OUTPUT_BUFFER (1 << 16)
+
+typedef enum StreamMode
+{
+    STREAM_NONE,
+    STREAM_MAP,    // print the result for every line
+    STREAM_FILTER, // print the lines the lambda accepts (returns non-nil)
+    STREAM_FOLD,   // thread an accumulator through all lines, print it at the end
+} StreamMode;
+
+StreamMode stream_mode = STREAM_NONE;
+const char *stream_source = NULL; // the lambda expression
+const char *stream_init = NULL;   // initial accumulator of --fold, nil if unset
+
+typedef struct Stream
+{
+    SExpr *fn;
+    Env *env;
+    SExpr *line;  // map and filter: one string cell rebound to every line
+    SExpr *args;  // map and filter: the argument list holding line
+    SExpr *acc;   // fold: the accumulator
+    SExpr *cell;  // fold: holds atom accumulators across released records
+    char *text;   // fold: storage of a string accumulator held in cell
+    size_t records;
+} Stream;
+
+// (fields s): splits s at whitespace into numbers and strings
+SExpr *builtin_fields(SExpr *args)
+{
+    SExpr *s = car(args);
+    if (!s || s->type != TYPE_ATOM_STRING)
+        yisp_error("fields expects a string");
+
+    SExpr *head = nil();
+    SExpr *last = NULL;
+    const char *ptr = s->string;
+    char token[256];
+    while (true)
+    {
+        while (*ptr == ' ' || *ptr == '\t')
+            ptr++;
+        if (*ptr == '\0')
+            return head;
+
+        const char *start = ptr;
+        while (*ptr && *ptr != ' ' && *ptr != '\t')
+            ptr++;
+        size_t len = (size_t)(ptr - start);
+        char *text = len < sizeof(token) ? token : malloc(len + 1);
+        memcpy(text, start, len);
+        text[len] = '\0';
+
+        // Numbers as the reader reads them: "nan" or "0x10" stay text
+        SExpr *field = numeral_length(text) == len ? number(strtod(text, NULL)) : string(text);
+        if (text != token)
+            free(text);
+
+        SExpr *cell = cons(field, nil());
+        if (last)
+            last->cons.cdr = cell;
+        else
+            head = cell;
+        last = cell;
+    }
+}
+
+// Writes a result on its own line; strings are written without quotes
+static void stream_write(SExpr *value)
+{
+    if (value->type == TYPE_ATOM_STRING)
+        fputs(value->string, interp->out);
+    else
+        fprintSExpr(interp->out, value);
+    fputc('\n', interp->out);
+}
+
+// Keeps a fold result past the release of the record that produced it.
+// Returns false if it lives in the record's allocations and must be kept.
+static bool stream_hold(Stream *stream, SExpr *result)
+{
+    if (result == stream->cell || result->type == TYPE_NIL || result->type == TYPE_ATOM_SYMBOL)
+    {
+        stream->acc = result;
+        return true;
+    }
+
+    if (result->type == TYPE_ATOM_NUMBER)
+    {
+        stream->cell->type = TYPE_ATOM_NUMBER;
+        stream->cell->number = result->number;
+        stream->acc = stream->cell;
+        return true;
+    }
+
+    if (result->type == TYPE_ATOM_STRING)
+    {
+        char *text = strdup(result->string);
+        free(stream->text);
+        stream->text = text;
+        stream->cell->type = TYPE_ATOM_STRING;
+        stream->cell->string = text;
+        stream->acc = stream->cell;
+        return true;
+    }
+
+    // A kept list may contain the cell, so later atoms get a fresh one
+    stream->acc = result;
+    stream->cell = NULL;
+    stream->text = NULL;
+    return false;
+}
+
+// Makes the string cell that map and filter rebind to every line
+static void stream_line_cell(Stream *stream)
+{
+    stream->line = heap_alloc(HEAP_STRING, sizeof(SExpr));
+    stream->line->type = TYPE_ATOM_STRING;
+    stream->line->string = "";
+    stream->args = cons(stream->line, nil());
+}
+
+static void stream_record(Stream *stream, char *line, size_t len)
+{
+    stream->records++;
+    if (len > 0 && line[len - 1] == '\r')
+        line[--len] = '\0';
+
+    if (stream_mode == STREAM_FOLD)
+    {
+        if (!stream->cell)
+            stream->cell = heap_alloc(HEAP_NUMBER, sizeof(SExpr));
+
+        // The line is copied: the accumulator may keep it
+        ArenaMark mark = arena_mark();
+        SExpr *args = cons(stream->acc, cons(string(line), nil()));
+        if (stream_hold(stream, apply_function(stream->fn, args, stream->env)))
+            arena_release(&mark);
+        else
+            arena_keep(&mark);
+        return;
+    }
+
+    stream->line->string = line;
+    ArenaMark mark = arena_mark();
+    SExpr *result = apply_function(stream->fn, stream->args, stream->env);
+
+    if (stream_mode == STREAM_FILTER)
+    {
+        if (result->type != TYPE_NIL)
+        {
+            fwrite(line, 1, len, interp->out);
+            fputc('\n', interp->out);
+        }
+    }
+    else
+    {
+        stream_write(result);
+    }
+
+    if (!arena_release(&mark))
+    {
+        // Something the record did outlives it and may hold on to the line,
+        // so the cell gets its own copy of the text and later records a new cell
+        stream->line->string = string(line)->string;
+        stream_line_cell(stream);
+    }
+}
+
+// Reads input in blocks and hands every complete line to stream_record
+static bool stream_read(Stream *stream, int fd)
+{
+    size_t capacity = STREAM_BLOCK_SIZE;
+    char *block = malloc(capacity + 1);
+    size_t filled = 0;
+
+    while (true)
+    {
+        if (filled == capacity)
+        {
+            // A line longer than the block: grow it
+            capacity *= 2;
+            block = realloc(block, capacity + 1);
+        }
+
+        ssize_t got = read(fd, block + filled, capacity - filled);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            fprintf(interp->err, "Error: cannot read input: %s\n", strerror(errno));
+            free(block);
+            return false;
+        }
+        if (got == 0)
+            break;
+
+        // Bytes carried over hold no newline, so only the new ones are searched
+        char *start = block;
+        char *search = block + filled;
+        char *end = search + got;
+        char *newline;
+        while ((newline = memchr(search, '\n', (size_t)(end - search))) != NULL)
+        {
+            *newline = '\0';
+            stream_record(stream, start, (size_t)(newline - start));
+            start = search = newline + 1;
+        }
+
+        // Carry the unfinished line over to the front of the block
+        filled = (size_t)(end - start);
+        memmove(block, start, filled);
+    }
+
+    if (filled > 0)
+    {
+        block[filled] = '\0';
+        stream_record(stream, block, filled);
+    }
+    free(block);
+    return true;
+}
+
+// Evaluates source to a lambda, or to the name of a primitive
+static SExpr *stream_compile(const char *source, Env *env)
+{
+    const char *ptr = source;
+    SExpr *expr = parseSExpr(&ptr);
+    if (!expr || expr->type == TYPE_NIL)
+        yisp_error("cannot parse %s", source);
+
+    SExpr *fn = eval(expr, env);
+    if (fn->type == TYPE_CONS && car(fn)->type == TYPE_ATOM_SYMBOL && strcmp(car(fn)->string, "lambda") == 0)
+        return optimize_lambda(fn, env);
+    if (fn->type != TYPE_ATOM_SYMBOL)
+        yisp_error("%s is not a function", source);
+    return fn;
+}
+
+// Runs the --map, --filter or --fold program over stdin. Returns the exit
+// status for main.
+int runStream()
+{
+    static char output[STREAM_OUTPUT_BUFFER];
+    setvbuf(interp->out, output, _IOFBF, sizeof(output));
+
+    Stream stream = {.env = interp->global_env};
+
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    volatile int status = 0;
+    if (setjmp(on_error) == 0)
+    {
+        stream.fn = stream_compile(stream_source, stream.env);
+
+        if (stream_mode == STREAM_FOLD)
+        {
+            stream.acc = nil();
+            if (stream_init)
+            {
+                const char *ptr = stream_init;
+                stream.acc = eval(parseSExpr(&ptr), stream.env);
+            }
+        }
+        else
+        {
+            stream_line_cell(&stream);
+        }
+
+        if (!stream_read(&stream, STDIN_FILENO))
+            status = 1;
+        else if (stream_mode == STREAM_FOLD)
+            stream_write(stream.acc);
+    }
+    else
+    {
+        fprintf(interp->err, "Error: stopped at record %zu\n", stream.records);
+        status = 1;
+    }
+
+    interp->on_error = NULL;
+    fflush(interp->out);
+    free(stream.text);
+    return status;
+}
+
+#endif // STREAM_H
@@ -1,7 +1,19 @@
 #ifndef TESTS_H
 #define TESTS_H
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "sexpr.h"
 #include "utils.h"
+#include "pmap.h"
+#include "yisp.h"
+#include "image.h"
+#include "cache.h"
+#include "serve.h"
 
 typedef struct Test
 {
@@ -9,6 +21,526 @@ typedef struct Test
     const char *expected_output;
 } Test;
 
+static void tests_on_alarm(int sig)
+{
+    (void)sig;
+    eval_timed_out = 1;
+}
+
+// Evaluates input with a 50 ms deadline, as --serve --timeout does, and
+// writes the error it raised, or its value, to output
+static void run_guarded(const char *input, Env *env, char *output, size_t size)
+{
+    const char *ptr = input;
+    SExpr *expr = parseSExpr(&ptr);
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *saved_err = interp->err;
+    interp->err = open_memstream(&text, &len);
+
+    struct sigaction action = {0};
+    action.sa_handler = tests_on_alarm;
+    sigaction(SIGALRM, &action, NULL);
+    struct itimerval timer = {.it_value = {.tv_usec = 50000}};
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0)
+        sexp_to_string(eval(expr, env), output, size);
+    else
+        snprintf(output, size, "%s", "");
+
+    struct itimerval off = {0};
+    setitimer(ITIMER_REAL, &off, NULL);
+    eval_timed_out = 0;
+    interp->on_error = NULL;
+    fclose(interp->err);
+    interp->err = saved_err;
+    if (text && len > 0)
+    {
+        text[len - 1] = '\0'; // the newline
+        snprintf(output, size, "%s", text);
+    }
+    free(text);
+}
+
+// A check driven from C, as a host program or the command line would drive
+// the interpreter; run writes what it observed to output
+typedef struct HostTest
+{
+    const char *name;
+    const char *expected_output;
+    void (*run)(char *output, size_t size);
+} HostTest;
+
+// An expression over named slots, given a number and a string
+static void host_embed_slots(char *output, size_t size)
+{
+    Yisp *y = yisp_open();
+    const char *slots[] = {"x", "label"};
+    YispFn *sum = yisp_compile(y, "(if (string? label) (add x 1) 0)", slots, 2);
+    YispFn *echo = yisp_compile(y, "label", slots, 2);
+
+    YispValue a = {0}, b = {0};
+    yisp_bind_number(sum, 0, 41);
+    yisp_bind_string(sum, 1, "hello");
+    bool ok = yisp_call(sum, &a);
+    yisp_bind_string(echo, 1, "hello");
+    ok = ok && yisp_call(echo, &b);
+    snprintf(output, size, "%g %s", ok ? a.number : -1, ok && b.type == YISP_STRING ? b.text : "?");
+    yisp_close(y);
+}
+
+// A named lambda over rows of inputs; a batch leaves no memory behind
+static void host_embed_batch(char *output, size_t size)
+{
+    Yisp *y = yisp_open();
+    yisp_load(y, "(define (score price qty) (mul price qty))");
+    YispFn *score = yisp_compile(y, "score", NULL, 0);
+
+    double rows[2000];
+    for (int i = 0; i < 2000; i++)
+        rows[i] = i % 7;
+    YispValue results[1000];
+    yisp_call_batch(score, rows, 3, results);
+    snprintf(output, size, "%g %g %g", results[0].number, results[1].number, results[2].number);
+
+    size_t live = y->interp->heap_stats.live_bytes;
+    yisp_call_batch(score, rows, 1000, results);
+    size_t len = strlen(output);
+    snprintf(output + len, size - len, ", %s", y->interp->heap_stats.live_bytes == live ? "constant" : "grew");
+    yisp_close(y);
+}
+
+// A failed call reports its error and leaves the interpreter usable
+static void host_embed_error(char *output, size_t size)
+{
+    Yisp *y = yisp_open();
+    const char *slots[] = {"x"};
+    YispFn *bad = yisp_compile(y, "(div x 0)", slots, 1);
+    YispFn *good = yisp_compile(y, "(add x 1)", slots, 1);
+    bool unparsed = yisp_compile(y, ")", NULL, 0) == NULL;
+
+    YispValue v = {0};
+    yisp_bind_number(bad, 0, 1);
+    bool failed = !yisp_call(bad, &v);
+    snprintf(output, size, "%s, %s", failed ? yisp_error_message(y) : "no error", unparsed ? "unparsed" : "parsed");
+
+    yisp_bind_number(good, 0, 41);
+    size_t len = strlen(output);
+    snprintf(output + len, size - len, ", %g", yisp_call(good, &v) ? v.number : -1);
+    yisp_close(y);
+}
+
+// A fresh file for a check to write; the caller unlinks it
+static void host_temp_path(char *path)
+{
+    strcpy(path, "/tmp/yisp-test-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        close(fd);
+}
+
+// Evaluates every form of source in the global environment of the current
+// interpreter and appends the printed value of each to output, space separated
+static void host_eval(const char *source, char *output, size_t size)
+{
+    const char *ptr = source;
+    while (true)
+    {
+        skipWhitespace(&ptr);
+        if (*ptr == '\0')
+            break;
+
+        size_t len = strlen(output);
+        if (len > 0 && len + 1 < size)
+            output[len++] = ' ';
+        sexp_to_string(eval(parseSExpr(&ptr), interp->global_env), output + len, size - len);
+    }
+}
+
+// Writes text to a fresh file at path
+static void host_write_file(char *path, const char *text)
+{
+    host_temp_path(path);
+    FILE *file = fopen(path, "w");
+    fputs(text, file);
+    fclose(file);
+}
+
+// Runs this interpreter's executable with arguments, stdin from input if
+// given, and collects its output lines, space separated, and exit status
+static void host_run(const char *arguments, const char *input, char *output, size_t size)
+{
+    char command[512];
+    snprintf(command, sizeof(command), "/proc/%d/exe %s%s%s 2>&1", (int)getpid(), arguments, input ? " < " : "",
+             input ? input : "");
+    output[0] = '\0';
+    FILE *pipe = popen(command, "r");
+    if (!pipe)
+        return;
+
+    size_t len = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), pipe))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        len += snprintf(output + len, size - len, "%s%s", len ? " " : "", line);
+        if (len >= size)
+            len = size - 1;
+    }
+    int status = pclose(pipe);
+    snprintf(output + len, size - len, "%s[%d]", len ? " " : "", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+// --dump-image saves what a file defined, and --image loads it before the next
+static void host_image_command_line(char *output, size_t size)
+{
+    char prelude[32], script[32], image[32];
+    host_write_file(prelude, "(define (inc x) (add x 1))\n");
+    host_write_file(script, "(inc 41)\n");
+    host_temp_path(image);
+
+    char arguments[128], dumped[128], loaded[128];
+    snprintf(arguments, sizeof(arguments), "--dump-image %s %s", image, prelude);
+    host_run(arguments, NULL, dumped, sizeof(dumped));
+    snprintf(arguments, sizeof(arguments), "--image %s %s", image, script);
+    host_run(arguments, NULL, loaded, sizeof(loaded));
+    snprintf(output, size, "%s, %s", dumped, loaded);
+
+    unlink(prelude);
+    unlink(script);
+    unlink(image);
+}
+
+// --hashcons makes equal quoted constants one object and reports what it shared
+static void host_hashcons(char *output, size_t size)
+{
+    char path[40];
+    host_write_file(path, "(eq '(a \"b\" 1) '(a \"b\" 1))\n(car (cdr '(a \"b\" 1)))\n");
+    char arguments[64];
+    snprintf(arguments, sizeof(arguments), "--hashcons %s", path);
+    host_run(arguments, NULL, output, size);
+    unlink(path);
+}
+
+// --map, --filter and --fold over lines of stdin, and an error stopping a run
+static void host_stream_command_line(char *output, size_t size)
+{
+    char input[40];
+    host_write_file(input, "1 a\n2 b\n1 c\n");
+
+    const char *runs[] = {
+        "--map '(lambda (l) (fields l))'",
+        "--filter '(lambda (l) (eq (car (fields l)) 1))'",
+        "--fold '(lambda (acc l) (add acc (car (fields l))))' --init 0",
+        "--map '(lambda (l) (add l 1))'",
+    };
+    output[0] = '\0';
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    {
+        char ran[256];
+        host_run(runs[i], input, ran, sizeof(ran));
+        size_t len = strlen(output);
+        snprintf(output + len, size - len, "%s%s", i ? " | " : "", ran);
+    }
+    unlink(input);
+}
+
+// Globals sharing structure and holding strings survive a dump and a load
+// into another interpreter, sharing still intact
+static void host_image_round_trip(char *output, size_t size)
+{
+    char path[32];
+    host_temp_path(path);
+    Interp *saved = interp;
+
+    Interp *writer = interp_new();
+    interp_enter(writer);
+    output[0] = '\0';
+    char scratch[256] = "";
+    host_eval("(define shared '(1 \"two\" three)) (define pair (cons shared shared)) (define (inc x) (add x 1))",
+              scratch, sizeof(scratch));
+    bool dumped = image_dump(path);
+    interp_free(writer);
+
+    Interp *reader = interp_new();
+    interp_enter(reader);
+    if (dumped && image_load(path))
+        host_eval("pair (eq (car pair) (cdr pair)) (inc 41)", output, size);
+    interp_free(reader);
+
+    interp_enter(saved);
+    unlink(path);
+}
+
+// Copies the image at from to to, with the bytes at offset replaced
+static void host_image_patch(const char *from, const char *to, size_t offset, const void *bytes, size_t len,
+                             bool rechecksum)
+{
+    FILE *in = fopen(from, "rb");
+    size_t size;
+    char *image = read_file(in, &size);
+    fclose(in);
+
+    memcpy(image + offset, bytes, len);
+    if (rechecksum)
+    {
+        ImageHeader *header = (ImageHeader *)image;
+        char *objects = image + sizeof(ImageHeader);
+        char *names = objects + header->objects_size;
+        header->checksum = image_checksum(objects, header->objects_size, names, header->symbols_size,
+                                          (uint64_t *)(names + header->symbols_size), header->binding_count);
+    }
+
+    FILE *out = fopen(to, "wb");
+    fwrite(image, 1, size, out);
+    fclose(out);
+    free(image);
+}
+
+// A damaged image is refused, whether the header, the checksum or the
+// structure under a valid checksum gives it away
+static void host_image_damaged(char *output, size_t size)
+{
+    char path[32], damaged[32];
+    host_temp_path(path);
+    host_temp_path(damaged);
+    Interp *saved = interp;
+
+    Interp *in = interp_new();
+    interp_enter(in);
+    char scratch[256] = "";
+    host_eval("(define kept '(a \"b\" 3))", scratch, sizeof(scratch));
+    image_dump(path);
+
+    FILE *file = fopen(path, "rb");
+    ImageHeader header;
+    bool read = file && fread(&header, sizeof(header), 1, file) == 1;
+    if (file)
+        fclose(file);
+
+    output[0] = '\0';
+    if (read)
+    {
+        // The first binding's value, pointed past the object region
+        size_t binding = sizeof(ImageHeader) + header.objects_size + header.symbols_size;
+        uint64_t outside = header.objects_size + 64;
+        const char *names[] = {"header", "checksum", "structure"};
+        for (int i = 0; i < 3; i++)
+        {
+            if (i == 0)
+                host_image_patch(path, damaged, 0, "X", 1, false);
+            else if (i == 1)
+                host_image_patch(path, damaged, sizeof(ImageHeader) + 8, "\x7f", 1, false);
+            else
+                host_image_patch(path, damaged, binding + sizeof(uint64_t), &outside, sizeof(outside), true);
+
+            size_t len = strlen(output);
+            snprintf(output + len, size - len, "%s%s %s", i ? ", " : "", names[i],
+                     image_map(damaged, 0, NULL) ? "loaded" : "refused");
+        }
+    }
+
+    // The valid file still loads
+    size_t len = strlen(output);
+    snprintf(output + len, size - len, ", intact %s", image_map(path, 0, NULL) ? "loaded" : "refused");
+
+    interp_free(in);
+    interp_enter(saved);
+    unlink(path);
+    unlink(damaged);
+}
+
+// Evaluates the file at path through eval_cached in a fresh interpreter, as
+// a run of its own would, and collects what it printed, space separated
+static void host_eval_cached(const char *path, bool cached, char *output, size_t size)
+{
+    FILE *file = fopen(path, "r");
+    size_t len;
+    char *buffer = read_file(file, &len);
+    fclose(file);
+
+    Interp *saved = interp;
+    Interp *in = interp_new();
+    interp_enter(in);
+    char *text = NULL;
+    size_t text_len = 0;
+    in->out = in->err = open_memstream(&text, &text_len);
+
+    // An error ends the run, as it would end the process
+    bool saved_enabled = cache_enabled;
+    cache_enabled = cached;
+    jmp_buf on_error;
+    in->on_error = &on_error;
+    if (setjmp(on_error) == 0)
+        eval_cached(path, buffer, len, in->global_env);
+    in->on_error = NULL;
+    cache_enabled = saved_enabled;
+
+    fclose(in->out);
+    in->out = stdout;
+    in->err = stderr;
+    interp_free(in);
+    interp_enter(saved);
+
+    for (char *c = text; c && *c; c++)
+        if (*c == '\n')
+            *c = ' ';
+    snprintf(output, size, "%s", text ? text : "");
+    free(text);
+    free(buffer);
+}
+
+// The inode of path, 0 if there is no such file
+static ino_t host_inode(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+// A second run maps the cache the first wrote and prints the same; a changed
+// source is parsed again and the cache replaced
+static void host_cache_hit(char *output, size_t size)
+{
+    char path[40], cache_path[48];
+    host_write_file(path, "(define (sq x) (mul x x))\n(sq 7)\n'(a \"b\" 3)\n");
+    snprintf(cache_path, sizeof(cache_path), "%sc", path);
+
+    char first[128], second[128], changed[128];
+    host_eval_cached(path, true, first, sizeof(first));
+    ino_t written = host_inode(cache_path);
+    host_eval_cached(path, true, second, sizeof(second));
+    bool hit = written && host_inode(cache_path) == written;
+
+    FILE *file = fopen(path, "w");
+    fputs("(define (sq x) (add x x))\n(sq 7)\n", file);
+    fclose(file);
+    host_eval_cached(path, true, changed, sizeof(changed));
+    bool rebuilt = host_inode(cache_path) != written;
+
+    snprintf(output, size, "%s| %s, %s| %s", first, strcmp(first, second) == 0 && hit ? "mapped" : second, changed,
+             rebuilt ? "rebuilt" : "stale");
+    unlink(path);
+    unlink(cache_path);
+}
+
+// A source the reader complains about prints the same through the cache
+static void host_cache_malformed(char *output, size_t size)
+{
+    char path[40], cache_path[48];
+    host_write_file(path, "(add 1 2)\n(add 1");
+    snprintf(cache_path, sizeof(cache_path), "%sc", path);
+
+    char plain[256], cached[256];
+    host_eval_cached(path, false, plain, sizeof(plain));
+    host_eval_cached(path, true, cached, sizeof(cached));
+    snprintf(output, size, "%s", strcmp(plain, cached) == 0 ? "same" : cached);
+    unlink(path);
+    unlink(cache_path);
+}
+
+// Sends a request line and appends its response to output, lines space
+// separated, only the first line if first_only; " |" separates responses
+static void host_serve_ask(int fd, const char *request, bool first_only, char *output, size_t size)
+{
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+    send(fd, "\n", 1, MSG_NOSIGNAL);
+
+    char response[1024];
+    size_t len = 0;
+    while (len < sizeof(response) - 1 && !(len == 1 && response[0] == '\n') &&
+           !(len >= 2 && response[len - 2] == '\n' && response[len - 1] == '\n'))
+    {
+        ssize_t got = recv(fd, response + len, sizeof(response) - 1 - len, 0);
+        if (got <= 0)
+            break;
+        len += (size_t)got;
+    }
+    response[len] = '\0';
+    if (first_only)
+        response[strcspn(response, "\n")] = '\0';
+    while (len > 0 && response[len - 1] == '\n')
+        response[--len] = '\0';
+    for (char *c = response; *c; c++)
+        if (*c == '\n')
+            *c = ' ';
+
+    size_t used = strlen(output);
+    snprintf(output + used, size - used, "%s%s", used ? " | " : "", response);
+}
+
+// Connects to the server at path, waiting up to two seconds for it to listen
+static int host_serve_connect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    for (int attempt = 0; attempt < 200; attempt++)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Requests over a socket: each runs in its own frame under the deadline, the
+// server keeps its counters, and a line over SERVE_LINE_MAX is refused
+static void host_serve(char *output, size_t size)
+{
+    char prelude[40], socket_path[40];
+    host_write_file(prelude, "(define (sq x) (mul x x))\n");
+    host_temp_path(socket_path);
+
+    output[0] = '\0';
+    fflush(NULL); // or the child would write out what is buffered again
+    pid_t server = fork();
+    if (server == 0)
+    {
+        char exe[32];
+        snprintf(exe, sizeof(exe), "/proc/%d/exe", (int)getppid());
+        freopen("/dev/null", "w", stderr);
+        freopen("/dev/null", "w", stdout);
+        execl(exe, exe, "--serve", socket_path, "--timeout", "100", prelude, (char *)NULL);
+        _exit(127);
+    }
+
+    int fd = server > 0 ? host_serve_connect(socket_path) : -1;
+    if (fd >= 0)
+    {
+        host_serve_ask(fd, "(define z 5) (add z 1)", false, output, size);
+        host_serve_ask(fd, "z (sq 9)", false, output, size);
+        host_serve_ask(fd, "(while t 1)", false, output, size);
+        host_serve_ask(fd, ":metrics", true, output, size);
+        close(fd);
+    }
+
+    // One endless line: the server answers once it holds SERVE_LINE_MAX
+    fd = server > 0 ? host_serve_connect(socket_path) : -1;
+    if (fd >= 0)
+    {
+        size_t long_len = SERVE_LINE_MAX + 65536;
+        char *line = malloc(long_len + 1);
+        memset(line, 'a', long_len);
+        line[long_len] = '\0';
+        host_serve_ask(fd, line, false, output, size);
+        free(line);
+        close(fd);
+    }
+
+    if (server > 0)
+    {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    unlink(prelude);
+    unlink(socket_path);
+}
+
 void runTests()
 {
     Test tests[] = {
@@ -125,15 +657,179 @@ void runTests()
         {"(factorial 5)", "120"},
         {"(define compose (lambda (f g) (lambda (x) (f (g x)))))", "compose"},
         {"(define id (lambda (x) x))", "id"},
-        {"(id \"hello\")", "\"hello\""}
+        {"(id \"hello\")", "\"hello\""},
+
+        // Define-time constant folding and inlining
+        {"(define (hours) (mul 60 60))", "hours"},
+        {"hours", "(lambda () 3600)"},
+        {"(hours)", "3600"},
+        {"(define (pick n) (if t (id n) (error)))", "pick"},
+        {"pick", "(lambda (n) n)"},
+        {"(define (grade n) (cond ((eq 1 2) 'low) (else (add n (mul 2 3)))))", "grade"},
+        {"(grade 4)", "10"},
+        {"(define (shadow add) (add 1 2))", "shadow"},
+        {"shadow", "(lambda (add) (add 1 2))"},
+        {"(define (ident x) x)", "ident"},
+        {"(define (via-ident y) (ident y))", "via-ident"},
+        {"via-ident", "(lambda (y) y)"},
+        {"(define (ident x) 42)", "ident"},
+        {"(via-ident 5)", "42"},
+        {"via-ident", "(lambda (y) 42)"},
+
+        // Parallel map. The first (heap-stats) interns its keys, here on a
+        // worker whose loop releases its arena windows.
+        {"(pmap car '((1 2) (3 4) (5 6)))", "(1 3 5)"},
+        {"(pmap (lambda (x) (mul x x)) '(1 2 3))", "(1 4 9)"},
+        {"(pmap car '())", "()"},
+        {"(define (work x) (do ((i 0 (add i 1))) ((eq i 20000) 0) (if (eq x 1) 0 (heap-stats))))", "work"},
+        {"(pmap work '(1 2 3 4 5 6 7 8))", "(0 0 0 0 0 0 0 0)"},
+
+        // Heap statistics
+        {"(car (car (heap-stats)))", "cons"},
+        {"(number? (car (cdr (car (heap-stats)))))", "t"},
+
+        // Binary format
+        {"(write-binary test-bin '(1 -2.5 0.1 \"s\" sym (a . b)))", "t"},
+        {"(read-binary test-bin)", "(1 -2.5 0.1 \"s\" sym (a . b))"},
+        {"(eq (car (cdr (cdr (read-binary test-bin)))) 0.1)", "t"},
+
+        // Splitting lines into fields
+        {"(fields \"GET /a  200\t1.5\")", "(\"GET\" \"/a\" 200 1.5)"},
+        {"(fields \"\")", "()"},
+        {"(fields \"nan inf 0x10 -2.5 1e3\")", "(\"nan\" \"inf\" \"0x10\" -2.5 1000)"},
+        {"'(- 1e 0x10 -2.5)", "(- 1e 0x10 -2.5)"},
+
+        // Promises and streams
+        {"(force (delay (add 1 2)))", "3"},
+        {"(define (nat n) (stream-cons n (nat (add n 1))))", "nat"},
+        {"(stream->list (stream-take 5 (stream-filter (lambda (x) (eq (mod x 2) 0)) (nat 1))))", "(2 4 6 8 10)"},
+        {"(stream-fold add 0 (stream-take 100 (stream-map (lambda (x) (mul x 2)) (nat 1))))", "10100"},
+
+        // Loops
+        {"(define (tally n) (do ((i 0 (add i 1)) (acc 0 (add acc i))) ((eq i n) acc)))", "tally"},
+        {"(tally 100)", "4950"},
+        {"(let loop ((i 0) (acc nil)) (if (eq i 3) acc (loop (add i 1) (cons i acc))))", "(2 1 0)"},
+        {"(define (countdown n) (while (eq (gt n 0) 1) (set n (sub n 1))))", "countdown"},
+        {"(countdown 5)", "()"},
+
+        // Let forms
+        {"(let ((a 2) (b 3)) (mul a b))", "6"},
+        {"(let* ((a 2) (b (add a 1))) (mul a b))", "6"},
+        {"(define (later n) (let ((m (add n 1))) (delay (mul m 2))))", "later"},
+        {"(force (later 4))", "10"},
+
+        // List primitives
+        {"(foldl add 0 (filter (lambda (x) (eq (lt x 3) 1)) (quote (1 2 3 4))))", "3"},
+        {"(reverse (map (lambda (x) (mul x 2)) (append (quote (1 2)) (quote (3)))))", "(6 4 2)"},
+
+        // Sorting
+        {"(sort (quote (3 1 2 5 4)) gt)", "(5 4 3 2 1)"},
+        {"(sort (quote ((2 . a) (1 . b) (2 . c) (1 . d))) (lambda (x y) (lt (car x) (car y))))", "((1 . b) (1 . d) (2 . a) (2 . c))"},
+        {"(define unsorted (quote (3 1 2)))", "unsorted"},
+        {"(sort unsorted lt)", "(1 2 3)"},
+        {"unsorted", "(3 1 2)"},
+
+        // Names a frame binds are never folded or inlined
+        {"(define (pick-first a b) a)", "pick-first"},
+        {"(define (shadow pick-first) 0)", "shadow"},
+        {"(shadow 1)", "0"},
+        {"(define (use-first) (pick-first 1 2))", "use-first"},
+        {"(define (via pick-first) (use-first))", "via"},
+        {"(via (lambda (a b) b))", "2"},
+
+        // Call-site cache
+        {"(define (countup n) (if (eq n 0) 0 (countup (sub n 1))))", "countup"},
+        {"(define hits-before (car (call-cache-stats)))", "hits-before"},
+        {"(countup 100)", "0"},
+        {"(gte (sub (car (call-cache-stats)) hits-before) 300)", "1"},
+
+        // Deep recursion
+        {"(define (depth n) (if (eq n 0) 0 (add 1 (depth (sub n 1)))))", "depth"},
+        {"(depth 50000)", "50000"},
+
+        // Compiled lambdas
+        {"(define (tri n) (if (eq n 0) 0 (add n (tri (sub n 1)))))", "tri"},
+        {"(tri 5000)", "1.25025e+07"},
+        {"(define (quot n d) (if (eq n 0) (div 100 d) (quot (sub n 1) d)))", "quot"},
+        {"(quot 2000 4)", "25"},
+        {"(define (pick n k) (if (eq n 0) k (pick (sub n 1) k)))", "pick"},
+        {"(pick 2000 7)", "7"},
+        {"(pick 2000 'sym)", "sym"},
+        {"(pick 2000 \"str\")", "\"str\""},
+        {"(define (modn n a b) (if (eq n 0) (mod a b) (modn (sub n 1) a b)))", "modn"},
+        {"(modn 2000 7 3)", "1"},
+        {"(modn 2000 -7 3)", "-1"},
+        {"(modn 2000 7 -3)", "1"},
+        {"(modn 2000 -7.5 2)", "-1"},
+        {"(define (same n x) (if (eq n 0) (if (eq x x) 1 0) (same (sub n 1) x)))", "same"},
+        {"(same 2000 5)", "1"},
+        {"(same 2000 (sub (mul 1e308 10) (mul 1e308 10)))", "0"},
+        {"(define (three) (add 1 2))", "three"},
+        {"(define (add a b) (sub a b))", "add"},
+        {"(tri 10)", "5"},
+        {"(three)", "-1"},
+        {"(define add 'add)", "add"},
+        {"(tri 100)", "5050"},
+        {"(three)", "3"},
+        {"(define (scale n k) (if (eq k 0) (mul n 2) (scale n (sub k 1))))", "scale"},
+        {"(define (with-mul mul) (scale 3 10))", "with-mul"},
+        {"(scale 3 2000)", "6"},
+        {"(with-mul add)", "5"},
+        {"(scale 3 2000)", "6"}
     };
 
     Env *test_env = make_env(NULL);
     init_symbols();
 
+    // pmap runs on worker threads even on a single CPU
+    if (pmap_threads < 0)
+        pmap_threads = 3;
+
+    // A file of its own for the binary format tests, so concurrent runs do
+    // not write over each other's
+    char bin_path[] = "/tmp/yisp-test-XXXXXX";
+    int bin_fd = mkstemp(bin_path);
+    if (bin_fd >= 0)
+        close(bin_fd);
+    set(test_env, symbol("test-bin"), string(bin_path));
+
+    // Rows that may raise an error. Loops whose bodies make no calls must
+    // still stop at the deadline, and compiled code hands errors to the
+    // interpreter, which keeps the lambda from then on.
+    Test guarded[] = {
+        {"(while t 1)", "Error: evaluation timed out"},
+        {"(do () (()))", "Error: evaluation timed out"},
+        {"(let loop () (loop))", "Error: evaluation timed out"},
+        {"(quot 2000 0)", "Error: division by zero"},
+        {"(quot 2000 5)", "20"},
+    };
+
+    HostTest hosted[] = {
+        {"embedding: slots bound to a number and a string", "42 hello", host_embed_slots},
+        {"embedding: a batch of rows, then one that should take no memory", "0 6 20, constant", host_embed_batch},
+        {"embedding: a failed call, then a good one", "division by zero, unparsed, 42", host_embed_error},
+        {"image: shared structure and strings, dumped and loaded", "((1 \"two\" three) 1 \"two\" three) t 42",
+         host_image_round_trip},
+        {"image: --dump-image, then --image", "inc [0], 42 [0]", host_image_command_line},
+        {"cache: a source run twice, then changed", "sq 49 (a \"b\" 3) | mapped, sq 14 | rebuilt", host_cache_hit},
+        {"cache: a malformed source", "same", host_cache_malformed},
+        {"hashcons: three equal quoted lists",
+         "hash-consing: 15 quoted nodes, 10 shared, 240 bytes saved, 5 canonical cells t \"b\" [0]", host_hashcons},
+        {"stream: --map, --filter and --fold over stdin",
+         "(1 \"a\") (2 \"b\") (1 \"c\") [0] | 1 a 1 c [0] | 4 [0] | "
+         "Error: add expects number atoms Error: stopped at record 1 [1]",
+         host_stream_command_line},
+        {"serve: requests over a socket",
+         "z 6 | z 81 | Error: evaluation timed out | requests 3 | Error: request line too long", host_serve},
+        {"image: damaged copies of an image", "header refused, checksum refused, structure refused, intact loaded",
+         host_image_damaged},
+    };
+
     int n = sizeof(tests) / sizeof(tests[0]);
+    int n_guarded = sizeof(guarded) / sizeof(guarded[0]);
+    int n_hosted = sizeof(hosted) / sizeof(hosted[0]);
 
-    printf("Running %d tests...\n", n);
+    printf("Running %d tests...\n", n + n_guarded + n_hosted);
     printf("------------------------------------------------------------\n");
 
     for (int i = 0; i < n; i++)
@@ -164,6 +860,33 @@ void runTests()
         // Cleanup if needed
     }
 
+    for (int i = 0; i < n_guarded; i++)
+    {
+        char output_buffer[1024];
+        run_guarded(guarded[i].input, test_env, output_buffer, sizeof(output_buffer));
+        bool pass = strcmp(guarded[i].expected_output, output_buffer) == 0;
+
+        printf("TEST %2d %s \n", n + i + 1, pass ? "PASSED" : "FAILED");
+        printf("Input:           %s\n", guarded[i].input);
+        printf("Expected output: %s\n", guarded[i].expected_output);
+        printf("Actual output:   %s\n", output_buffer);
+        printf("------------------------------------------------------------\n");
+    }
+
+    for (int i = 0; i < n_hosted; i++)
+    {
+        char output_buffer[1024];
+        hosted[i].run(output_buffer, sizeof(output_buffer));
+        bool pass = strcmp(hosted[i].expected_output, output_buffer) == 0;
+
+        printf("TEST %2d %s \n", n + n_guarded + i + 1, pass ? "PASSED" : "FAILED");
+        printf("Input:           %s\n", hosted[i].name);
+        printf("Expected output: %s\n", hosted[i].expected_output);
+        printf("Actual output:   %s\n", output_buffer);
+        printf("------------------------------------------------------------\n");
+    }
+
+    unlink(bin_path);
 }
 
 
@@ -22,68 +22,89 @@ static void append_to_buffer(char *buf, size_t size, size_t *pos, const char *fm
     }
 }
 
-static void sexp_to_string_internal(SExpr *sexp, char *buf, size_t size, size_t *pos)
+typedef struct PrintBuffer
 {
-    if (!sexp)
-    {
-        append_to_buffer(buf, size, pos, "()");
+    char *buf;
+    size_t size;
+    size_t pos;
+} PrintBuffer;
+
+// Stops the walk once the buffer is full
+static bool sexp_to_string_emit(void *ctx, SExpr *atom, const char *text)
+{
+    PrintBuffer *out = ctx;
+    if (!atom)
+        append_to_buffer(out->buf, out->size, &out->pos, "%s", text);
+    else if (atom->type == TYPE_ATOM_NUMBER)
+        append_to_buffer(out->buf, out->size, &out->pos, "%g", atom->number);
+    else if (atom->type == TYPE_ATOM_SYMBOL)
+        append_to_buffer(out->buf, out->size, &out->pos, "%s", atom->string);
+    else if (atom->type == TYPE_ATOM_STRING)
+        append_to_buffer(out->buf, out->size, &out->pos, "\"%s\"", atom->string);
+    else if (atom->type == TYPE_NIL)
+        append_to_buffer(out->buf, out->size, &out->pos, "()");
+    else if (atom->type == TYPE_PROMISE)
+        append_to_buffer(out->buf, out->size, &out->pos, "#<promise>");
+    else
+        append_to_buffer(out->buf, out->size, &out->pos, "<unknown>");
+    return out->pos < out->size - 1;
+}
+
+void sexp_to_string(SExpr *sexp, char *buf, size_t size)
+{
+    if (size == 0)
         return;
-    }
+    PrintBuffer out = {.buf = buf, .size = size};
+    print_walk(sexp, sexp_to_string_emit, &out);
+    buf[out.pos < size ? out.pos : size - 1] = '\0'; // Null-terminate safely
+}
 
-    switch (sexp->type)
-    {
-    case TYPE_ATOM_NUMBER:
-        append_to_buffer(buf, size, pos, "%g", sexp->number);
-        break;
+// Reads the rest of a file into a NUL-terminated buffer owned by the caller
+char *read_file(FILE *file, size_t *length)
+{
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
 
-    case TYPE_ATOM_SYMBOL:
-        append_to_buffer(buf, size, pos, "%s", sexp->string);
-        break;
+    if (size < 0)
+        size = 0;
 
-    case TYPE_ATOM_STRING:
-        append_to_buffer(buf, size, pos, "\"%s\"", sexp->string);
-        break;
+    char *buffer = malloc(size + 1);
+    size_t read = fread(buffer, 1, size, file);
+    buffer[read] = '\0';
 
-    case TYPE_NIL:
-        append_to_buffer(buf, size, pos, "()");
-        break;
+    if (length)
+        *length = read;
+    return buffer;
+}
 
-    case TYPE_CONS:
+// Evaluates every expression in buffer, printing each result to interp->out.
+// Returns false if the input could not be parsed.
+bool eval_buffer(const char *buffer, Env *env)
+{
+    const char *ptr = buffer;
+    while (*ptr != '\0')
     {
-        append_to_buffer(buf, size, pos, "(");
-        SExpr *cur = sexp;
-        while (cur && cur->type == TYPE_CONS)
-        {
-            sexp_to_string_internal(cur->cons.car, buf, size, pos);
-            cur = cur->cons.cdr;
-            if (cur && cur->type == TYPE_CONS)
-            {
-                append_to_buffer(buf, size, pos, " ");
-            }
-        }
-        if (cur && cur->type != TYPE_NIL)
+        // Skip whitespace before parsing next expression
+        while (*ptr && isspace(*ptr))
+            ptr++;
+
+        if (*ptr == '\0')
+            break;
+
+        SExpr *sexpr = parseSExpr(&ptr);
+        if (!sexpr)
         {
-            append_to_buffer(buf, size, pos, " . ");
-            sexp_to_string_internal(cur, buf, size, pos);
+            fprintf(interp->out, "Parse error\n");
+            return false;
         }
-        append_to_buffer(buf, size, pos, ")");
-        break;
-    }
 
-    default:
-        append_to_buffer(buf, size, pos, "<unknown>");
-        break;
+        SExpr *result = eval(sexpr, env);
+        fprintSExpr(interp->out, result);
+        fputc('\n', interp->out);
     }
-}
 
-void sexp_to_string(SExpr *sexp, char *buf, size_t size)
-{
-    size_t pos = 0;
-    if (size == 0)
-        return;
-    sexp_to_string_internal(sexp, buf, size, &pos);
-    buf[pos < size ? pos : size - 1] = '\0'; // Null-terminate safely
+    return true;
 }
 
-
 #endif // UTILS_H
\ No newline at end of file
@@ -0,0 +1,353 @@
+#ifndef YISP_H
+#define YISP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "sexpr.h"
+#include "utils.h"
+#include "profile.h"
+#include "pmap.h"
+
+// ==================== EMBEDDING API ====================
+
+// Lets a host program evaluate Yisp without the REPL: open an interpreter,
+// load definitions, compile a rule once into a YispFn, then bind values into
+// its slots and call it as often as needed. Results come back as YispValue.
+//
+//     Yisp *y = yisp_open();
+//     yisp_load(y, "(define (score price qty) (mul price qty))");
+//     YispFn *fn = yisp_compile(y, "score", NULL, 0);
+//     yisp_bind_number(fn, 0, 9.5);
+//     yisp_bind_number(fn, 1, 3);
+//     YispValue v;
+//     if (yisp_call(fn, &v))
+//         printf("%g\n", v.number);
+//     yisp_close(y);
+//
+// A call that neither sets a binding nor interns a symbol leaves nothing
+// behind: its frames and temporaries are released when it returns, so calling
+// in a loop runs in constant memory. Every function enters the interpreter it
+// is given, so each Yisp must only be used by one thread at a time.
+
+typedef enum YispType
+{
+    YISP_NIL,
+    YISP_NUMBER,
+    YISP_STRING,
+    YISP_SYMBOL,
+    YISP_LIST,
+} YispType;
+
+typedef struct YispValue
+{
+    YispType type;
+    double number;    // for YISP_NUMBER
+    const char *text; // string contents, symbol name, or printed list; valid until the next call.
+                      // Printed lists are cut off at YISP_TEXT_MAX - 1 characters.
+} YispValue;
+
+typedef struct YispFn YispFn;
+
+typedef struct Yisp
+{
+    Interp *interp;
+    char *error; // message of the last failed operation
+    size_t error_len;
+    FILE *errors;
+    char *text; // backing store of YispValue.text
+    size_t text_len;
+    size_t text_capacity;
+    ArenaMark mark; // taken before each call, kept here to survive an error
+    YispFn *fns;
+} Yisp;
+
+struct YispFn
+{
+    Yisp *owner;
+    SExpr *lambda;
+    const char *name; // reported to the profiler
+    size_t slot_count;
+    SExpr *slots;     // one preallocated value cell per slot
+    char **strings;   // string storage of each slot
+    SExpr *args;      // argument list made of the slot cells
+    struct YispFn *next;
+};
+
+// Room for the text of one result; longer text is truncated
+#define YISP_TEXT_MAX 4096
+
+Yisp *yisp_open()
+{
+    Yisp *y = calloc(1, sizeof(Yisp));
+    y->interp = interp_new();
+    y->errors = open_memstream(&y->error, &y->error_len);
+    y->interp->err = y->errors;
+    return y;
+}
+
+void yisp_close(Yisp *y)
+{
+    YispFn *fn = y->fns;
+    while (fn)
+    {
+        YispFn *next = fn->next;
+        for (size_t i = 0; i < fn->slot_count; i++)
+            free(fn->strings[i]);
+        free(fn->strings);
+        free(fn);
+        fn = next;
+    }
+
+    interp_free(y->interp);
+    fclose(y->errors);
+    free(y->error);
+    free(y->text);
+    free(y);
+}
+
+// Message of the last failed operation, without the "Error: " prefix
+const char *yisp_error_message(Yisp *y)
+{
+    fflush(y->errors);
+    if (y->error_len == 0)
+        return "";
+
+    // A shorter message written over a longer one is not terminated
+    y->error[y->error_len] = '\0';
+    char *message = y->error;
+    if (strncmp(message, "Error: ", 7) == 0)
+        message += 7;
+    size_t len = strlen(message);
+    if (len > 0 && message[len - 1] == '\n')
+        message[len - 1] = '\0';
+    return message;
+}
+
+static void yisp_clear_error(Yisp *y)
+{
+    fflush(y->errors);
+    rewind(y->errors);
+    fflush(y->errors);
+}
+
+static size_t yisp_store_text(Yisp *y, SExpr *value)
+{
+    if (y->text_len + YISP_TEXT_MAX > y->text_capacity)
+    {
+        y->text_capacity = y->text_capacity * 2 + YISP_TEXT_MAX;
+        y->text = realloc(y->text, y->text_capacity);
+    }
+
+    size_t offset = y->text_len;
+    if (value->type == TYPE_CONS)
+        sexp_to_string(value, y->text + offset, YISP_TEXT_MAX);
+    else
+        snprintf(y->text + offset, YISP_TEXT_MAX, "%s", value->string);
+    y->text_len += strlen(y->text + offset) + 1;
+    return offset;
+}
+
+// Converts a result; text is stored as an offset until the batch is done
+static void yisp_convert(Yisp *y, SExpr *value, YispValue *out, size_t *text_offset)
+{
+    memset(out, 0, sizeof(YispValue));
+    switch (value->type)
+    {
+    case TYPE_ATOM_NUMBER:
+        out->type = YISP_NUMBER;
+        out->number = value->number;
+        return;
+    case TYPE_NIL:
+        out->type = YISP_NIL;
+        return;
+    case TYPE_ATOM_STRING:
+        out->type = YISP_STRING;
+        break;
+    case TYPE_ATOM_SYMBOL:
+        out->type = YISP_SYMBOL;
+        break;
+    default:
+        out->type = YISP_LIST;
+        break;
+    }
+    *text_offset = yisp_store_text(y, value);
+}
+
+// Evaluates every form of source in the global environment, without printing
+bool yisp_load(Yisp *y, const char *source)
+{
+    Interp *saved = interp;
+    interp_enter(y->interp);
+    yisp_clear_error(y);
+
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    bool ok = setjmp(on_error) == 0;
+    if (ok)
+    {
+        const char *ptr = source;
+        while (true)
+        {
+            skipWhitespace(&ptr);
+            if (*ptr == '\0')
+                break;
+
+            SExpr *form = parseSExpr(&ptr);
+            if (!form)
+                yisp_error("cannot parse source");
+            eval(form, interp->global_env);
+        }
+    }
+
+    interp->on_error = NULL;
+    interp_enter(saved);
+    return ok;
+}
+
+// Compiles source once. With slot names, source is an expression over those
+// names, bound in slot order; without, it must evaluate to a lambda (or name
+// one) and the slots are its parameters. Returns NULL on error.
+YispFn *yisp_compile(Yisp *y, const char *source, const char *const *slot_names, size_t slot_count)
+{
+    Interp *saved = interp;
+    interp_enter(y->interp);
+    yisp_clear_error(y);
+
+    YispFn *volatile fn = NULL;
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0)
+    {
+        const char *ptr = source;
+        SExpr *expr = parseSExpr(&ptr);
+        if (!expr)
+            yisp_error("cannot parse source");
+
+        const char *name = "<lambda>";
+        size_t count = slot_count;
+        SExpr *lambda;
+        if (slot_names)
+        {
+            SExpr *formals = nil();
+            for (size_t i = count; i-- > 0;)
+                formals = cons(symbol(slot_names[i]), formals);
+            lambda = cons(symbol("lambda"), cons(formals, cons(expr, nil())));
+            lambda = optimize_lambda(lambda, interp->global_env);
+        }
+        else
+        {
+            if (expr->type == TYPE_ATOM_SYMBOL)
+                name = expr->string;
+            lambda = eval(expr, interp->global_env);
+            if (!lambda || lambda->type != TYPE_CONS || car(lambda)->type != TYPE_ATOM_SYMBOL ||
+                strcmp(car(lambda)->string, "lambda") != 0)
+                yisp_error("source does not evaluate to a lambda");
+
+            count = 0;
+            for (SExpr *it = cadr(lambda); it->type == TYPE_CONS; it = it->cons.cdr)
+                count++;
+        }
+
+        YispFn *made = calloc(1, sizeof(YispFn));
+        made->owner = y;
+        made->lambda = lambda;
+        made->name = name;
+        made->slot_count = count;
+        made->slots = heap_alloc(HEAP_CONS, (count ? count : 1) * sizeof(SExpr));
+        made->strings = calloc(count ? count : 1, sizeof(char *));
+        made->args = nil();
+        for (size_t i = count; i-- > 0;)
+        {
+            made->slots[i].type = TYPE_NIL;
+            made->args = cons(&made->slots[i], made->args);
+        }
+
+        made->next = y->fns;
+        y->fns = made;
+        fn = made;
+    }
+
+    interp->on_error = NULL;
+    interp_enter(saved);
+    return fn;
+}
+
+void yisp_bind_number(YispFn *fn, size_t slot, double value)
+{
+    SExpr *cell = &fn->slots[slot];
+    cell->type = TYPE_ATOM_NUMBER;
+    cell->number = value;
+}
+
+// The string is copied; the slot keeps its own buffer between binds
+void yisp_bind_string(YispFn *fn, size_t slot, const char *value)
+{
+    SExpr *cell = &fn->slots[slot];
+    size_t len = strlen(value);
+    fn->strings[slot] = realloc(fn->strings[slot], len + 1);
+    memcpy(fn->strings[slot], value, len + 1);
+    cell->type = TYPE_ATOM_STRING;
+    cell->string = fn->strings[slot];
+}
+
+void yisp_bind_nil(YispFn *fn, size_t slot)
+{
+    fn->slots[slot].type = TYPE_NIL;
+}
+
+// Evaluates fn for rows of numeric inputs (row-major, slot_count per row),
+// storing one result per row. Stops at the first error and returns the number
+// of rows evaluated.
+size_t yisp_call_batch(YispFn *fn, const double *inputs, size_t rows, YispValue *results)
+{
+    Yisp *y = fn->owner;
+    Interp *saved = interp;
+    interp_enter(y->interp);
+    yisp_clear_error(y);
+    y->text_len = 0;
+
+    size_t *offsets = malloc((rows ? rows : 1) * sizeof(size_t));
+    volatile size_t done = 0;
+
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0)
+    {
+        for (size_t row = 0; row < rows; row++)
+        {
+            if (inputs)
+                for (size_t i = 0; i < fn->slot_count; i++)
+                    yisp_bind_number(fn, i, inputs[row * fn->slot_count + i]);
+
+            y->mark = arena_mark();
+            SExpr *value = apply_lambda(fn->lambda, fn->args, fn->name, interp->global_env);
+            yisp_convert(y, value, &results[row], &offsets[row]);
+            arena_release(&y->mark);
+            done = row + 1;
+        }
+    }
+    else
+    {
+        arena_release(&y->mark);
+    }
+
+    // Text is only placed once the buffer has stopped growing
+    for (size_t row = 0; row < done; row++)
+        if (results[row].type != YISP_NUMBER && results[row].type != YISP_NIL)
+            results[row].text = y->text + offsets[row];
+    free(offsets);
+
+    interp->on_error = NULL;
+    interp_enter(saved);
+    return done;
+}
+
+// Evaluates fn with the values currently bound to its slots
+bool yisp_call(YispFn *fn, YispValue *result)
+{
+    return yisp_call_batch(fn, NULL, 1, result) == 1;
+}
+
+#endif // YISP_H